@@ -0,0 +1,255 @@
+#include <sys/queue.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "config.h"
+#include "alloc.h"
+#include "util.h"
+#include "log.h"
+
+#ifdef HAVE_WORKER_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(EVENT__DISABLE_MM_REPLACEMENT) || \
+    defined(_EVENT_DISABLE_MM_REPLACEMENT)
+#define NO_MM_REPLACEMENT
+#endif
+
+/* size classes run from 64 bytes to 64k; bigger blocks aren't cached */
+#define MIN_CLASS_SHIFT 6
+#define NCLASSES 11
+#define class_size(i)	((size_t)1 << (MIN_CLASS_SHIFT + (i)))
+#define MAX_CLASS_SIZE	class_size(NCLASSES - 1)
+
+/* each block starts with the size it holds, and what follows is kept
+   aligned */
+#define HEADER_SIZE 16
+#define block_size(p)	(*(size_t *)((char *)(p) - HEADER_SIZE))
+
+/* a cached block links to the next through its first bytes */
+struct free_block {
+	struct free_block *next;
+};
+
+struct thread_cache {
+	TAILQ_ENTRY(thread_cache) next;
+	struct free_block *classes[NCLASSES];
+	struct alloc_stats stats;
+};
+TAILQ_HEAD(thread_cache_list, thread_cache);
+
+#ifdef HAVE_WORKER_THREADS
+/* a thread's counters are only written by that thread, but any may
+   read them */
+#define stat_get(p)	__atomic_load_n((p), __ATOMIC_RELAXED)
+#define stat_set(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+static pthread_key_t cache_key;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_cache_list caches = TAILQ_HEAD_INITIALIZER(caches);
+/* what threads that have since exited did */
+static struct alloc_stats retired;
+#else
+#define stat_get(p)	(*(p))
+#define stat_set(p, v)	(*(p) = (v))
+
+static struct thread_cache main_cache;
+#endif
+
+#ifndef NO_MM_REPLACEMENT
+static size_t cache_limit;
+static int installed;
+
+#ifdef HAVE_WORKER_THREADS
+/* the thread is exiting */
+static void
+cache_free(void *arg)
+{
+	struct thread_cache *c = arg;
+	struct free_block *b;
+	int i;
+
+	for (i = 0; i < NCLASSES; i++) {
+		while ((b = c->classes[i])) {
+			c->classes[i] = b->next;
+			free((char *)b - HEADER_SIZE);
+		}
+	}
+
+	pthread_mutex_lock(&caches_lock);
+	TAILQ_REMOVE(&caches, c, next);
+	retired.nallocs += c->stats.nallocs;
+	retired.ncached += c->stats.ncached;
+	pthread_mutex_unlock(&caches_lock);
+	mem_free(c);
+}
+
+static struct thread_cache *
+cache_get(void)
+{
+	struct thread_cache *c;
+
+	c = pthread_getspecific(cache_key);
+	if (c)
+		return c;
+
+	c = mem_calloc(1, sizeof(*c));
+	pthread_setspecific(cache_key, c);
+	pthread_mutex_lock(&caches_lock);
+	TAILQ_INSERT_TAIL(&caches, c, next);
+	pthread_mutex_unlock(&caches_lock);
+
+	return c;
+}
+#else
+#define cache_get()	(&main_cache)
+#endif
+
+static int
+size_class(size_t size)
+{
+	int i = 0;
+
+	while (class_size(i) < size)
+		i++;
+
+	return i;
+}
+
+static void *
+block_new(size_t size)
+{
+	char *p;
+
+	p = malloc(HEADER_SIZE + size);
+	if (!p)
+		return NULL;
+	*(size_t *)p = size;
+
+	return p + HEADER_SIZE;
+}
+
+static void *
+alloc_malloc(size_t size)
+{
+	struct thread_cache *c = cache_get();
+	struct free_block *b;
+	int i;
+
+	stat_set(&c->stats.nallocs, c->stats.nallocs + 1);
+	if (size > MAX_CLASS_SIZE)
+		return block_new(size);
+
+	i = size_class(size);
+	b = c->classes[i];
+	if (!b)
+		return block_new(class_size(i));
+
+	c->classes[i] = b->next;
+	stat_set(&c->stats.ncached, c->stats.ncached + 1);
+	stat_set(&c->stats.ncached_bytes,
+		 c->stats.ncached_bytes - class_size(i));
+
+	return b;
+}
+
+static void
+alloc_free(void *ptr)
+{
+	struct thread_cache *c;
+	struct free_block *b = ptr;
+	size_t size;
+	int i;
+
+	if (!ptr)
+		return;
+
+	size = block_size(ptr);
+	c = cache_get();
+	if (size > MAX_CLASS_SIZE ||
+	    c->stats.ncached_bytes + size > cache_limit) {
+		free((char *)ptr - HEADER_SIZE);
+		return;
+	}
+
+	i = size_class(size);
+	b->next = c->classes[i];
+	c->classes[i] = b;
+	stat_set(&c->stats.ncached_bytes, c->stats.ncached_bytes + size);
+}
+
+static void *
+alloc_realloc(void *ptr, size_t size)
+{
+	size_t old;
+	char *p;
+
+	if (!ptr)
+		return alloc_malloc(size);
+
+	old = block_size(ptr);
+	if (size <= old)
+		return ptr;
+
+	if (old > MAX_CLASS_SIZE) {
+		p = realloc((char *)ptr - HEADER_SIZE, HEADER_SIZE + size);
+		if (!p)
+			return NULL;
+		*(size_t *)p = size;
+		return p + HEADER_SIZE;
+	}
+
+	p = alloc_malloc(size);
+	if (!p)
+		return NULL;
+	memcpy(p, ptr, old);
+	alloc_free(ptr);
+
+	return p;
+}
+#endif
+
+int
+alloc_install(size_t cache_size)
+{
+#ifdef NO_MM_REPLACEMENT
+	return -1;
+#else
+	if (installed)
+		return -1;
+#ifdef HAVE_WORKER_THREADS
+	if (pthread_key_create(&cache_key, cache_free))
+		return -1;
+#endif
+	cache_limit = cache_size;
+	event_set_mem_functions(alloc_malloc, alloc_realloc, alloc_free);
+	installed = 1;
+	log_debug("alloc: caching up to %lu bytes per thread",
+		  (unsigned long)cache_size);
+
+	return 0;
+#endif
+}
+
+void
+alloc_get_stats(struct alloc_stats *stats)
+{
+#ifdef HAVE_WORKER_THREADS
+	struct thread_cache *c;
+
+	pthread_mutex_lock(&caches_lock);
+	*stats = retired;
+	TAILQ_FOREACH(c, &caches, next) {
+		stats->nallocs += stat_get(&c->stats.nallocs);
+		stats->ncached += stat_get(&c->stats.ncached);
+		stats->ncached_bytes += stat_get(&c->stats.ncached_bytes);
+	}
+	pthread_mutex_unlock(&caches_lock);
+#else
+	*stats = main_cache.stats;
+#endif
+}
@@ -0,0 +1,27 @@
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+#include <event2/util.h>
+
+/* An allocator for libevent's own memory: evbuffer chains, events and
+   bufferevents, which come and go with every read. Blocks are rounded
+   up to a power of two size class, and freed ones are kept in a cache
+   per thread for that thread's next block of the same class. A block
+   freed on another thread than the one it came from, say a buffer a
+   worker filled, just joins the freeing thread's cache. */
+
+struct alloc_stats {
+	ev_uint64_t nallocs;		/* blocks libevent asked for */
+	ev_uint64_t ncached;		/* ... that came from a cache */
+	size_t ncached_bytes;		/* kept in caches right now */
+};
+
+/* have libevent allocate through the caches, keeping up to cache_size
+   bytes per thread; 0 caches nothing and only counts. Call before
+   anything else uses libevent. -1 if libevent was built without
+   allocator replacement. */
+int alloc_install(size_t cache_size);
+
+void alloc_get_stats(struct alloc_stats *stats);
+
+#endif
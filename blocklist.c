@@ -0,0 +1,264 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/util.h>
+
+#include "config.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "blocklist.h"
+#include "util.h"
+#include "log.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+struct blocklist {
+	ev_uint64_t *slots;	/* name hashes, open addressed; 0 is empty */
+	size_t mask;
+	size_t count;
+};
+
+static int
+is_name_char(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	       (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_';
+}
+
+static unsigned char
+lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/* names are hashed from the right so every suffix of a host can be
+   looked up in one pass */
+static ev_uint64_t
+hash_step(ev_uint64_t h, char c)
+{
+	return (h ^ lower(c)) * FNV_PRIME;
+}
+
+static int
+set_contains(const struct blocklist *bl, ev_uint64_t h)
+{
+	size_t i;
+
+	if (!h)
+		h = 1;
+	for (i = h & bl->mask; bl->slots[i]; i = (i + 1) & bl->mask) {
+		if (bl->slots[i] == h)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+set_add(struct blocklist *bl, const char *name, size_t len)
+{
+	ev_uint64_t h = FNV_OFFSET;
+	size_t i;
+
+	while (len)
+		h = hash_step(h, name[--len]);
+	if (!h)
+		h = 1;
+
+	for (i = h & bl->mask; bl->slots[i]; i = (i + 1) & bl->mask) {
+		if (bl->slots[i] == h)
+			return;
+	}
+	bl->slots[i] = h;
+	bl->count++;
+}
+
+static const char *
+skip_space(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+	return p;
+}
+
+static const char *
+skip_word(const char *p, const char *end)
+{
+	while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+		p++;
+	return p;
+}
+
+static int
+is_address(const char *p, const char *end)
+{
+	for (; p < end; ++p) {
+		if (*p != '.' && *p != ':' && !(*p >= '0' && *p <= '9') &&
+		    !(*p >= 'a' && *p <= 'f') && !(*p >= 'A' && *p <= 'F'))
+			return 0;
+	}
+	return 1;
+}
+
+/* the host a list line names, if any */
+static int
+parse_line(const char *p, const char *end, const char **name, size_t *len)
+{
+	const char *e, *q;
+	int dots = 0;
+
+	p = skip_space(p, end);
+	if (p == end || *p == '#' || *p == '!')
+		return 0;
+
+	e = skip_word(p, end);
+	/* hosts file: an address, then the name */
+	q = skip_space(e, end);
+	if (q < end && *q != '#' && is_address(p, e)) {
+		p = q;
+		e = skip_word(p, end);
+	}
+
+	if (e - p > 2 && p[0] == '|' && p[1] == '|') {
+		p += 2;
+		if (e[-1] == '^')
+			e--;
+	}
+	while (p < e && (*p == '*' || *p == '.'))
+		p++;
+	while (e > p && e[-1] == '.')
+		e--;
+
+	for (q = p; q < e; ++q) {
+		if (!is_name_char(*q))
+			return 0;
+		dots += *q == '.';
+	}
+	if (!dots)
+		return 0;
+
+	*name = p;
+	*len = e - p;
+
+	return 1;
+}
+
+static struct blocklist *
+parse_list(const char *buf, size_t len)
+{
+	struct blocklist *bl;
+	const char *p, *end = buf + len, *eol, *name;
+	size_t nlines = 1, size, namelen;
+
+	for (p = buf; (p = memchr(p, '\n', end - p)); ++p)
+		nlines++;
+	/* keep the table at most half full */
+	for (size = 16; size < nlines * 2; size <<= 1)
+		;
+
+	bl = mem_calloc(1, sizeof(*bl));
+	bl->slots = mem_calloc(size, sizeof(*bl->slots));
+	bl->mask = size - 1;
+
+	for (p = buf; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		if (parse_line(p, eol, &name, &namelen))
+			set_add(bl, name, namelen);
+	}
+
+	return bl;
+}
+
+struct blocklist *
+blocklist_load(const char *path)
+{
+	struct blocklist *bl;
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		log_error("blocklist: can't open %s: %s", path,
+			  strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		return parse_list("", 0);
+	}
+
+#ifdef HAVE_MMAP
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED) {
+		log_error("blocklist: can't map %s: %s", path,
+			  strerror(errno));
+		return NULL;
+	}
+	bl = parse_list(buf, st.st_size);
+	munmap(buf, st.st_size);
+#else
+	buf = mem_malloc(st.st_size);
+	if (read(fd, buf, st.st_size) != st.st_size) {
+		log_error("blocklist: can't read %s: %s", path,
+			  strerror(errno));
+		close(fd);
+		mem_free(buf);
+		return NULL;
+	}
+	close(fd);
+	bl = parse_list(buf, st.st_size);
+	mem_free(buf);
+#endif
+
+	return bl;
+}
+
+void
+blocklist_free(struct blocklist *bl)
+{
+	if (!bl)
+		return;
+
+	mem_free(bl->slots);
+	mem_free(bl);
+}
+
+int
+blocklist_match(const struct blocklist *bl, const char *host)
+{
+	ev_uint64_t h = FNV_OFFSET;
+	const char *p;
+
+	p = host + strlen(host);
+	if (p > host && p[-1] == '.')
+		p--;
+
+	while (p > host) {
+		h = hash_step(h, *--p);
+		if ((p == host || p[-1] == '.') && set_contains(bl, h))
+			return 1;
+	}
+
+	return 0;
+}
+
+size_t
+blocklist_size(const struct blocklist *bl)
+{
+	return bl->count;
+}
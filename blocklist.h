@@ -0,0 +1,23 @@
+#ifndef _BLOCKLIST_H_
+#define _BLOCKLIST_H_
+
+#include <stddef.h>
+
+/* A set of blocked host names. Each name blocks itself and everything
+   under it: "ads.example.com" also blocks "x.ads.example.com". Only a
+   64 bit hash of each name is kept, so a list of 100k names costs about
+   2MB and a lookup is a hash probe per label of the host. */
+
+struct blocklist;
+
+/* One name per line. Hosts file lines ("0.0.0.0 ads.example.com") and
+   "||ads.example.com^" rules work too; comments start with '#' or '!'.
+   Lines that don't name a host with at least one dot are skipped.
+   NULL if the file can't be read. */
+struct blocklist *blocklist_load(const char *path);
+void blocklist_free(struct blocklist *bl);
+
+int blocklist_match(const struct blocklist *bl, const char *host);
+size_t blocklist_size(const struct blocklist *bl);
+
+#endif
@@ -0,0 +1,195 @@
+#include <sys/queue.h>
+#include <string.h>
+
+#include <event2/util.h>
+#include <event2/event.h>
+
+#include "breaker.h"
+#include "util.h"
+#include "log.h"
+
+/* how long a circuit first stays open, and the most it's doubled to */
+static struct timeval min_open_time = {10, 0};
+static struct timeval max_open_time = {300, 0};
+/* how long a half open circuit waits on the connection it let through
+   before letting another try */
+static struct timeval probe_timeout = {30, 0};
+
+#define MAX_CIRCUITS 256
+
+enum circuit_state {
+	CIRCUIT_CLOSED,
+	CIRCUIT_OPEN,
+	CIRCUIT_HALF_OPEN
+};
+
+/* only hosts that have failed lately have one */
+struct circuit {
+	TAILQ_ENTRY(circuit) next;
+	const char *host;		/* an atom */
+	int port;
+	enum circuit_state state;
+	unsigned nfailures;		/* in a row */
+	struct timeval open_time;
+	struct timeval until;		/* when the next connection may go */
+};
+TAILQ_HEAD(circuit_list, circuit);
+
+struct breaker {
+	struct event_base *base;
+	unsigned max_failures;
+	struct circuit_list circuits;	/* most recently used first */
+	size_t size;
+	struct breaker_stats stats;
+};
+
+static void
+circuit_free(struct breaker *b, struct circuit *c)
+{
+	TAILQ_REMOVE(&b->circuits, c, next);
+	b->size--;
+	if (c->state != CIRCUIT_CLOSED)
+		b->stats.nopen--;
+	host_atom_unref(c->host);
+	mem_free(c);
+}
+
+static struct circuit *
+circuit_find(struct breaker *b, const char *host, int port)
+{
+	struct circuit *c;
+
+	TAILQ_FOREACH(c, &b->circuits, next) {
+		if (c->host == host && c->port == port)
+			break;
+	}
+	if (!c)
+		return NULL;
+
+	TAILQ_REMOVE(&b->circuits, c, next);
+	TAILQ_INSERT_HEAD(&b->circuits, c, next);
+
+	return c;
+}
+
+static void
+circuit_open(struct breaker *b, struct circuit *c)
+{
+	struct timeval now;
+
+	if (c->state == CIRCUIT_CLOSED)
+		b->stats.nopen++;
+	b->stats.ntripped++;
+	c->state = CIRCUIT_OPEN;
+	event_base_gettimeofday_cached(b->base, &now);
+	evutil_timeradd(&now, &c->open_time, &c->until);
+	log_notice("breaker: %s:%d keeps failing; failing its requests "
+		   "for %ld seconds", log_scrub(c->host), c->port,
+		   (long)c->open_time.tv_sec);
+}
+
+struct breaker *
+breaker_new(struct event_base *base, unsigned max_failures)
+{
+	struct breaker *b;
+
+	b = mem_calloc(1, sizeof(*b));
+	b->base = base;
+	b->max_failures = max_failures ? max_failures : 1;
+	TAILQ_INIT(&b->circuits);
+
+	return b;
+}
+
+void
+breaker_free(struct breaker *b)
+{
+	struct circuit *c;
+
+	if (!b)
+		return;
+
+	while ((c = TAILQ_FIRST(&b->circuits)))
+		circuit_free(b, c);
+	mem_free(b);
+}
+
+int
+breaker_allow(struct breaker *b, const char *host, int port)
+{
+	struct circuit *c;
+	struct timeval now;
+
+	c = circuit_find(b, host, port);
+	if (!c || c->state == CIRCUIT_CLOSED)
+		return 0;
+
+	event_base_gettimeofday_cached(b->base, &now);
+	if (evutil_timercmp(&now, &c->until, <)) {
+		b->stats.nrefused++;
+		return -1;
+	}
+
+	/* let this one through, and no other until it's done */
+	log_debug("breaker: trying %s:%d again", log_scrub(host), port);
+	c->state = CIRCUIT_HALF_OPEN;
+	evutil_timeradd(&now, &probe_timeout, &c->until);
+
+	return 0;
+}
+
+void
+breaker_connected(struct breaker *b, const char *host, int port)
+{
+	struct circuit *c;
+
+	c = circuit_find(b, host, port);
+	if (!c)
+		return;
+
+	if (c->state != CIRCUIT_CLOSED)
+		log_notice("breaker: %s:%d is back", log_scrub(host), port);
+	circuit_free(b, c);
+}
+
+void
+breaker_failed(struct breaker *b, const char *host, int port)
+{
+	struct circuit *c;
+
+	c = circuit_find(b, host, port);
+	if (!c) {
+		if (b->size == MAX_CIRCUITS)
+			circuit_free(b, TAILQ_LAST(&b->circuits,
+						   circuit_list));
+		c = mem_calloc(1, sizeof(*c));
+		c->host = host_atom_ref(host);
+		c->port = port;
+		TAILQ_INSERT_HEAD(&b->circuits, c, next);
+		b->size++;
+	}
+
+	switch (c->state) {
+	case CIRCUIT_CLOSED:
+		if (++c->nfailures < b->max_failures)
+			break;
+		c->open_time = min_open_time;
+		circuit_open(b, c);
+		break;
+	case CIRCUIT_HALF_OPEN:
+		evutil_timeradd(&c->open_time, &c->open_time, &c->open_time);
+		if (evutil_timercmp(&c->open_time, &max_open_time, >))
+			c->open_time = max_open_time;
+		circuit_open(b, c);
+		break;
+	case CIRCUIT_OPEN:
+		/* tried before the circuit opened */
+		break;
+	}
+}
+
+void
+breaker_get_stats(struct breaker *b, struct breaker_stats *stats)
+{
+	*stats = b->stats;
+}
@@ -0,0 +1,36 @@
+#ifndef _BREAKER_H_
+#define _BREAKER_H_
+
+#include <event2/util.h>
+
+/* Per host circuit breakers. A host:port whose connections keep failing
+   is given up on for a while (the circuit is open), and requests for it
+   are failed straight away rather than each waiting out a connect or
+   SOCKS failure of its own. After that, connections are let through one
+   at a time (half open): one that works closes the circuit again, one
+   that fails opens it for twice as long. */
+
+struct event_base;
+struct breaker;
+
+struct breaker_stats {
+	size_t nopen;			/* hosts given up on right now */
+	ev_uint64_t ntripped;		/* times a circuit opened */
+	ev_uint64_t nrefused;		/* connections failed straight away */
+};
+
+/* open a circuit after max_failures failed connections in a row */
+struct breaker *breaker_new(struct event_base *base, unsigned max_failures);
+void breaker_free(struct breaker *b);
+
+/* 0 if a connection to host:port may be tried now, -1 if it should be
+   failed without trying. */
+int breaker_allow(struct breaker *b, const char *host, int port);
+
+/* how a connection to host:port went */
+void breaker_connected(struct breaker *b, const char *host, int port);
+void breaker_failed(struct breaker *b, const char *host, int port);
+
+void breaker_get_stats(struct breaker *b, struct breaker_stats *stats);
+
+#endif
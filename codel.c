@@ -0,0 +1,132 @@
+#include <event2/util.h>
+
+#include "codel.h"
+
+static ev_int64_t
+tv_to_usec(const struct timeval *tv)
+{
+	return (ev_int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static ev_uint64_t
+isqrt(ev_uint64_t n)
+{
+	ev_uint64_t x = n, y = (n + 1) / 2;
+
+	while (y < x) {
+		x = y;
+		y = (x + n / x) / 2;
+	}
+
+	return x;
+}
+
+/* when to shed next: interval / sqrt(count) after t. count is scaled up
+   so the square root keeps some precision. */
+static void
+control_law(const struct codel_params *p, unsigned count,
+	    const struct timeval *t, struct timeval *next)
+{
+	ev_uint64_t usec;
+	struct timeval wait;
+
+	usec = tv_to_usec(&p->interval) * 1024 /
+	       isqrt((ev_uint64_t)count << 20);
+	wait.tv_sec = usec / 1000000;
+	wait.tv_usec = usec % 1000000;
+	evutil_timeradd(t, &wait, next);
+}
+
+/* 1 if the queue has been above target for an interval */
+static int
+above_target(struct codel *c, const struct codel_params *p,
+	     const struct timeval *now, const struct timeval *sojourn,
+	     size_t nleft)
+{
+	if (evutil_timercmp(sojourn, &p->target, <) || !nleft) {
+		evutil_timerclear(&c->first_above);
+		return 0;
+	}
+	if (!evutil_timerisset(&c->first_above)) {
+		evutil_timeradd(now, &p->interval, &c->first_above);
+		return 0;
+	}
+
+	return !evutil_timercmp(now, &c->first_above, <);
+}
+
+int
+codel_should_shed(struct codel *c, const struct codel_params *p,
+		  const struct timeval *now, const struct timeval *sojourn,
+		  size_t nleft)
+{
+	struct timeval since;
+	unsigned delta;
+
+	if (!above_target(c, p, now, sojourn, nleft)) {
+		c->shedding = 0;
+		return 0;
+	}
+
+	if (c->shedding) {
+		if (evutil_timercmp(now, &c->shed_next, <))
+			return 0;
+		c->count++;
+		control_law(p, c->count, &c->shed_next, &c->shed_next);
+		return 1;
+	}
+
+	/* if shedding stopped only a little while ago, start again at about
+	   the rate it had got to */
+	c->shedding = 1;
+	delta = c->count - c->lastcount;
+	evutil_timersub(now, &c->shed_next, &since);
+	if (delta > 1 && tv_to_usec(&since) < 16 * tv_to_usec(&p->interval))
+		c->count = delta;
+	else
+		c->count = 1;
+	control_law(p, c->count, now, &c->shed_next);
+	c->lastcount = c->count;
+
+	return 1;
+}
+
+#ifdef TEST_CODEL
+/* a queue that's served every 10ms, with items arriving every 9ms, so
+   the wait keeps growing; prints when items are shed. the target is
+   50ms and the interval 500ms. */
+#include <stdio.h>
+
+int
+main(int argc, char **argv)
+{
+	struct codel c = { {0, 0}, {0, 0}, 0, 0, 0 };
+	struct codel_params p = { {0, 50000}, {0, 500000} };
+	struct timeval now, sojourn, arrived;
+	ev_int64_t in = 0, out = 0;
+	unsigned nshed = 0;
+
+	while (out < 5000000) {
+		out += 10000;
+		in += 9000;
+		if (in > out)
+			in = out;
+		now.tv_sec = out / 1000000;
+		now.tv_usec = out % 1000000;
+		arrived.tv_sec = in / 1000000;
+		arrived.tv_usec = in % 1000000;
+		evutil_timersub(&now, &arrived, &sojourn);
+		if (codel_should_shed(&c, &p, &now, &sojourn, 1)) {
+			nshed++;
+			printf("%ld.%03ld: shed after %ld ms (%u)\n",
+			       (long)now.tv_sec, (long)now.tv_usec / 1000,
+			       (long)(tv_to_usec(&sojourn) / 1000), c.count);
+			/* the next item steps up */
+			in += 9000;
+		}
+	}
+	printf("%u shed\n", nshed);
+
+	return 0;
+}
+#endif
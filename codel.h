@@ -0,0 +1,33 @@
+#ifndef _CODEL_H_
+#define _CODEL_H_
+
+#include <event2/util.h>
+
+/* CoDel style queue management. How long each item waited in its queue
+   (its sojourn) is looked at as it leaves. Once sojourns have stayed
+   above target for a whole interval, the queue is standing rather than
+   draining a burst, and items are shed: the first straight away, each
+   next one sooner after the last (interval / sqrt(n)), until an item
+   gets through in under target or the queue empties. */
+
+struct codel_params {
+	struct timeval target;
+	struct timeval interval;
+};
+
+/* a queue's state; all zeros to start with */
+struct codel {
+	struct timeval first_above;	/* when above target is too long */
+	struct timeval shed_next;
+	unsigned count;			/* shed since shedding started */
+	unsigned lastcount;
+	int shedding;
+};
+
+/* an item leaves the queue at now after waiting sojourn, with nleft
+   others still behind it. 1 if it should be shed rather than served. */
+int codel_should_shed(struct codel *c, const struct codel_params *p,
+		      const struct timeval *now,
+		      const struct timeval *sojourn, size_t nleft);
+
+#endif
@@ -0,0 +1,502 @@
+#include <sys/queue.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+#include "config.h"
+#include "compress.h"
+#include "httpconn.h"
+#include "headers.h"
+#include "util.h"
+#include "log.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+static char *
+trim(char *p)
+{
+	char *e;
+
+	p += strspn(p, " \t");
+	e = p + strlen(p);
+	while (e > p && (e[-1] == ' ' || e[-1] == '\t'))
+		*--e = '\0';
+
+	return p;
+}
+
+int
+compress_accepted(struct header_list *headers)
+{
+	struct header *h;
+	char *val, *tok, *next, *params, *coding;
+	double q, gzip_q = -1, any_q = -1;
+
+	TAILQ_FOREACH(h, headers, next) {
+		if (evutil_ascii_strcasecmp(h->key, "Accept-Encoding"))
+			continue;
+		val = header_get_val(h);
+		for (tok = val; tok; tok = next) {
+			next = strchr(tok, ',');
+			if (next)
+				*next++ = '\0';
+			params = strchr(tok, ';');
+			if (params)
+				*params++ = '\0';
+			coding = trim(tok);
+
+			q = 1;
+			if (params) {
+				params = trim(params);
+				if ((params[0] == 'q' || params[0] == 'Q') &&
+				    params[1] == '=')
+					q = strtod(params + 2, NULL);
+			}
+			if (!evutil_ascii_strcasecmp(coding, "gzip") ||
+			    !evutil_ascii_strcasecmp(coding, "x-gzip"))
+				gzip_q = q;
+			else if (!strcmp(coding, "*"))
+				any_q = q;
+		}
+		mem_free(val);
+	}
+
+	q = gzip_q >= 0 ? gzip_q : any_q;
+
+	return q > 0;
+}
+
+#ifdef HAVE_ZLIB
+
+/* bodies known to be shorter than this aren't worth it */
+#define MIN_LENGTH 256
+
+/* how often the level is reconsidered, and how much of that time the
+   process can spend on the CPU before compression backs off a level, or
+   be under before it steps back up */
+static struct timeval load_interval = {1, 0};
+#define BUSY_PERCENT 70
+#define IDLE_PERCENT 30
+
+/* bodies may be compressed on worker threads */
+#ifdef HAVE_WORKER_THREADS
+#define stat_add(p, n)	__atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#define stat_get(p)	__atomic_load_n((p), __ATOMIC_RELAXED)
+#define ref_drop(p)	__atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#else
+#define stat_add(p, n)	(*(p) += (n))
+#define stat_get(p)	(*(p))
+#define ref_drop(p)	(--*(p))
+#endif
+
+/* types worth compressing besides text/ */
+static const char *text_types[] = {
+	"application/javascript",
+	"application/x-javascript",
+	"application/ecmascript",
+	"application/json",
+	"application/xml",
+	"image/svg+xml",
+	NULL
+};
+
+static int
+is_text(const char *type)
+{
+	size_t len = strlen(type);
+	int i;
+
+	if (!evutil_ascii_strncasecmp(type, "text/", 5))
+		/* compressing holds events back */
+		return evutil_ascii_strcasecmp(type, "text/event-stream");
+	if (len > 5 && !evutil_ascii_strcasecmp(type + len - 5, "+json"))
+		return 1;
+	if (len > 4 && !evutil_ascii_strcasecmp(type + len - 4, "+xml"))
+		return 1;
+	for (i = 0; text_types[i]; ++i) {
+		if (!evutil_ascii_strcasecmp(type, text_types[i]))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int
+worth_compressing(struct header_list *headers)
+{
+	char *val, *p;
+	int ok;
+
+	if (headers_has_key(headers, "Content-Range") ||
+	    headers_has_token(headers, "Cache-Control", "no-transform"))
+		return 0;
+
+	val = headers_find(headers, "Content-Encoding");
+	if (val) {
+		ok = !evutil_ascii_strcasecmp(trim(val), "identity");
+		mem_free(val);
+		if (!ok)
+			return 0;
+	}
+
+	val = headers_find(headers, "Content-Length");
+	if (val) {
+		ok = get_int(val, 10) >= MIN_LENGTH;
+		mem_free(val);
+		if (!ok)
+			return 0;
+	}
+
+	val = headers_find(headers, "Content-Type");
+	if (!val)
+		return 0;
+	p = strchr(val, ';');
+	if (p)
+		*p = '\0';
+	ok = is_text(trim(val));
+	mem_free(val);
+
+	return ok;
+}
+
+/* the compressed body is a different representation, so a strong
+   validator for the original no longer holds */
+static void
+weaken_etags(struct header_list *headers)
+{
+	struct header *h;
+	char *val, *weak;
+	size_t len;
+
+	TAILQ_FOREACH(h, headers, next) {
+		if (evutil_ascii_strcasecmp(h->key, "ETag"))
+			continue;
+		val = header_get_val(h);
+		if (strncmp(val, "W/", 2)) {
+			len = strlen(val) + 2;
+			weak = mem_malloc(len + 1);
+			evutil_snprintf(weak, len + 1, "W/%s", val);
+			header_set_val(h, weak, len);
+			mem_free(weak);
+		}
+		mem_free(val);
+	}
+}
+
+struct compressor {
+	int refs;			/* the proxy's, and a stream's each */
+	int max_level;
+	int level;
+	struct timeval window_start;
+	ev_uint64_t window_cpu;
+	struct compressor_stats stats;
+};
+
+struct stream {
+	struct compressor *c;
+	z_stream z;
+};
+
+static void
+compressor_unref(struct compressor *c)
+{
+	if (!ref_drop(&c->refs))
+		mem_free(c);
+}
+
+static voidpf
+zalloc(voidpf opaque, uInt items, uInt size)
+{
+	return mem_calloc(items, size);
+}
+
+static void
+zfree(voidpf opaque, voidpf p)
+{
+	mem_free(p);
+}
+
+/* CPU time used by this thread, or failing that the process */
+static ev_uint64_t
+cpu_usec(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		return ts.tv_sec * (ev_uint64_t)1000000 + ts.tv_nsec / 1000;
+#endif
+	return (double)clock() * 1000000 / CLOCKS_PER_SEC;
+}
+
+/* look at how busy the loop's thread, which calls this, has been since
+   last time. the process's CPU time would count workers compressing in
+   parallel as the loop being busy. */
+static void
+adjust_level(struct compressor *c)
+{
+	struct timeval now, elapsed;
+	ev_uint64_t cpu = cpu_usec();
+	long usec, busy;
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, &c->window_start, &elapsed);
+	if (evutil_timercmp(&elapsed, &load_interval, <))
+		return;
+
+	usec = elapsed.tv_sec * 1000000 + elapsed.tv_usec;
+	busy = (cpu - c->window_cpu) * 100 / usec;
+	c->window_start = now;
+	c->window_cpu = cpu;
+
+	if (busy > BUSY_PERCENT && c->level > 1) {
+		c->level--;
+		log_debug("compress: %ld%% busy, down to level %d", busy,
+			  c->level);
+	} else if (busy < IDLE_PERCENT && c->level < c->max_level) {
+		c->level++;
+		log_debug("compress: %ld%% busy, up to level %d", busy,
+			  c->level);
+	}
+}
+
+/* deflate all of in into out */
+static int
+stream_deflate(struct stream *s, struct evbuffer *in, struct evbuffer *out,
+	       int flush)
+{
+	struct compressor *c = s->c;
+	struct evbuffer_iovec v, o;
+	ev_uint64_t start = cpu_usec(), nin = 0, nout = 0;
+	int rv, last;
+
+	do {
+		if (evbuffer_peek(in, -1, NULL, &v, 1) < 1) {
+			v.iov_base = NULL;
+			v.iov_len = 0;
+		}
+		last = v.iov_len == evbuffer_get_length(in);
+		s->z.next_in = v.iov_base;
+		s->z.avail_in = v.iov_len;
+		do {
+			evbuffer_reserve_space(out, 4096, &o, 1);
+			s->z.next_out = o.iov_base;
+			s->z.avail_out = o.iov_len;
+			rv = deflate(&s->z, last ? flush : Z_NO_FLUSH);
+			if (rv == Z_STREAM_ERROR)
+				return -1;
+			o.iov_len -= s->z.avail_out;
+			evbuffer_commit_space(out, &o, 1);
+			nout += o.iov_len;
+		} while (!s->z.avail_out);
+		evbuffer_drain(in, v.iov_len);
+		nin += v.iov_len;
+	} while (!last);
+
+	stat_add(&c->stats.nbytes_in, nin);
+	stat_add(&c->stats.nbytes_out, nout);
+	stat_add(&c->stats.nusec, cpu_usec() - start);
+
+	return 0;
+}
+
+static int
+compress_init(void **state, struct header_list *headers, void *arg)
+{
+	struct compressor *c = arg;
+	struct stream *s;
+
+	if (!worth_compressing(headers))
+		return 0;
+
+	adjust_level(c);
+	s = mem_calloc(1, sizeof(*s));
+	s->c = c;
+	s->z.zalloc = zalloc;
+	s->z.zfree = zfree;
+	/* 16 on top of the window bits asks for a gzip wrapper */
+	if (deflateInit2(&s->z, c->level, Z_DEFLATED, 15 + 16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
+		mem_free(s);
+		return -1;
+	}
+	stat_add(&c->refs, 1);
+
+	headers_remove(headers, "Content-Encoding");
+	headers_add_key_val(headers, "Content-Encoding", "gzip");
+	if (!headers_has_token(headers, "Vary", "Accept-Encoding") &&
+	    !headers_has_token(headers, "Vary", "*"))
+		headers_add_key_val(headers, "Vary", "Accept-Encoding");
+	weaken_etags(headers);
+	stat_add(&c->stats.nresponses, 1);
+	*state = s;
+
+	return 1;
+}
+
+/* flush each piece, so a body trickling in isn't held back */
+static int
+compress_process(void *state, struct evbuffer *in, struct evbuffer *out)
+{
+	return stream_deflate(state, in, out, Z_SYNC_FLUSH);
+}
+
+static void
+compress_free(void *state)
+{
+	struct stream *s = state;
+	struct compressor *c = s->c;
+
+	deflateEnd(&s->z);
+	mem_free(s);
+	compressor_unref(c);
+}
+
+static int
+compress_finish(void *state, struct evbuffer *in, struct evbuffer *out)
+{
+	struct stream *s = state;
+	int rv;
+
+	rv = stream_deflate(s, in, out, Z_FINISH);
+	compress_free(s);
+
+	return rv;
+}
+
+static const struct http_filter compress_filter = {
+	"gzip",
+	compress_init,
+	compress_process,
+	compress_finish,
+	compress_free,
+	1,
+	1
+};
+
+struct compressor *
+compressor_new(int max_level)
+{
+	struct compressor *c;
+
+	c = mem_calloc(1, sizeof(*c));
+	c->refs = 1;
+	c->max_level = max_level;
+	c->level = max_level;
+	evutil_gettimeofday(&c->window_start, NULL);
+	c->window_cpu = cpu_usec();
+
+	return c;
+}
+
+void
+compressor_free(struct compressor *c)
+{
+	if (c)
+		compressor_unref(c);
+}
+
+void
+compressor_add_filter(struct compressor *c, struct http_conn *conn)
+{
+	http_conn_add_filter(conn, &compress_filter, c);
+}
+
+void
+compressor_get_stats(struct compressor *c, struct compressor_stats *stats)
+{
+	stats->nresponses = stat_get(&c->stats.nresponses);
+	stats->nbytes_in = stat_get(&c->stats.nbytes_in);
+	stats->nbytes_out = stat_get(&c->stats.nbytes_out);
+	stats->nusec = stat_get(&c->stats.nusec);
+	stats->level = c->level;
+}
+
+#else
+
+struct compressor *
+compressor_new(int max_level)
+{
+	log_error("compress: shim was built without zlib");
+
+	return NULL;
+}
+
+void
+compressor_free(struct compressor *c)
+{
+}
+
+void
+compressor_add_filter(struct compressor *c, struct http_conn *conn)
+{
+}
+
+void
+compressor_get_stats(struct compressor *c, struct compressor_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+#endif
+
+#ifdef TEST_COMPRESS
+/* gzips stdin to stdout as a text/plain body, so
+   ./test_compress < file | gunzip | cmp - file
+   should be quiet. the stats go to stderr. */
+#include <stdio.h>
+
+int
+main(int argc, char **argv)
+{
+	struct compressor *c;
+	struct compressor_stats stats;
+	struct header_list headers;
+	struct evbuffer *in, *out;
+	char buf[8192];
+	void *state;
+	size_t n;
+
+	c = compressor_new(argc > 1 ? atoi(argv[1]) : 6);
+	if (!c)
+		return 1;
+	TAILQ_INIT(&headers);
+	headers_add_key_val(&headers, "Content-Type",
+			    "text/plain; charset=utf-8");
+	if (compress_filter.init(&state, &headers, c) != 1)
+		return 1;
+
+	in = evbuffer_new();
+	out = evbuffer_new();
+	while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+		evbuffer_add(in, buf, n);
+		if (compress_filter.process(state, in, out) < 0)
+			return 1;
+		evbuffer_write(out, 1);
+	}
+	if (compress_filter.finish(state, in, out) < 0)
+		return 1;
+	while (evbuffer_get_length(out))
+		evbuffer_write(out, 1);
+
+	compressor_get_stats(c, &stats);
+	fprintf(stderr, "level %d: %lu -> %lu bytes (%.1f%%), %lu usec\n",
+		stats.level, (unsigned long)stats.nbytes_in,
+		(unsigned long)stats.nbytes_out,
+		stats.nbytes_in ? 100.0 * stats.nbytes_out / stats.nbytes_in :
+				  0.0,
+		(unsigned long)stats.nusec);
+
+	headers_clear(&headers);
+	evbuffer_free(in);
+	evbuffer_free(out);
+	compressor_free(c);
+
+	return 0;
+}
+#endif
@@ -0,0 +1,39 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <event2/util.h>
+
+/* gzip for response bodies on their way to the client, when the origin
+   sent text uncompressed. Bodies that are already encoded, aren't text,
+   are ranges, or are too short to be worth it are left alone. New bodies
+   start at the current level, which steps down from the configured one
+   while the event loop is busy and back up once it isn't, so compressing
+   gives way when the CPU is needed for relaying. */
+
+struct header_list;
+struct http_conn;
+struct compressor;
+
+struct compressor_stats {
+	ev_uint64_t nresponses;		/* bodies compressed */
+	ev_uint64_t nbytes_in;		/* body bytes before compression */
+	ev_uint64_t nbytes_out;		/* ... and after */
+	ev_uint64_t nusec;		/* CPU time spent compressing */
+	int level;			/* what new bodies get right now */
+};
+
+/* max_level is 1 to 9. NULL if shim was built without zlib. */
+struct compressor *compressor_new(int max_level);
+/* bodies already being compressed keep it until they're done */
+void compressor_free(struct compressor *c);
+
+/* does a request's Accept-Encoding take gzip? */
+int compress_accepted(struct header_list *headers);
+/* compress the next response conn writes, if it's worth it. it must
+   have a body. */
+void compressor_add_filter(struct compressor *c, struct http_conn *conn);
+
+void compressor_get_stats(struct compressor *c,
+			  struct compressor_stats *stats);
+
+#endif
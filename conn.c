@@ -15,35 +15,40 @@
 #include "util.h"
 #include "log.h"
 
+struct socks_server {
+	enum socks_ver ver;
+	struct sockaddr_storage addr;
+	int addr_len;
+};
+
 struct conninfo {
 	enum socks_ver socks;
 	struct bufferevent *bev;
 	void *cbarg;
+	struct evbuffer *early;		/* ours */
 	int connecting;
 	conn_connectcb on_connect;
 	/* for socks... */
-	char *host;
+	const char *host;		/* an atom */
 	int port;
 	struct sockaddr_storage addr;
 	int addr_len;
+	struct sockaddr_storage socks_addr;
+	int socks_addr_len;
 };
 
-static enum socks_ver use_socks = SOCKS_NONE;
-static struct sockaddr_storage socks_addr;
-static int socks_addr_len = sizeof(socks_addr);
-static char *conn_error_string = NULL;
-
 static void
 finish_connection(struct conninfo *info, int ok, const char *reason)
 {
-	mem_free(conn_error_string);
-	conn_error_string = NULL;
-	if (!ok)
-		conn_error_string = mem_strdup(reason);
 	bufferevent_disable(info->bev, EV_READ);
 	bufferevent_setcb(info->bev, NULL, NULL, NULL, NULL);
-	info->on_connect(info->bev, ok, info->cbarg);
-	mem_free(info->host);
+	if (info->early) {
+		if (ok)
+			bufferevent_write_buffer(info->bev, info->early);
+		evbuffer_free(info->early);
+	}
+	info->on_connect(info->bev, ok, ok ? NULL : reason, info->cbarg);
+	host_atom_unref(info->host);
 	mem_free(info);
 }
 
@@ -56,6 +61,7 @@ write_socks_request(struct conninfo *info)
 		if (info->addr.ss_family != AF_INET) {
 			finish_connection(info, 0,
 				"SOCKS 4 can't handle ipv6!");
+			return;
 		}
 
 		/* connection request */
@@ -76,6 +82,13 @@ write_socks_request(struct conninfo *info)
 		bufferevent_write(info->bev, info->host, strlen(info->host)+1);
 	}
 
+	/* in the same segment as the request, ideally */
+	if (info->early && evbuffer_get_length(info->early)) {
+		log_debug("conn: sending %lu bytes of early data",
+			  (unsigned long)evbuffer_get_length(info->early));
+		bufferevent_write_buffer(info->bev, info->early);
+	}
+
 	bufferevent_enable(info->bev, EV_READ);
 }
 
@@ -159,8 +172,8 @@ void socks_resolvecb(int result, struct evutil_addrinfo *ai, void *arg)
 		memcpy(&info->addr, ai->ai_addr, ai->ai_addrlen);
 		info->addr_len = ai->ai_addrlen;
 		bufferevent_socket_connect(info->bev,
-					   (struct sockaddr*)&socks_addr,
-					   socks_addr_len);
+					   (struct sockaddr*)&info->socks_addr,
+					   info->socks_addr_len);
 	}
 
 	if (ai)
@@ -169,7 +182,9 @@ void socks_resolvecb(int result, struct evutil_addrinfo *ai, void *arg)
 
 int
 conn_connect_bufferevent(struct bufferevent *bev, struct evdns_base *dns,
+			 const struct socks_server *socks,
 			 int family, const char *name, int port,
+			 struct evbuffer **early,
 			 conn_connectcb conncb, void *arg)
 {
 	struct conninfo *info;
@@ -180,17 +195,23 @@ conn_connect_bufferevent(struct bufferevent *bev, struct evdns_base *dns,
 	info->bev = bev;
 	info->on_connect = conncb;
 	info->cbarg = arg;
+	if (early)
+		*early = info->early = evbuffer_new();
 	info->connecting = 1;
-	info->socks = use_socks;
+	info->socks = SOCKS_NONE;
 
 	bufferevent_setcb(bev, conn_readcb, NULL, conn_errorcb, info);
-	if (use_socks != SOCKS_NONE) {
-		info->host = mem_strdup(name);
+	if (socks) {
+		/* copy the server; it may go away before we're done */
+		info->socks = socks->ver;
+		memcpy(&info->socks_addr, &socks->addr, socks->addr_len);
+		info->socks_addr_len = socks->addr_len;
+		info->host = host_atom(name);
 		info->port = port;
-		if (use_socks == SOCKS_4a) {
+		if (info->socks == SOCKS_4a) {
 			rv = bufferevent_socket_connect(bev,
-					(struct sockaddr*)&socks_addr,
-					socks_addr_len);
+					(struct sockaddr*)&info->socks_addr,
+					info->socks_addr_len);
 			return rv;
 		}
 #ifndef DISABLE_DIRECT_CONNECTIONS
@@ -225,11 +246,11 @@ conn_connect_bufferevent(struct bufferevent *bev, struct evdns_base *dns,
 	return rv;
 }
 
-int
-conn_set_socks_server(const char *name, int port, enum socks_ver ver)
+struct socks_server *
+socks_server_new(const char *name, int port, enum socks_ver ver)
 {
 	int ret;
-	int rv = -1;	
+	struct socks_server *rv = NULL;
 	struct evutil_addrinfo *ai = NULL;
 	struct evutil_addrinfo hint;
 	char portstr[NI_MAXSERV];
@@ -245,13 +266,13 @@ conn_set_socks_server(const char *name, int port, enum socks_ver ver)
 
 	ret = evutil_getaddrinfo(name, portstr, &hint, &ai);
 	if (!ret) {
-		rv = 0;
-		memset(&socks_addr, 0, sizeof(socks_addr));
-		memcpy(&socks_addr, ai->ai_addr, ai->ai_addrlen);
-		socks_addr_len = ai->ai_addrlen;
-		use_socks = ver;
+		rv = mem_calloc(1, sizeof(*rv));
+		assert(ai->ai_addrlen <= sizeof(rv->addr));
+		memcpy(&rv->addr, ai->ai_addr, ai->ai_addrlen);
+		rv->addr_len = ai->ai_addrlen;
+		rv->ver = ver;
 		log_notice("conn: socks server set to %s",
-			   format_addr((struct sockaddr*)&socks_addr));
+			   format_addr((struct sockaddr*)&rv->addr));
 	} else {
 		log_error("conn: can't resolve socks server %s: %s",
 			  name, evutil_gai_strerror(ret));
@@ -263,17 +284,55 @@ conn_set_socks_server(const char *name, int port, enum socks_ver ver)
 	return rv;
 }
 
-const char *
-conn_get_connect_error(void)
+struct socks_server *
+socks_server_parse(const char *str)
+{
+	struct url *url;
+	enum socks_ver ver;
+	struct socks_server *server = NULL;
+
+	url = url_tokenize(str);
+	if (!url || !url->scheme) {
+		log_error("conn: bad socks server, %s", str);
+		goto out;
+	}
+	if (url->port < 0)
+		url->port = 1080;
+
+	if (!evutil_ascii_strcasecmp(url->scheme, "socks4"))
+		ver = SOCKS_4;
+	else if (!evutil_ascii_strcasecmp(url->scheme, "socks4a"))
+		ver = SOCKS_4a;
+	else {
+		log_error("conn: unknown socks version, %s", url->scheme);
+		goto out;
+	}
+
+	server = socks_server_new(url->host, url->port, ver);
+
+out:
+	url_free(url);
+
+	return server;
+}
+
+void
+socks_server_free(struct socks_server *socks)
+{
+	mem_free(socks);
+}
+
+enum socks_ver
+socks_server_get_version(const struct socks_server *socks)
 {
-	return conn_error_string;
+	return socks->ver;
 }
 
 #ifdef TEST_CONN
-void do_connect(struct bufferevent *bev, int ok, void *arg)
+void do_connect(struct bufferevent *bev, int ok, const char *err, void *arg)
 {
 	if (!ok) {
-		log_notice("conn: failed: %s", conn_get_connect_error());
+		log_notice("conn: failed: %s", err);
 	} else {
 		log_notice("conn: conn OK!");
 	}
@@ -286,6 +345,7 @@ int main(int argc, char **argv)
 	struct event_base *base;
 	struct bufferevent *bev;
 	struct url *socks, *host;
+	struct socks_server *server = NULL;
 	int s4;
 
 	base = event_base_new();
@@ -296,8 +356,9 @@ int main(int argc, char **argv)
 	if (argc >= 3) {
 		socks = url_tokenize(argv[2]);
 		s4 = !evutil_ascii_strcasecmp("socks4", socks->scheme);
-		if (conn_set_socks_server(socks->host, socks->port, s4?
-				SOCKS_4 : SOCKS_4a) < 0)
+		server = socks_server_new(socks->host, socks->port, s4?
+					  SOCKS_4 : SOCKS_4a);
+		if (!server)
 			return 0;
 	}
 	
@@ -305,8 +366,8 @@ int main(int argc, char **argv)
 
 	bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
 
-	conn_connect_bufferevent(bev, dns, AF_INET, host->host, host->port,
-				 do_connect, NULL);
+	conn_connect_bufferevent(bev, dns, server, AF_INET, host->host,
+				 host->port, NULL, do_connect, NULL);
 
 	event_base_dispatch(base);
 
@@ -7,16 +7,33 @@ enum socks_ver {
 	SOCKS_4a
 };
 
-/* called on connect completion with the bev, conn status (0 failed, 1 ok). */
+/* called on connect completion with the bev, conn status (0 failed, 1 ok)
+   and, on failure, a reason that is only valid during the call. */
 
 struct bufferevent;  
+struct evbuffer;
+struct evdns_base;
+struct socks_server;
  
-typedef void (*conn_connectcb)(struct bufferevent *bev, int ok, void *arg);
+typedef void (*conn_connectcb)(struct bufferevent *bev, int ok,
+			       const char *err, void *arg);
 
+/* socks may be NULL to connect directly. if early isn't NULL, *early is
+   set to a buffer for data for the far end: whatever is in it when the
+   SOCKS request goes out is sent right behind it, for servers that take
+   optimistic data (Tor does), and the rest once connected. the buffer
+   is freed before conncb is called. */
 int conn_connect_bufferevent(struct bufferevent *bev, struct evdns_base *dns,
+			     const struct socks_server *socks,
 			     int family, const char *name, int port,
+			     struct evbuffer **early,
 			     conn_connectcb conncb, void *arg);
-int conn_set_socks_server(const char *name, int port, enum socks_ver ver);
-const char *conn_get_connect_error(void);
+
+struct socks_server *socks_server_new(const char *name, int port,
+				      enum socks_ver ver);
+/* str looks like socks_version://address[:port]; NULL on error. */
+struct socks_server *socks_server_parse(const char *str);
+void socks_server_free(struct socks_server *socks);
+enum socks_ver socks_server_get_version(const struct socks_server *socks);
 
 #endif
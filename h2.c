@@ -0,0 +1,1462 @@
+#include <sys/queue.h>
+#include <assert.h>
+#include <string.h>
+
+#include <event2/util.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "h2.h"
+#include "hpack.h"
+#include "httpconn.h"
+#include "headers.h"
+#include "util.h"
+#include "log.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+/* what's left once the HTTP/1 parser has read the request line */
+#define H2_PREFACE_TAIL_LEN 6
+
+#define H2_FRAME_HEADER_LEN 9
+#define H2_DEFAULT_FRAME_SIZE 16384
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+
+enum h2_frame_type {
+	H2_DATA,
+	H2_HEADERS,
+	H2_PRIORITY,
+	H2_RST_STREAM,
+	H2_SETTINGS,
+	H2_PUSH_PROMISE,
+	H2_PING,
+	H2_GOAWAY,
+	H2_WINDOW_UPDATE,
+	H2_CONTINUATION
+};
+
+#define H2_FLAG_END_STREAM	0x01
+#define H2_FLAG_ACK		0x01
+#define H2_FLAG_END_HEADERS	0x04
+#define H2_FLAG_PADDED		0x08
+#define H2_FLAG_PRIORITY	0x20
+
+enum h2_error {
+	H2_NO_ERROR,
+	H2_PROTOCOL_ERROR,
+	H2_INTERNAL_ERROR,
+	H2_FLOW_CONTROL_ERROR,
+	H2_SETTINGS_TIMEOUT,
+	H2_STREAM_CLOSED,
+	H2_FRAME_SIZE_ERROR,
+	H2_REFUSED_STREAM,
+	H2_CANCEL,
+	H2_COMPRESSION_ERROR,
+	H2_CONNECT_ERROR,
+	H2_ENHANCE_YOUR_CALM
+};
+
+enum h2_setting {
+	H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+	H2_SETTINGS_ENABLE_PUSH,
+	H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+	H2_SETTINGS_INITIAL_WINDOW_SIZE,
+	H2_SETTINGS_MAX_FRAME_SIZE,
+	H2_SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+/* how many streams a client may have open at once */
+static ev_uint32_t max_concurrent_streams = 100;
+
+/* limits on a request's header block, compressed and decoded */
+static size_t max_header_block = 64 * 1024;
+static size_t max_header_list = 64 * 1024;
+
+/* response body we hold per stream while waiting on the peer's window */
+static size_t max_stream_backlog = 64 * 1024;
+
+/* max amount of frames we let sit on the session's outbuf */
+static size_t max_session_backlog = 128 * 1024;
+
+/* frames handled per read wakeup before yielding to the loop */
+static int max_frames_per_wakeup = 32;
+
+static struct timeval idle_session_timeout = {120, 0};
+static struct timeval flush_timeout = {30, 0};
+
+struct h2_frame {
+	size_t len;
+	int type;
+	int flags;
+	ev_uint32_t stream;
+};
+
+struct h2_stream {
+	TAILQ_ENTRY(h2_stream) next;
+	ev_uint32_t id;
+	struct h2_session *session;
+	struct bufferevent *bev;	/* our end of the pair */
+	struct http_conn *conn;		/* reads the proxy's response */
+	int is_head;
+	int is_connect;
+	int is_tunnel;			/* a CONNECT that got its 2xx */
+	int has_req_body;
+	int remote_closed;
+	int local_closed;
+	int response_started;
+	int response_done;
+	int conn_choked;
+	int read_paused;
+	ev_int64_t send_window;
+	ev_int64_t recv_window;
+	size_t recv_unacked;
+	struct evbuffer *outq;
+};
+TAILQ_HEAD(h2_stream_list, h2_stream);
+
+struct h2_session {
+	struct event_base *base;
+	struct bufferevent *bev;
+	const struct h2_cbs *cbs;
+	void *cbarg;
+	struct h2_stream_list streams;
+	size_t nstreams;
+	ev_uint32_t last_stream_id;
+	size_t preface_left;
+	struct hpack_table decoder;
+	struct evbuffer *hblock;	/* HEADERS waiting on CONTINUATION */
+	ev_uint32_t hblock_stream;
+	int hblock_end_stream;
+	struct evbuffer *scratch;
+	ev_uint32_t peer_max_frame;
+	ev_int64_t peer_initial_window;
+	ev_int64_t send_window;
+	ev_int64_t recv_window;
+	size_t recv_unacked;
+	int write_blocked;
+	int goaway_recv;
+	int closing;
+	int will_free;
+	struct event *process_ev;
+};
+
+/* a request being pulled out of a header block */
+struct h2_request {
+	char *method;
+	char *scheme;
+	char *authority;
+	char *path;
+	char *cookie;
+	struct header_list headers;
+	size_t size;
+	int regular_seen;
+	int malformed;
+};
+
+static void on_stream_error(struct http_conn *, enum http_conn_error, void *);
+static void on_stream_continuation(struct http_conn *, void *);
+static void on_stream_response(struct http_conn *, struct http_response *,
+			       void *);
+static void on_stream_read_body(struct http_conn *, struct evbuffer *, void *);
+static void on_stream_msg_complete(struct http_conn *, void *);
+static void on_stream_write_more(struct http_conn *, void *);
+static void on_stream_flush(struct http_conn *, void *);
+
+static const struct http_cbs stream_methods = {
+	0,
+	on_stream_error,
+	0,
+	on_stream_continuation,
+	on_stream_response,
+	on_stream_read_body,
+	on_stream_msg_complete,
+	on_stream_write_more,
+	on_stream_flush,
+	0
+};
+
+static void session_shutdown(struct h2_session *session, enum h2_error err);
+static void session_flush_streams(struct h2_session *session);
+
+static ev_uint32_t
+get32(const unsigned char *p)
+{
+	return ((ev_uint32_t)p[0] << 24) | ((ev_uint32_t)p[1] << 16) |
+	       ((ev_uint32_t)p[2] << 8) | p[3];
+}
+
+static void
+put32(unsigned char *p, ev_uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* frame output */
+
+static void
+send_frame_header(struct h2_session *session, size_t len, int type,
+		  int flags, ev_uint32_t stream)
+{
+	unsigned char hdr[H2_FRAME_HEADER_LEN];
+
+	hdr[0] = len >> 16;
+	hdr[1] = len >> 8;
+	hdr[2] = len;
+	hdr[3] = type;
+	hdr[4] = flags;
+	put32(hdr + 5, stream);
+	evbuffer_add(bufferevent_get_output(session->bev), hdr, sizeof(hdr));
+}
+
+static void
+send_frame(struct h2_session *session, int type, int flags,
+	   ev_uint32_t stream, const void *payload, size_t len)
+{
+	send_frame_header(session, len, type, flags, stream);
+	if (len)
+		evbuffer_add(bufferevent_get_output(session->bev),
+			     payload, len);
+}
+
+static void
+send_rst(struct h2_session *session, ev_uint32_t stream, enum h2_error err)
+{
+	unsigned char buf[4];
+
+	put32(buf, err);
+	send_frame(session, H2_RST_STREAM, 0, stream, buf, sizeof(buf));
+}
+
+static void
+send_window_update(struct h2_session *session, ev_uint32_t stream,
+		   ev_uint32_t inc)
+{
+	unsigned char buf[4];
+
+	put32(buf, inc);
+	send_frame(session, H2_WINDOW_UPDATE, 0, stream, buf, sizeof(buf));
+}
+
+static void
+send_settings(struct h2_session *session)
+{
+	unsigned char buf[6];
+
+	buf[0] = 0;
+	buf[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+	put32(buf + 2, max_concurrent_streams);
+	send_frame(session, H2_SETTINGS, 0, 0, buf, sizeof(buf));
+}
+
+/* a header block, split into CONTINUATIONs as needed; empties block. */
+static void
+send_headers(struct h2_session *session, ev_uint32_t stream,
+	     struct evbuffer *block, int end_stream)
+{
+	struct evbuffer *outbuf = bufferevent_get_output(session->bev);
+	size_t len;
+	int type, flags;
+
+	type = H2_HEADERS;
+	flags = end_stream ? H2_FLAG_END_STREAM : 0;
+	do {
+		len = evbuffer_get_length(block);
+		if (len > session->peer_max_frame)
+			len = session->peer_max_frame;
+		else
+			flags |= H2_FLAG_END_HEADERS;
+		send_frame_header(session, len, type, flags, stream);
+		evbuffer_remove_buffer(block, outbuf, len);
+		type = H2_CONTINUATION;
+		flags = 0;
+	} while (evbuffer_get_length(block) > 0);
+}
+
+static int
+session_choked(struct h2_session *session)
+{
+	struct evbuffer *outbuf = bufferevent_get_output(session->bev);
+
+	if (session->write_blocked)
+		return 1;
+
+	if (evbuffer_get_length(outbuf) > max_session_backlog) {
+		bufferevent_setwatermark(session->bev, EV_WRITE,
+					 max_session_backlog / 2, 0);
+		session->write_blocked = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* streams */
+
+static struct h2_stream *
+stream_find(struct h2_session *session, ev_uint32_t id)
+{
+	struct h2_stream *stream;
+
+	TAILQ_FOREACH(stream, &session->streams, next) {
+		if (stream->id == id)
+			return stream;
+	}
+
+	return NULL;
+}
+
+static void
+session_check_idle(struct h2_session *session)
+{
+	if (session->closing || session->will_free)
+		return;
+
+	if (session->nstreams == 0) {
+		if (session->goaway_recv)
+			session_shutdown(session, H2_NO_ERROR);
+		else
+			bufferevent_set_timeouts(session->bev,
+						 &idle_session_timeout, NULL);
+	} else
+		bufferevent_set_timeouts(session->bev, NULL, NULL);
+}
+
+static void
+stream_free(struct h2_stream *stream)
+{
+	struct h2_session *session = stream->session;
+
+	log_debug("h2: freeing stream %u", (unsigned)stream->id);
+
+	TAILQ_REMOVE(&session->streams, stream, next);
+	session->nstreams--;
+
+	/* the proxy's end sees this as the client closing */
+	http_conn_free(stream->conn);
+	evbuffer_free(stream->outq);
+	mem_free(stream);
+
+	session_check_idle(session);
+}
+
+static void
+stream_reset(struct h2_stream *stream, enum h2_error err)
+{
+	send_rst(stream->session, stream->id, err);
+	stream_free(stream);
+}
+
+/* the response is out; stop the client sending anything else. a tunnel's
+   client can go on sending until it's done too. */
+static void
+stream_close(struct h2_stream *stream)
+{
+	if (stream->is_tunnel && !stream->remote_closed)
+		return;
+	if (!stream->remote_closed)
+		send_rst(stream->session, stream->id, H2_NO_ERROR);
+	stream_free(stream);
+}
+
+/* a tunnel is half closed by EOF on our end of the pair */
+static void
+stream_tunnel_eof(struct h2_stream *stream)
+{
+	bufferevent_flush(stream->bev, EV_WRITE, BEV_FINISHED);
+	if (stream->local_closed)
+		stream_free(stream);
+}
+
+static void
+stream_remote_close(struct h2_stream *stream)
+{
+	stream->remote_closed = 1;
+	if (stream->is_tunnel)
+		stream_tunnel_eof(stream);
+	else if (stream->has_req_body && !stream->is_connect)
+		http_conn_write_finished(stream->conn);
+}
+
+/* send a frame's worth of response. return: 1 if there may be more to
+   send, 0 if not or if the stream is gone. */
+static int
+stream_send_data(struct h2_stream *stream)
+{
+	struct h2_session *session = stream->session;
+	struct evbuffer *outbuf = bufferevent_get_output(session->bev);
+	ev_int64_t n;
+	size_t len;
+	int flags;
+
+	if (stream->local_closed) {
+		stream_close(stream);
+		return 0;
+	}
+
+	len = evbuffer_get_length(stream->outq);
+	if ((len == 0 && !stream->response_done) || session_choked(session))
+		return 0;
+
+	n = len;
+	if (n > session->peer_max_frame)
+		n = session->peer_max_frame;
+	if (n > stream->send_window)
+		n = stream->send_window;
+	if (n > session->send_window)
+		n = session->send_window;
+	if (n <= 0 && len > 0)
+		return 0;
+
+	flags = 0;
+	if ((size_t)n == len && stream->response_done)
+		flags = H2_FLAG_END_STREAM;
+
+	send_frame_header(session, n, H2_DATA, flags, stream->id);
+	evbuffer_remove_buffer(stream->outq, outbuf, n);
+	stream->send_window -= n;
+	session->send_window -= n;
+
+	if (flags & H2_FLAG_END_STREAM) {
+		stream->local_closed = 1;
+		stream_close(stream);
+		return 0;
+	}
+
+	len = evbuffer_get_length(stream->outq);
+	if (stream->read_paused && len < max_stream_backlog / 2) {
+		stream->read_paused = 0;
+		http_conn_start_reading(stream->conn);
+	}
+
+	return len > 0;
+}
+
+static void
+stream_flush(struct h2_stream *stream)
+{
+	while (stream_send_data(stream))
+		;
+}
+
+static void
+stream_send_window_update(struct h2_stream *stream)
+{
+	if (stream->conn_choked || stream->remote_closed ||
+	    stream->recv_unacked < H2_DEFAULT_WINDOW / 2)
+		return;
+
+	send_window_update(stream->session, stream->id, stream->recv_unacked);
+	stream->recv_window += stream->recv_unacked;
+	stream->recv_unacked = 0;
+}
+
+static struct h2_stream *
+stream_new(struct h2_session *session, ev_uint32_t id)
+{
+	struct h2_stream *stream;
+	struct bufferevent *pair[2];
+
+	if (bufferevent_pair_new(session->base, BEV_OPT_CLOSE_ON_FREE |
+				 BEV_OPT_DEFER_CALLBACKS, pair) < 0)
+		log_fatal("h2: failed to create bufferevent pair");
+
+	stream = mem_calloc(1, sizeof(*stream));
+	stream->id = id;
+	stream->session = session;
+	stream->bev = pair[1];
+	stream->conn = http_conn_new_bev(session->base, pair[1], HTTP_SERVER,
+					 &stream_methods, stream);
+	stream->send_window = session->peer_initial_window;
+	stream->recv_window = H2_DEFAULT_WINDOW;
+	stream->outq = evbuffer_new();
+	if (!stream->outq)
+		log_fatal("h2: failed to create evbuffer");
+
+	TAILQ_INSERT_TAIL(&session->streams, stream, next);
+	session->nstreams++;
+	session_check_idle(session);
+
+	log_debug("h2: new stream %u", (unsigned)id);
+	session->cbs->on_stream(session, pair[0], session->cbarg);
+
+	return stream;
+}
+
+/* request headers */
+
+static int
+is_connection_header(const char *name)
+{
+	return (!evutil_ascii_strcasecmp(name, "connection") ||
+		!evutil_ascii_strcasecmp(name, "keep-alive") ||
+		!evutil_ascii_strcasecmp(name, "proxy-connection") ||
+		!evutil_ascii_strcasecmp(name, "transfer-encoding") ||
+		!evutil_ascii_strcasecmp(name, "upgrade"));
+}
+
+/* nothing that could break up the HTTP/1.1 we turn it into */
+static int
+valid_field(const char *str, size_t len, const char *bad)
+{
+	return strlen(str) == len && strpbrk(str, bad) == NULL;
+}
+
+static int
+set_pseudo(char **field, const char *val, size_t len)
+{
+	if (*field || !valid_field(val, len, " \t\r\n"))
+		return -1;
+	*field = mem_strdup(val);
+
+	return 0;
+}
+
+static void
+request_add_cookie(struct h2_request *req, const char *val, size_t len)
+{
+	char *cookie;
+	size_t oldlen;
+
+	if (!req->cookie) {
+		req->cookie = mem_strdup(val);
+		return;
+	}
+
+	/* crumbs are joined back up for HTTP/1.1 */
+	oldlen = strlen(req->cookie);
+	cookie = mem_malloc(oldlen + len + 3);
+	memcpy(cookie, req->cookie, oldlen);
+	memcpy(cookie + oldlen, "; ", 2);
+	memcpy(cookie + oldlen + 2, val, len + 1);
+	mem_free(req->cookie);
+	req->cookie = cookie;
+}
+
+static int
+collect_header(const char *name, size_t namelen, const char *val,
+	       size_t vallen, void *arg)
+{
+	struct h2_request *req = arg;
+	int bad = 0;
+
+	req->size += namelen + vallen + 32;
+	if (namelen == 0 || req->size > max_header_list ||
+	    !valid_field(val, vallen, "\r\n") ||
+	    !valid_field(name + 1, namelen - 1,
+			 " \t\r\n:ABCDEFGHIJKLMNOPQRSTUVWXYZ") ||
+	    strchr(" \t\r\nABCDEFGHIJKLMNOPQRSTUVWXYZ", name[0])) {
+		/* the table still has to be kept in step */
+		req->malformed = 1;
+		return 0;
+	}
+
+	if (name[0] == ':') {
+		if (req->regular_seen)
+			bad = 1;
+		else if (!strcmp(name, ":method"))
+			bad = set_pseudo(&req->method, val, vallen);
+		else if (!strcmp(name, ":scheme"))
+			bad = set_pseudo(&req->scheme, val, vallen);
+		else if (!strcmp(name, ":authority"))
+			bad = set_pseudo(&req->authority, val, vallen);
+		else if (!strcmp(name, ":path"))
+			bad = set_pseudo(&req->path, val, vallen);
+		else
+			bad = 1;
+	} else {
+		req->regular_seen = 1;
+		if (!strcmp(name, "cookie"))
+			request_add_cookie(req, val, vallen);
+		else if (!is_connection_header(name) &&
+			 strcmp(name, "te") && strcmp(name, "content-length") &&
+			 strcmp(name, "http2-settings"))
+			headers_add_key_val(&req->headers, name, val);
+	}
+
+	if (bad)
+		req->malformed = 1;
+
+	return 0;
+}
+
+static void
+request_clear(struct h2_request *req)
+{
+	mem_free(req->method);
+	mem_free(req->scheme);
+	mem_free(req->authority);
+	mem_free(req->path);
+	mem_free(req->cookie);
+	headers_clear(&req->headers);
+}
+
+/* write req to the stream's pair as an HTTP/1.1 proxy request */
+static int
+stream_write_request(struct h2_stream *stream, struct h2_request *req,
+		     int end_stream)
+{
+	struct evbuffer *outbuf = bufferevent_get_output(stream->bev);
+	const char *host;
+
+	if (!req->method)
+		return -1;
+
+	if (!strcmp(req->method, "CONNECT")) {
+		if (!req->authority || req->scheme || req->path)
+			return -1;
+		stream->is_connect = 1;
+		stream->has_req_body = 1;
+		evbuffer_add_printf(outbuf, "CONNECT %s HTTP/1.1\r\n",
+				    req->authority);
+	} else {
+		host = req->authority;
+		if (!host)
+			host = headers_find(&req->headers, "host");
+		if (!req->scheme || !req->path || !host || req->path[0] != '/') {
+			if (host != req->authority)
+				mem_free((char *)host);
+			return -1;
+		}
+		evbuffer_add_printf(outbuf, "%s %s://%s%s HTTP/1.1\r\n",
+				    req->method, req->scheme, host, req->path);
+		if (host != req->authority)
+			mem_free((char *)host);
+
+		stream->is_head = !strcmp(req->method, "HEAD");
+		/* the proxy ignores a body on these */
+		stream->has_req_body = (strcmp(req->method, "GET") &&
+					!stream->is_head);
+	}
+
+	if (req->authority && !headers_has_key(&req->headers, "host"))
+		headers_add_key_val(&req->headers, "host", req->authority);
+	if (req->cookie)
+		headers_add_key_val(&req->headers, "cookie", req->cookie);
+
+	/* DATA frames are what delimit the body, so always chunk it */
+	if (stream->has_req_body && !stream->is_connect) {
+		if (end_stream) {
+			headers_add_key_val(&req->headers, "Content-Length",
+					    "0");
+			stream->has_req_body = 0;
+		} else
+			headers_add_key_val(&req->headers,
+					    "Transfer-Encoding", "chunked");
+	}
+
+	headers_dump(&req->headers, outbuf);
+
+	if (stream->has_req_body && !stream->is_connect)
+		http_conn_set_output_encoding(stream->conn, TE_CHUNKED);
+
+	return 0;
+}
+
+static void
+process_header_block(struct h2_session *session, ev_uint32_t id,
+		     const unsigned char *block, size_t len, int end_stream)
+{
+	struct h2_request req;
+	struct h2_stream *stream;
+
+	memset(&req, 0, sizeof(req));
+	TAILQ_INIT(&req.headers);
+
+	if (hpack_decode(&session->decoder, block, len, collect_header,
+			 &req) < 0) {
+		session_shutdown(session, H2_COMPRESSION_ERROR);
+		goto out;
+	}
+
+	stream = stream_find(session, id);
+	if (stream) {
+		/* trailers; there's nowhere to put them, so drop them */
+		if (stream->remote_closed || !end_stream)
+			stream_reset(stream, H2_PROTOCOL_ERROR);
+		else
+			stream_remote_close(stream);
+		goto out;
+	}
+
+	if (id <= session->last_stream_id) {
+		session_shutdown(session, H2_STREAM_CLOSED);
+		goto out;
+	}
+	session->last_stream_id = id;
+
+	if (req.malformed) {
+		send_rst(session, id, H2_PROTOCOL_ERROR);
+		goto out;
+	}
+	if (session->nstreams >= max_concurrent_streams) {
+		send_rst(session, id, H2_REFUSED_STREAM);
+		goto out;
+	}
+
+	stream = stream_new(session, id);
+	if (stream_write_request(stream, &req, end_stream) < 0) {
+		log_info("h2: malformed request on stream %u", (unsigned)id);
+		stream_reset(stream, H2_PROTOCOL_ERROR);
+		goto out;
+	}
+	if (end_stream)
+		stream_remote_close(stream);
+
+out:
+	request_clear(&req);
+}
+
+/* frame input */
+
+static void
+handle_data(struct h2_session *session, struct h2_frame *f,
+	    struct evbuffer *inbuf)
+{
+	struct h2_stream *stream;
+	unsigned char pad = 0;
+	size_t len = f->len;
+
+	if (f->stream == 0) {
+		session_shutdown(session, H2_PROTOCOL_ERROR);
+		evbuffer_drain(inbuf, len);
+		return;
+	}
+	if (f->flags & H2_FLAG_PADDED) {
+		if (len < 1) {
+			session_shutdown(session, H2_PROTOCOL_ERROR);
+			return;
+		}
+		evbuffer_remove(inbuf, &pad, 1);
+		len--;
+		if (pad > len) {
+			session_shutdown(session, H2_PROTOCOL_ERROR);
+			evbuffer_drain(inbuf, len);
+			return;
+		}
+		len -= pad;
+	}
+
+	session->recv_window -= f->len;
+	session->recv_unacked += f->len;
+	if (session->recv_window < 0) {
+		session_shutdown(session, H2_FLOW_CONTROL_ERROR);
+		evbuffer_drain(inbuf, len + pad);
+		return;
+	}
+
+	stream = stream_find(session, f->stream);
+	if (!stream || stream->remote_closed) {
+		evbuffer_drain(inbuf, len + pad);
+		if (f->stream > session->last_stream_id)
+			session_shutdown(session, H2_PROTOCOL_ERROR);
+		else if (stream)
+			stream_reset(stream, H2_STREAM_CLOSED);
+		else
+			send_rst(session, f->stream, H2_STREAM_CLOSED);
+		return;
+	}
+
+	stream->recv_window -= f->len;
+	stream->recv_unacked += f->len;
+	if (stream->recv_window < 0) {
+		evbuffer_drain(inbuf, len + pad);
+		stream_reset(stream, H2_FLOW_CONTROL_ERROR);
+		return;
+	}
+
+	if (stream->has_req_body && len) {
+		evbuffer_remove_buffer(inbuf, session->scratch, len);
+		if (!http_conn_write_buf(stream->conn, session->scratch))
+			stream->conn_choked = 1;
+	} else
+		evbuffer_drain(inbuf, len);
+	evbuffer_drain(inbuf, pad);
+
+	if (f->flags & H2_FLAG_END_STREAM)
+		stream_remote_close(stream);
+}
+
+static void
+handle_headers(struct h2_session *session, struct h2_frame *f,
+	       const unsigned char *p)
+{
+	size_t len = f->len;
+	size_t pad = 0;
+
+	if (f->stream == 0 || !(f->stream & 1)) {
+		session_shutdown(session, H2_PROTOCOL_ERROR);
+		return;
+	}
+	if (f->flags & H2_FLAG_PADDED) {
+		if (len < 1) {
+			session_shutdown(session, H2_PROTOCOL_ERROR);
+			return;
+		}
+		pad = *p++;
+		len--;
+	}
+	if (f->flags & H2_FLAG_PRIORITY) {
+		if (len < 5) {
+			session_shutdown(session, H2_PROTOCOL_ERROR);
+			return;
+		}
+		p += 5;
+		len -= 5;
+	}
+	if (pad > len) {
+		session_shutdown(session, H2_PROTOCOL_ERROR);
+		return;
+	}
+	len -= pad;
+
+	if (f->flags & H2_FLAG_END_HEADERS) {
+		process_header_block(session, f->stream, p, len,
+				     f->flags & H2_FLAG_END_STREAM);
+	} else {
+		evbuffer_add(session->hblock, p, len);
+		session->hblock_stream = f->stream;
+		session->hblock_end_stream = f->flags & H2_FLAG_END_STREAM;
+	}
+}
+
+static void
+handle_continuation(struct h2_session *session, struct h2_frame *f,
+		    const unsigned char *p)
+{
+	size_t len;
+
+	if (session->hblock_stream == 0 ||
+	    f->stream != session->hblock_stream) {
+		session_shutdown(session, H2_PROTOCOL_ERROR);
+		return;
+	}
+
+	evbuffer_add(session->hblock, p, f->len);
+	len = evbuffer_get_length(session->hblock);
+	if (len > max_header_block) {
+		session_shutdown(session, H2_ENHANCE_YOUR_CALM);
+		return;
+	}
+
+	if (f->flags & H2_FLAG_END_HEADERS) {
+		session->hblock_stream = 0;
+		process_header_block(session, f->stream,
+				     evbuffer_pullup(session->hblock, len), len,
+				     session->hblock_end_stream);
+		evbuffer_drain(session->hblock, len);
+	}
+}
+
+static enum h2_error
+apply_settings(struct h2_session *session, const unsigned char *p,
+	       size_t len)
+{
+	struct h2_stream *stream;
+	ev_int64_t delta;
+	ev_uint32_t val;
+	int id;
+
+	if (len % 6)
+		return H2_FRAME_SIZE_ERROR;
+
+	for (; len > 0; p += 6, len -= 6) {
+		id = (p[0] << 8) | p[1];
+		val = get32(p + 2);
+
+		switch (id) {
+		case H2_SETTINGS_ENABLE_PUSH:
+			if (val > 1)
+				return H2_PROTOCOL_ERROR;
+			break;
+		case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+			if (val > H2_MAX_WINDOW)
+				return H2_FLOW_CONTROL_ERROR;
+			delta = (ev_int64_t)val - session->peer_initial_window;
+			TAILQ_FOREACH(stream, &session->streams, next)
+				stream->send_window += delta;
+			session->peer_initial_window = val;
+			break;
+		case H2_SETTINGS_MAX_FRAME_SIZE:
+			if (val < H2_DEFAULT_FRAME_SIZE || val > 0xffffff)
+				return H2_PROTOCOL_ERROR;
+			session->peer_max_frame = val;
+			break;
+		default:
+			/* we never push, and never index what we send */
+			break;
+		}
+	}
+
+	return H2_NO_ERROR;
+}
+
+static void
+handle_settings(struct h2_session *session, struct h2_frame *f,
+		const unsigned char *p)
+{
+	enum h2_error err;
+
+	if (f->stream != 0) {
+		session_shutdown(session, H2_PROTOCOL_ERROR);
+		return;
+	}
+	if (f->flags & H2_FLAG_ACK) {
+		if (f->len != 0)
+			session_shutdown(session, H2_FRAME_SIZE_ERROR);
+		return;
+	}
+
+	err = apply_settings(session, p, f->len);
+	if (err != H2_NO_ERROR) {
+		session_shutdown(session, err);
+		return;
+	}
+	send_frame(session, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+static void
+handle_window_update(struct h2_session *session, struct h2_frame *f,
+		     const unsigned char *p)
+{
+	struct h2_stream *stream;
+	ev_uint32_t inc;
+
+	if (f->len != 4) {
+		session_shutdown(session, H2_FRAME_SIZE_ERROR);
+		return;
+	}
+	inc = get32(p) & H2_MAX_WINDOW;
+
+	if (f->stream == 0) {
+		session->send_window += inc;
+		if (inc == 0)
+			session_shutdown(session, H2_PROTOCOL_ERROR);
+		else if (session->send_window > H2_MAX_WINDOW)
+			session_shutdown(session, H2_FLOW_CONTROL_ERROR);
+		return;
+	}
+
+	stream = stream_find(session, f->stream);
+	if (!stream)
+		return;
+	stream->send_window += inc;
+	if (inc == 0)
+		stream_reset(stream, H2_PROTOCOL_ERROR);
+	else if (stream->send_window > H2_MAX_WINDOW)
+		stream_reset(stream, H2_FLOW_CONTROL_ERROR);
+}
+
+static void
+handle_frame(struct h2_session *session, struct h2_frame *f,
+	     struct evbuffer *inbuf)
+{
+	struct h2_stream *stream;
+	const unsigned char *p = NULL;
+
+	if (session->hblock_stream && f->type != H2_CONTINUATION) {
+		session_shutdown(session, H2_PROTOCOL_ERROR);
+		evbuffer_drain(inbuf, f->len);
+		return;
+	}
+
+	if (f->type == H2_DATA) {
+		handle_data(session, f, inbuf);
+		return;
+	}
+
+	if (f->len)
+		p = evbuffer_pullup(inbuf, f->len);
+
+	switch (f->type) {
+	case H2_HEADERS:
+		handle_headers(session, f, p);
+		break;
+	case H2_CONTINUATION:
+		handle_continuation(session, f, p);
+		break;
+	case H2_PRIORITY:
+		if (f->len != 5)
+			session_shutdown(session, H2_FRAME_SIZE_ERROR);
+		break;
+	case H2_RST_STREAM:
+		if (f->stream == 0 || f->stream > session->last_stream_id)
+			session_shutdown(session, H2_PROTOCOL_ERROR);
+		else if (f->len != 4)
+			session_shutdown(session, H2_FRAME_SIZE_ERROR);
+		else if ((stream = stream_find(session, f->stream)))
+			stream_free(stream);
+		break;
+	case H2_SETTINGS:
+		handle_settings(session, f, p);
+		break;
+	case H2_PUSH_PROMISE:
+		session_shutdown(session, H2_PROTOCOL_ERROR);
+		break;
+	case H2_PING:
+		if (f->stream != 0 || f->len != 8)
+			session_shutdown(session, H2_FRAME_SIZE_ERROR);
+		else if (!(f->flags & H2_FLAG_ACK))
+			send_frame(session, H2_PING, H2_FLAG_ACK, 0, p, 8);
+		break;
+	case H2_GOAWAY:
+		log_debug("h2: client sent goaway");
+		session->goaway_recv = 1;
+		/* with nothing open, there's nothing left to wait for */
+		session_check_idle(session);
+		break;
+	case H2_WINDOW_UPDATE:
+		handle_window_update(session, f, p);
+		break;
+	default:
+		/* unknown frame types are to be ignored */
+		break;
+	}
+
+	evbuffer_drain(inbuf, f->len);
+}
+
+/* return: -1 bad preface, 0 need more, 1 done */
+static int
+read_preface(struct h2_session *session, struct evbuffer *inbuf)
+{
+	const char *expect;
+	size_t len;
+
+	expect = H2_PREFACE + H2_PREFACE_LEN - session->preface_left;
+	len = evbuffer_get_length(inbuf);
+	if (len > session->preface_left)
+		len = session->preface_left;
+	if (len == 0)
+		return 0;
+
+	if (memcmp(evbuffer_pullup(inbuf, len), expect, len)) {
+		log_info("h2: bad connection preface");
+		return -1;
+	}
+	evbuffer_drain(inbuf, len);
+	session->preface_left -= len;
+
+	return session->preface_left == 0;
+}
+
+static void
+session_process_inbuf(struct h2_session *session)
+{
+	struct evbuffer *inbuf = bufferevent_get_input(session->bev);
+	unsigned char hdr[H2_FRAME_HEADER_LEN];
+	struct h2_stream *stream;
+	struct h2_frame f;
+	int budget = max_frames_per_wakeup;
+
+	if (session->closing || session->will_free)
+		return;
+
+	if (session->preface_left) {
+		switch (read_preface(session, inbuf)) {
+		case -1:
+			session_shutdown(session, H2_PROTOCOL_ERROR);
+			/* fallthru */
+		case 0:
+			return;
+		}
+	}
+
+	while (!session->closing &&
+	       evbuffer_get_length(inbuf) >= H2_FRAME_HEADER_LEN) {
+		evbuffer_copyout(inbuf, hdr, sizeof(hdr));
+		f.len = (hdr[0] << 16) | (hdr[1] << 8) | hdr[2];
+		f.type = hdr[3];
+		f.flags = hdr[4];
+		f.stream = get32(hdr + 5) & H2_MAX_WINDOW;
+
+		/* we never raise SETTINGS_MAX_FRAME_SIZE */
+		if (f.len > H2_DEFAULT_FRAME_SIZE) {
+			session_shutdown(session, H2_FRAME_SIZE_ERROR);
+			return;
+		}
+		if (evbuffer_get_length(inbuf) < sizeof(hdr) + f.len)
+			break;
+
+		/* out of budget; let everyone else have a go first */
+		if (budget-- == 0) {
+			log_debug("h2: session %p out of read budget, "
+				  "deferring", session);
+			event_active(session->process_ev, EV_TIMEOUT, 1);
+			break;
+		}
+		evbuffer_drain(inbuf, sizeof(hdr));
+		handle_frame(session, &f, inbuf);
+	}
+
+	if (session->closing)
+		return;
+
+	/* give back the window for whatever has been consumed */
+	if (session->recv_unacked >= H2_DEFAULT_WINDOW / 2) {
+		send_window_update(session, 0, session->recv_unacked);
+		session->recv_window += session->recv_unacked;
+		session->recv_unacked = 0;
+	}
+	TAILQ_FOREACH(stream, &session->streams, next)
+		stream_send_window_update(stream);
+
+	session_flush_streams(session);
+}
+
+static void
+session_readcb(struct bufferevent *bev, void *arg)
+{
+	session_process_inbuf(arg);
+}
+
+static void
+deferred_process_inbuf(evutil_socket_t fd, short what, void *arg)
+{
+	session_process_inbuf(arg);
+}
+
+/* give every stream a turn at the window, a frame at a time */
+static void
+session_flush_streams(struct h2_session *session)
+{
+	struct h2_stream *stream, *next;
+	int more;
+
+	do {
+		more = 0;
+		for (stream = TAILQ_FIRST(&session->streams); stream;
+		     stream = next) {
+			next = TAILQ_NEXT(stream, next);
+			more |= stream_send_data(stream);
+		}
+	} while (more && !session->write_blocked);
+}
+
+static void
+session_writecb(struct bufferevent *bev, void *arg)
+{
+	struct h2_session *session = arg;
+
+	if (session->closing) {
+		if (evbuffer_get_length(bufferevent_get_output(bev)) == 0) {
+			if (session->cbs->on_close)
+				session->cbs->on_close(session,
+						       session->cbarg);
+			h2_session_free(session);
+		}
+	} else if (session->write_blocked) {
+		bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+		session->write_blocked = 0;
+		session_flush_streams(session);
+	}
+}
+
+static void
+session_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct h2_session *session = arg;
+
+	if ((what & BEV_EVENT_TIMEOUT) && (what & BEV_EVENT_READING) &&
+	    !session->closing) {
+		log_info("h2: closing idle session");
+		session_shutdown(session, H2_NO_ERROR);
+		return;
+	}
+
+	log_debug("h2: session closed");
+	if (session->cbs->on_close)
+		session->cbs->on_close(session, session->cbarg);
+	h2_session_free(session);
+}
+
+/* send GOAWAY and close once it's written */
+static void
+session_shutdown(struct h2_session *session, enum h2_error err)
+{
+	struct h2_stream *stream;
+	unsigned char buf[8];
+
+	if (session->closing)
+		return;
+
+	if (err != H2_NO_ERROR)
+		log_info("h2: closing session, error %d", err);
+
+	session->closing = 1;
+	put32(buf, session->last_stream_id);
+	put32(buf + 4, err);
+	send_frame(session, H2_GOAWAY, 0, 0, buf, sizeof(buf));
+
+	while ((stream = TAILQ_FIRST(&session->streams)))
+		stream_free(stream);
+
+	bufferevent_disable(session->bev, EV_READ);
+	bufferevent_setwatermark(session->bev, EV_WRITE, 0, 0);
+	bufferevent_set_timeouts(session->bev, NULL, &flush_timeout);
+	bufferevent_enable(session->bev, EV_WRITE);
+}
+
+static int
+base64url_decode(const char *str, unsigned char *out, size_t outlen)
+{
+	unsigned int acc = 0;
+	int bits = 0, v;
+	size_t n = 0;
+
+	for (; *str && *str != '='; str++) {
+		if (*str >= 'A' && *str <= 'Z')
+			v = *str - 'A';
+		else if (*str >= 'a' && *str <= 'z')
+			v = *str - 'a' + 26;
+		else if (*str >= '0' && *str <= '9')
+			v = *str - '0' + 52;
+		else if (*str == '-')
+			v = 62;
+		else if (*str == '_')
+			v = 63;
+		else
+			return -1;
+		acc = (acc << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n == outlen)
+				return -1;
+			out[n++] = acc >> bits;
+		}
+	}
+
+	return n;
+}
+
+static struct h2_session *
+session_new(struct event_base *base, struct bufferevent *bev,
+	    const struct h2_cbs *cbs, void *cbarg)
+{
+	struct h2_session *session;
+
+	session = mem_calloc(1, sizeof(*session));
+	session->base = base;
+	session->bev = bev;
+	session->cbs = cbs;
+	session->cbarg = cbarg;
+	TAILQ_INIT(&session->streams);
+	hpack_table_init(&session->decoder, 4096);
+	session->peer_max_frame = H2_DEFAULT_FRAME_SIZE;
+	session->peer_initial_window = H2_DEFAULT_WINDOW;
+	session->send_window = H2_DEFAULT_WINDOW;
+	session->recv_window = H2_DEFAULT_WINDOW;
+	session->hblock = evbuffer_new();
+	session->scratch = evbuffer_new();
+	if (!session->hblock || !session->scratch)
+		log_fatal("h2: failed to create evbuffer");
+	session->process_ev = event_new(base, -1, 0, deferred_process_inbuf,
+					session);
+	if (!session->process_ev)
+		log_fatal("h2: failed to create event");
+
+	bufferevent_setwatermark(bev, EV_READ, 0, 0);
+	bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+	bufferevent_setcb(bev, session_readcb, session_writecb,
+			  session_eventcb, session);
+	bufferevent_priority_set(bev, HTTP_PRIORITY_HIGH);
+	bufferevent_enable(bev, EV_READ | EV_WRITE);
+	session_check_idle(session);
+
+	send_settings(session);
+
+	return session;
+}
+
+struct h2_session *
+h2_session_new(struct event_base *base, struct bufferevent *bev,
+	       const struct h2_cbs *cbs, void *cbarg)
+{
+	struct h2_session *session;
+
+	session = session_new(base, bev, cbs, cbarg);
+	session->preface_left = H2_PREFACE_TAIL_LEN;
+
+	/* the client's first frames may have come in with the preface */
+	event_active(session->process_ev, EV_TIMEOUT, 1);
+
+	log_debug("h2: new session %p", session);
+
+	return session;
+}
+
+struct h2_session *
+h2_session_upgrade(struct event_base *base, struct bufferevent *bev,
+		   struct http_request *req, const char *settings,
+		   const struct h2_cbs *cbs, void *cbarg)
+{
+	struct h2_session *session;
+	struct h2_stream *stream;
+	struct evbuffer *outbuf;
+	unsigned char buf[256];
+	int len;
+
+	session = session_new(base, bev, cbs, cbarg);
+	session->preface_left = H2_PREFACE_LEN;
+
+	if (settings) {
+		len = base64url_decode(settings, buf, sizeof(buf));
+		if (len < 0 || apply_settings(session, buf, len) != H2_NO_ERROR)
+			log_info("h2: ignoring bad HTTP2-Settings");
+	}
+
+	/* the upgrading request is stream 1, half closed already */
+	session->last_stream_id = 1;
+	stream = stream_new(session, 1);
+	stream->is_head = req->meth == METH_HEAD;
+	stream->remote_closed = 1;
+
+	headers_remove(req->headers, "connection");
+	outbuf = bufferevent_get_output(stream->bev);
+	evbuffer_add_printf(outbuf, "%s %s://%s:%d%s HTTP/1.1\r\n",
+			    http_method_to_string(req->meth),
+			    req->url->scheme, req->url->host, req->url->port,
+			    req->url->path);
+	headers_dump(req->headers, outbuf);
+	http_request_free(req);
+
+	event_active(session->process_ev, EV_TIMEOUT, 1);
+
+	log_debug("h2: new session %p, upgraded", session);
+
+	return session;
+}
+
+static void
+deferred_free(evutil_socket_t fd, short what, void *arg)
+{
+	struct h2_session *session = arg;
+
+	bufferevent_free(session->bev);
+	event_free(session->process_ev);
+	hpack_table_clear(&session->decoder);
+	evbuffer_free(session->hblock);
+	evbuffer_free(session->scratch);
+	mem_free(session);
+}
+
+void
+h2_session_free(struct h2_session *session)
+{
+	struct h2_stream *stream;
+
+	if (session->will_free)
+		return;
+
+	session->will_free = 1;
+	while ((stream = TAILQ_FIRST(&session->streams)))
+		stream_free(stream);
+	event_del(session->process_ev);
+	bufferevent_disable(session->bev, EV_READ | EV_WRITE);
+	bufferevent_setcb(session->bev, NULL, NULL, NULL, NULL);
+	event_base_once(session->base, -1, EV_TIMEOUT, deferred_free, session,
+			NULL);
+}
+
+/* http event slots for a stream's end of the pair */
+
+static void
+on_stream_error(struct http_conn *conn, enum http_conn_error err, void *arg)
+{
+	struct h2_stream *stream = arg;
+
+	log_debug("h2: stream %u: %s", (unsigned)stream->id,
+		  http_conn_error_to_string(err));
+	stream_reset(stream, stream->is_connect ? H2_CONNECT_ERROR :
+		     H2_INTERNAL_ERROR);
+}
+
+static void
+on_stream_continuation(struct http_conn *conn, void *arg)
+{
+}
+
+static void
+on_stream_response(struct http_conn *conn, struct http_response *resp,
+		   void *arg)
+{
+	struct h2_stream *stream = arg;
+	struct h2_session *session = stream->session;
+	struct evbuffer *block;
+	struct header *h;
+	char *val;
+	int end_stream, resp_ok;
+
+	if (stream->is_head)
+		http_conn_set_current_message_bodyless(conn);
+	/* a tunnel's body is everything until it closes */
+	resp_ok = resp->code / 100 == 2;
+	if (stream->is_connect && resp_ok)
+		headers_remove(resp->headers, "content-length");
+	end_stream = !http_conn_current_message_has_body(conn);
+
+	block = evbuffer_new();
+	hpack_encode_status(block, resp->code);
+	TAILQ_FOREACH(h, resp->headers, next) {
+		if (is_connection_header(h->key))
+			continue;
+		val = header_get_val(h);
+		hpack_encode_header(block, h->key, val);
+		mem_free(val);
+	}
+	send_headers(session, stream->id, block, end_stream);
+	evbuffer_free(block);
+	http_response_free(resp);
+
+	stream->response_started = 1;
+	if (end_stream)
+		stream->local_closed = 1;
+	else if (stream->is_connect && resp_ok) {
+		stream->is_tunnel = 1;
+		/* the client may have finished before we connected */
+		if (stream->remote_closed)
+			stream_tunnel_eof(stream);
+	}
+}
+
+static void
+on_stream_read_body(struct http_conn *conn, struct evbuffer *buf, void *arg)
+{
+	struct h2_stream *stream = arg;
+
+	evbuffer_add_buffer(stream->outq, buf);
+	stream_flush(stream);
+
+	if (evbuffer_get_length(stream->outq) > max_stream_backlog) {
+		stream->read_paused = 1;
+		http_conn_stop_reading(conn);
+	}
+}
+
+static void
+on_stream_msg_complete(struct http_conn *conn, void *arg)
+{
+	struct h2_stream *stream = arg;
+
+	stream->response_done = 1;
+	stream_flush(stream);
+}
+
+static void
+on_stream_write_more(struct http_conn *conn, void *arg)
+{
+	struct h2_stream *stream = arg;
+
+	stream->conn_choked = 0;
+	stream_send_window_update(stream);
+}
+
+static void
+on_stream_flush(struct http_conn *conn, void *arg)
+{
+}
@@ -0,0 +1,38 @@
+#ifndef _H2_H_
+#define _H2_H_
+
+/* An HTTP/2 (h2c) client connection. Each stream is handed out as one
+   end of a bufferevent pair that speaks HTTP/1.1, so the proxy can serve
+   it like any other client; the session translates frames to and from
+   that text. */
+
+struct bufferevent;
+struct event_base;
+struct http_request;
+struct h2_session;
+
+struct h2_cbs {
+	/* a new stream; bev is ready to be given to an HTTP_CLIENT conn */
+	void (*on_stream)(struct h2_session *, struct bufferevent *, void *);
+	/* the session is going away and will free itself */
+	void (*on_close)(struct h2_session *, void *);
+};
+
+/* prior knowledge; the connection preface's request line and the blank
+   line after it have already been read off bev. */
+struct h2_session *h2_session_new(struct event_base *base,
+				  struct bufferevent *bev,
+				  const struct h2_cbs *cbs, void *cbarg);
+
+/* HTTP/1.1 Upgrade; the 101 has been queued on bev. req becomes stream 1
+   and is freed. settings is the HTTP2-Settings header, or NULL. */
+struct h2_session *h2_session_upgrade(struct event_base *base,
+				      struct bufferevent *bev,
+				      struct http_request *req,
+				      const char *settings,
+				      const struct h2_cbs *cbs, void *cbarg);
+
+/* doesn't call on_close */
+void h2_session_free(struct h2_session *session);
+
+#endif
@@ -0,0 +1,441 @@
+#include <sys/queue.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/util.h>
+
+#include "headerpolicy.h"
+#include "headers.h"
+#include "util.h"
+#include "log.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+enum header_action {
+	ACTION_NONE,
+	ACTION_REMOVE,
+	ACTION_SET,
+	ACTION_ORIGIN
+};
+
+/* everything done to one header name, by direction */
+struct rule {
+	ev_uint64_t hash;
+	char *name;
+	enum header_action action[2];
+	char *value[2];
+};
+
+struct header_policy {
+	struct rule **slots;
+	size_t mask;
+	size_t nrules;
+};
+
+static ev_uint64_t
+hash_name(const char *name)
+{
+	ev_uint64_t h = FNV_OFFSET;
+	unsigned char c;
+
+	for (; *name; ++name) {
+		c = *name;
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		h = (h ^ c) * FNV_PRIME;
+	}
+
+	return h;
+}
+
+static struct rule *
+rule_find(const struct header_policy *policy, const char *name,
+	  ev_uint64_t h)
+{
+	struct rule *rule;
+	size_t i;
+
+	for (i = h & policy->mask; (rule = policy->slots[i]);
+	     i = (i + 1) & policy->mask) {
+		if (rule->hash == h &&
+		    !evutil_ascii_strcasecmp(rule->name, name))
+			return rule;
+	}
+
+	return NULL;
+}
+
+static void
+slot_insert(struct header_policy *policy, struct rule *rule)
+{
+	size_t i;
+
+	for (i = rule->hash & policy->mask; policy->slots[i];
+	     i = (i + 1) & policy->mask)
+		;
+	policy->slots[i] = rule;
+}
+
+static struct rule *
+rule_get(struct header_policy *policy, const char *name)
+{
+	struct rule **old, *rule;
+	ev_uint64_t h = hash_name(name);
+	size_t i, size;
+
+	rule = rule_find(policy, name, h);
+	if (rule)
+		return rule;
+
+	/* keep the table at most half full */
+	if ((policy->nrules + 1) * 2 > policy->mask + 1) {
+		old = policy->slots;
+		size = policy->mask + 1;
+		policy->slots = mem_calloc(size * 2, sizeof(*policy->slots));
+		policy->mask = size * 2 - 1;
+		for (i = 0; i < size; ++i) {
+			if (old[i])
+				slot_insert(policy, old[i]);
+		}
+		mem_free(old);
+	}
+
+	rule = mem_calloc(1, sizeof(*rule));
+	rule->hash = h;
+	rule->name = mem_strdup(name);
+	slot_insert(policy, rule);
+	policy->nrules++;
+
+	return rule;
+}
+
+/* a later rule for the same header and direction replaces an earlier
+   one */
+static void
+rule_set(struct header_policy *policy, enum header_dir dir,
+	 const char *name, enum header_action action, const char *value)
+{
+	struct rule *rule = rule_get(policy, name);
+
+	mem_free(rule->value[dir]);
+	rule->action[dir] = action;
+	rule->value[dir] = value ? mem_strdup(value) : NULL;
+}
+
+struct header_policy *
+header_policy_new(void)
+{
+	struct header_policy *policy;
+
+	policy = mem_calloc(1, sizeof(*policy));
+	policy->slots = mem_calloc(16, sizeof(*policy->slots));
+	policy->mask = 15;
+
+	rule_set(policy, HEADER_REQUEST, "Proxy-Authorization",
+		 ACTION_REMOVE, NULL);
+	rule_set(policy, HEADER_RESPONSE, "Proxy-Authenticate",
+		 ACTION_REMOVE, NULL);
+
+	return policy;
+}
+
+static char *
+trim(char *p)
+{
+	char *e;
+
+	p += strspn(p, " \t");
+	e = p + strlen(p);
+	while (e > p && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r' ||
+			 e[-1] == '\n'))
+		*--e = '\0';
+
+	return p;
+}
+
+/* the next space separated word of *p, terminated in place */
+static char *
+next_word(char **p)
+{
+	char *s = *p, *e;
+
+	s += strspn(s, " \t");
+	if (!*s)
+		return NULL;
+	e = s + strcspn(s, " \t");
+	if (*e)
+		*e++ = '\0';
+	*p = e;
+
+	return s;
+}
+
+static int
+parse_line(struct header_policy *policy, char *line)
+{
+	char *p = line, *dir, *name, *action, *value;
+	enum header_action act;
+	int req, resp;
+
+	dir = next_word(&p);
+	name = next_word(&p);
+	action = next_word(&p);
+	if (!action)
+		return -1;
+	value = trim(p);
+
+	if (!evutil_ascii_strcasecmp(dir, "request"))
+		req = 1, resp = 0;
+	else if (!evutil_ascii_strcasecmp(dir, "response"))
+		req = 0, resp = 1;
+	else if (!evutil_ascii_strcasecmp(dir, "both"))
+		req = 1, resp = 1;
+	else
+		return -1;
+
+	if (!evutil_ascii_strcasecmp(action, "remove"))
+		act = ACTION_REMOVE;
+	else if (!evutil_ascii_strcasecmp(action, "origin"))
+		act = ACTION_ORIGIN;
+	else if (!evutil_ascii_strcasecmp(action, "set") && *value)
+		act = ACTION_SET;
+	else
+		return -1;
+	if (act != ACTION_SET && *value)
+		return -1;
+
+	if (req)
+		rule_set(policy, HEADER_REQUEST, name, act, value);
+	if (resp)
+		rule_set(policy, HEADER_RESPONSE, name, act, value);
+
+	return 0;
+}
+
+struct header_policy *
+header_policy_load(const char *path)
+{
+	struct header_policy *policy;
+	char line[1024], *p;
+	int lineno = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		log_error("headerpolicy: can't open %s: %s", path,
+			  strerror(errno));
+		return NULL;
+	}
+
+	policy = header_policy_new();
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		p = trim(line);
+		if (!*p || *p == '#')
+			continue;
+		if (parse_line(policy, p) < 0) {
+			log_error("headerpolicy: %s:%d: bad rule", path,
+				  lineno);
+			header_policy_free(policy);
+			policy = NULL;
+			break;
+		}
+	}
+	fclose(fp);
+
+	return policy;
+}
+
+void
+header_policy_free(struct header_policy *policy)
+{
+	struct rule *rule;
+	size_t i;
+
+	if (!policy)
+		return;
+
+	for (i = 0; i <= policy->mask; ++i) {
+		rule = policy->slots[i];
+		if (!rule)
+			continue;
+		mem_free(rule->name);
+		mem_free(rule->value[HEADER_REQUEST]);
+		mem_free(rule->value[HEADER_RESPONSE]);
+		mem_free(rule);
+	}
+	mem_free(policy->slots);
+	mem_free(policy);
+}
+
+/* cut a URL down to scheme://host/ */
+static void
+set_origin(struct header *h)
+{
+	char *val, *host;
+	size_t len;
+
+	val = header_get_val(h);
+	host = strstr(val, "://");
+	if (host) {
+		host += 3;
+		len = host - val + strcspn(host, "/?#");
+		val[len] = '/';
+		header_set_val(h, val, len + 1);
+	}
+	mem_free(val);
+}
+
+void
+header_policy_apply(const struct header_policy *policy, enum header_dir dir,
+		    struct header_list *headers)
+{
+	struct header *h, *next;
+	struct rule *rule;
+
+	for (h = TAILQ_FIRST(headers); h; h = next) {
+		next = TAILQ_NEXT(h, next);
+		rule = rule_find(policy, h->key, hash_name(h->key));
+		if (!rule)
+			continue;
+
+		switch (rule->action[dir]) {
+		case ACTION_REMOVE:
+			header_remove(headers, h);
+			break;
+		case ACTION_SET:
+			header_set_val(h, rule->value[dir],
+				       strlen(rule->value[dir]));
+			break;
+		case ACTION_ORIGIN:
+			set_origin(h);
+			break;
+		case ACTION_NONE:
+			break;
+		}
+	}
+}
+
+size_t
+header_policy_size(const struct header_policy *policy)
+{
+	return policy->nrules;
+}
+
+#ifdef TEST_HEADERPOLICY
+/* applies a policy file (argv[1]) to headers on stdin, then times it
+   against removing a similar set with headers_remove(). */
+#include <stdlib.h>
+#include <event2/buffer.h>
+
+static const char *bench_msg =
+	"Host: www.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Firefox/128.0\r\n"
+	"Accept: text/html,application/xhtml+xml,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Referer: http://www.example.com/some/page?id=42\r\n"
+	"Cookie: session=0123456789abcdef; prefs=dark\r\n"
+	"Via: 1.1 cache.example.net\r\n"
+	"X-Forwarded-For: 192.0.2.1\r\n"
+	"Proxy-Authorization: Basic dXNlcjpwYXNz\r\n"
+	"DNT: 1\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"\r\n";
+
+static const char *bench_removed[] = {
+	"Proxy-Authorization", "Via", "X-Forwarded-For", "Forwarded",
+	"X-Client-IP", "X-Real-IP", "DNT", "Referer"
+};
+
+static void
+load(struct header_list *headers, struct evbuffer *buf)
+{
+	TAILQ_INIT(headers);
+	evbuffer_add(buf, bench_msg, strlen(bench_msg));
+	headers_load(headers, buf);
+}
+
+static double
+elapsed_ns(struct timeval *start, int n)
+{
+	struct timeval end, d;
+
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, start, &d);
+
+	return (d.tv_sec * 1e9 + d.tv_usec * 1e3) / n;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct header_policy *policy;
+	struct header_list headers;
+	struct evbuffer *buf, *out;
+	struct timeval start;
+	char line[256];
+	double base, with_policy, with_removes;
+	int i, n = 200000;
+	size_t k;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s policy-file < headers\n", argv[0]);
+		return 1;
+	}
+	policy = header_policy_load(argv[1]);
+	if (!policy)
+		return 1;
+
+	buf = evbuffer_new();
+	out = evbuffer_new();
+	TAILQ_INIT(&headers);
+	while (fgets(line, sizeof(line), stdin))
+		evbuffer_add(buf, line, strlen(line));
+	evbuffer_add(buf, "\r\n", 2);
+	headers_load(&headers, buf);
+	header_policy_apply(policy, HEADER_REQUEST, &headers);
+	headers_dump(&headers, out);
+	fwrite(evbuffer_pullup(out, -1), evbuffer_get_length(out), 1, stdout);
+	headers_clear(&headers);
+
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < n; ++i) {
+		load(&headers, buf);
+		headers_clear(&headers);
+	}
+	base = elapsed_ns(&start, n);
+
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < n; ++i) {
+		load(&headers, buf);
+		header_policy_apply(policy, HEADER_REQUEST, &headers);
+		headers_clear(&headers);
+	}
+	with_policy = elapsed_ns(&start, n) - base;
+
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < n; ++i) {
+		load(&headers, buf);
+		for (k = 0; k < sizeof(bench_removed) /
+			    sizeof(*bench_removed); ++k)
+			headers_remove(&headers, bench_removed[k]);
+		headers_clear(&headers);
+	}
+	with_removes = elapsed_ns(&start, n) - base;
+
+	printf("parse: %.0f ns/msg, policy (%lu rules): %.0f ns/msg, "
+	       "%lu headers_remove() calls: %.0f ns/msg\n",
+	       base, (unsigned long)header_policy_size(policy), with_policy,
+	       (unsigned long)(sizeof(bench_removed) /
+			       sizeof(*bench_removed)), with_removes);
+
+	header_policy_free(policy);
+	evbuffer_free(buf);
+	evbuffer_free(out);
+
+	return 0;
+}
+#endif
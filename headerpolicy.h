@@ -0,0 +1,40 @@
+#ifndef _HEADERPOLICY_H_
+#define _HEADERPOLICY_H_
+
+/* What to strip or rewrite in the headers passing through. Rules are
+   compiled into a table keyed by header name, so applying a policy is
+   one walk of the header list with a hash probe per header, however
+   many rules there are. A policy file has lines like:
+
+	# direction	header			action
+	request		Via			remove
+	request		Referer			origin
+	request		User-Agent		set Mozilla/5.0
+	response	X-Powered-By		remove
+	both		X-Tracking-Id		remove
+
+   remove drops the header, set replaces its value with the rest of the
+   line, and origin cuts a URL value down to scheme://host/. Every policy
+   also removes Proxy-Authorization from requests and Proxy-Authenticate
+   from responses, since shim doesn't do proxy authentication and they
+   aren't meant for the server or client. */
+
+enum header_dir {
+	HEADER_REQUEST,
+	HEADER_RESPONSE
+};
+
+struct header_list;
+struct header_policy;
+
+/* just the built in rules */
+struct header_policy *header_policy_new(void);
+/* NULL if the file can't be read or has a bad line. */
+struct header_policy *header_policy_load(const char *path);
+void header_policy_free(struct header_policy *policy);
+
+void header_policy_apply(const struct header_policy *policy,
+			 enum header_dir dir, struct header_list *headers);
+size_t header_policy_size(const struct header_policy *policy);
+
+#endif
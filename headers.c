@@ -62,7 +62,7 @@ headers_load(struct header_list *headers, struct evbuffer *buf)
 {
 	char *line, *p;
 	
-	while ((line = evbuffer_readln(buf, NULL, EVBUFFER_EOL_CRLF))) {
+	while ((line = mem_readln(buf))) {
 		if (*line == '\0') {
 			mem_free(line);
 			return 1;
@@ -106,44 +106,50 @@ headers_has_key(struct header_list *headers, const char *key)
 	return 0;
 }
 
-/* caller must free result; returns NULL if key not found. */
+/* caller must free result */
 char *
-headers_find(struct header_list *headers, const char *key)
+header_get_val(const struct header *h)
 {
-	struct header *h;
 	struct val_line *line;
 	char *ret, *p;
 	size_t len;
-	
-	TAILQ_FOREACH(h, headers, next) {
-		if (evutil_ascii_strcasecmp(h->key, key))
-			continue;
 
-		len = h->val_len;
+	len = h->val_len;
+
+	/* XXX Some of this space is wasted if we trim any leading WS
+	   from value lines */
+	ret = mem_calloc(1, len + 1);
+	p = ret;
+
+	TAILQ_FOREACH(line, &h->val, next) {
+		len = strspn(line->str, " \t");
+		/* after the first line, translate leading WS to
+		   a single SP */
+		if (p != ret)
+			*p++ = ' ';
+		memcpy(p, line->str + len, line->len - len);
+		p += line->len - len;
+	}
 
-		/* XXX Some of this space is wasted if we trim any leading WS
- 		   from value lines */
-		ret = mem_calloc(1, len + 1);
-		p = ret;
+	return ret;
+}
 
-		TAILQ_FOREACH(line, &h->val, next) {
-			len = strspn(line->str, " \t");
-			/* after the first line, translate leading WS to
- 		 	   a single SP */
-			if (p != ret)
-				*p++ = ' ';
-			memcpy(p, line->str + len, line->len - len);
-			p += line->len - len;
-		}
+/* caller must free result; returns NULL if key not found. */
+char *
+headers_find(struct header_list *headers, const char *key)
+{
+	struct header *h;
 	
-		return ret;	
+	TAILQ_FOREACH(h, headers, next) {
+		if (!evutil_ascii_strcasecmp(h->key, key))
+			return header_get_val(h);
 	}
 
 	return NULL;
 }
 
-static void
-remove_one(struct header_list *headers, struct header *h)
+void
+header_remove(struct header_list *headers, struct header *h)
 {
 	struct val_line *line;
 
@@ -155,13 +161,30 @@ remove_one(struct header_list *headers, struct header *h)
 	mem_free(h);	
 }
 
+void
+header_set_val(struct header *h, const char *val, size_t n)
+{
+	struct val_line *line;
+
+	while ((line = TAILQ_FIRST(&h->val))) {
+		TAILQ_REMOVE(&h->val, line, next);
+		mem_free(line);
+	}
+
+	line = mem_calloc(1, sizeof(*line) + n + 1);
+	memcpy(line->str, val, n);
+	line->len = n;
+	TAILQ_INSERT_TAIL(&h->val, line, next);
+	h->val_len = n;
+}
+
 void
 headers_clear(struct header_list *headers)
 {
 	struct header *h;
 
 	while ((h = TAILQ_FIRST(headers)))
-		remove_one(headers, h);
+		header_remove(headers, h);
 }
 
 int
@@ -175,13 +198,82 @@ headers_remove(struct header_list *headers, const char *key)
 		next = TAILQ_NEXT(h, next);
 		if (!evutil_ascii_strcasecmp(h->key, key)) {
 			count++;
-			remove_one(headers, h);
+			header_remove(headers, h);
 		}
 	}
 
 	return count;
 }
 
+/* find the next comma separated element of a list-valued header. */
+static const char *
+next_list_elem(const char **p, size_t *len)
+{
+	const char *s = *p, *e;
+
+	s += strspn(s, " \t,");
+	if (*s == '\0')
+		return NULL;
+	e = s + strcspn(s, ",");
+	*p = e;
+	while (e > s && (e[-1] == ' ' || e[-1] == '\t'))
+		e--;
+	*len = e - s;
+
+	return s;
+}
+
+int
+headers_has_token(struct header_list *headers, const char *key,
+		  const char *token)
+{
+	struct header *h;
+	const char *p, *elem;
+	char *val;
+	size_t len, toklen;
+	int found = 0;
+
+	toklen = strlen(token);
+	TAILQ_FOREACH(h, headers, next) {
+		if (evutil_ascii_strcasecmp(h->key, key))
+			continue;
+		val = header_get_val(h);
+		p = val;
+		while (!found && (elem = next_list_elem(&p, &len)))
+			found = len == toklen &&
+				!evutil_ascii_strncasecmp(elem, token, len);
+		mem_free(val);
+		if (found)
+			break;
+	}
+
+	return found;
+}
+
+void
+headers_remove_listed(struct header_list *headers, const char *key)
+{
+	struct header *h;
+	const char *p, *elem;
+	char *val, *name;
+	size_t len;
+
+	TAILQ_FOREACH(h, headers, next) {
+		if (evutil_ascii_strcasecmp(h->key, key))
+			continue;
+		val = header_get_val(h);
+		p = val;
+		while ((elem = next_list_elem(&p, &len))) {
+			name = mem_strdup_n(elem, len);
+			/* never let a token take the list itself with it */
+			if (evutil_ascii_strcasecmp(name, key))
+				headers_remove(headers, name);
+			mem_free(name);
+		}
+		mem_free(val);
+	}
+}
+
 #ifdef TEST_HEADERS
 #include <stdio.h>
 int main(int argc, char **argv)
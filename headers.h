@@ -29,7 +29,17 @@ void headers_dump(struct header_list *headers, struct evbuffer *buf);
 int headers_load(struct header_list *headers, struct evbuffer *buf);
 int headers_has_key(struct header_list *headers, const char *key);
 char *headers_find(struct header_list *headers, const char *key);
+char *header_get_val(const struct header *h);
 int headers_remove(struct header_list *headers, const char *key);
+/* for callers walking the list themselves */
+void header_remove(struct header_list *headers, struct header *h);
+void header_set_val(struct header *h, const char *val, size_t n);
+/* case insensitive match of token against key's comma separated values */
+int headers_has_token(struct header_list *headers, const char *key,
+		      const char *token);
+/* remove the headers named in key's values, eg. those listed in
+   Connection. key itself stays. */
+void headers_remove_listed(struct header_list *headers, const char *key);
 void headers_clear(struct header_list *headers);
 
 #endif
@@ -0,0 +1,635 @@
+#include <assert.h>
+#include <string.h>
+
+#include <event2/util.h>
+#include <event2/buffer.h>
+
+#include "hpack.h"
+#include "util.h"
+
+/* RFC 7541, appendix A */
+static const struct {
+	const char *name;
+	const char *val;
+} static_table[] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+#define STATIC_TABLE_LEN (sizeof(static_table) / sizeof(static_table[0]))
+
+/* decode tree for the code of RFC 7541, appendix B; a positive entry
+   is the next node, a negative one is -(symbol + 1), with 256 as EOS.
+   node 0 is the root, so no child can be 0. it's a constant so that
+   sessions on any thread can share it; TEST_HPACK rebuilds it from
+   the code lengths and checks it. */
+static const short huff_tree[256][2] = {
+	{ 1, 22 }, { 2, 9 }, { 3, 6 }, { 4, 5 },
+	{ -49, -50 }, { -51, -98 }, { 7, 8 }, { -100, -102 },
+	{ -106, -112 }, { 10, 15 }, { 11, 12 }, { -116, -117 },
+	{ 13, 14 }, { -33, -38 }, { -46, -47 }, { 16, 19 },
+	{ 17, 18 }, { -48, -52 }, { -53, -54 }, { 20, 21 },
+	{ -55, -56 }, { -57, -58 }, { 23, 40 }, { 24, 31 },
+	{ 25, 28 }, { 26, 27 }, { -62, -66 }, { -96, -99 },
+	{ 29, 30 }, { -101, -103 }, { -104, -105 }, { 32, 35 },
+	{ 33, 34 }, { -109, -110 }, { -111, -113 }, { 36, 37 },
+	{ -115, -118 }, { 38, 39 }, { -59, -67 }, { -68, -69 },
+	{ 41, 56 }, { 42, 49 }, { 43, 46 }, { 44, 45 },
+	{ -70, -71 }, { -72, -73 }, { 47, 48 }, { -74, -75 },
+	{ -76, -77 }, { 50, 53 }, { 51, 52 }, { -78, -79 },
+	{ -80, -81 }, { 54, 55 }, { -82, -83 }, { -84, -85 },
+	{ 57, 64 }, { 58, 61 }, { 59, 60 }, { -86, -87 },
+	{ -88, -90 }, { 62, 63 }, { -107, -108 }, { -114, -119 },
+	{ 65, 68 }, { 66, 67 }, { -120, -121 }, { -122, -123 },
+	{ 69, 72 }, { 70, 71 }, { -39, -43 }, { -45, -60 },
+	{ 73, 74 }, { -89, -91 }, { 75, 78 }, { 76, 77 },
+	{ -34, -35 }, { -41, -42 }, { 79, 81 }, { -64, 80 },
+	{ -40, -44 }, { 82, 84 }, { -125, 83 }, { -36, -63 },
+	{ 85, 88 }, { 86, 87 }, { -1, -37 }, { -65, -92 },
+	{ 89, 90 }, { -94, -127 }, { 91, 92 }, { -95, -126 },
+	{ 93, 94 }, { -61, -97 }, { -124, 95 }, { 96, 110 },
+	{ 97, 101 }, { 98, 99 }, { -93, -196 }, { -209, 100 },
+	{ -129, -131 }, { 102, 105 }, { 103, 104 }, { -132, -163 },
+	{ -185, -195 }, { 106, 107 }, { -225, -227 }, { 108, 109 },
+	{ -154, -162 }, { -168, -173 }, { 111, 133 }, { 112, 119 },
+	{ 113, 116 }, { 114, 115 }, { -177, -178 }, { -180, -210 },
+	{ 117, 118 }, { -217, -218 }, { -228, -230 }, { 120, 126 },
+	{ 121, 123 }, { -231, 122 }, { -130, -133 }, { 124, 125 },
+	{ -134, -135 }, { -137, -147 }, { 127, 130 }, { 128, 129 },
+	{ -155, -157 }, { -161, -164 }, { 131, 132 }, { -165, -170 },
+	{ -171, -174 }, { 134, 153 }, { 135, 142 }, { 136, 139 },
+	{ 137, 138 }, { -179, -182 }, { -186, -187 }, { 140, 141 },
+	{ -188, -190 }, { -191, -197 }, { 143, 146 }, { 144, 145 },
+	{ -199, -229 }, { -233, -234 }, { 147, 150 }, { 148, 149 },
+	{ -2, -136 }, { -138, -139 }, { 151, 152 }, { -140, -141 },
+	{ -142, -144 }, { 154, 169 }, { 155, 162 }, { 156, 159 },
+	{ 157, 158 }, { -148, -150 }, { -151, -152 }, { 160, 161 },
+	{ -153, -156 }, { -158, -159 }, { 163, 166 }, { 164, 165 },
+	{ -166, -167 }, { -169, -175 }, { 167, 168 }, { -176, -181 },
+	{ -183, -184 }, { 170, 180 }, { 171, 174 }, { 172, 173 },
+	{ -189, -192 }, { -198, -232 }, { 175, 177 }, { -240, 176 },
+	{ -10, -143 }, { 178, 179 }, { -145, -146 }, { -149, -160 },
+	{ 181, 190 }, { 182, 185 }, { 183, 184 }, { -172, -207 },
+	{ -216, -226 }, { 186, 187 }, { -237, -238 }, { 188, 189 },
+	{ -200, -208 }, { -235, -236 }, { 191, 207 }, { 192, 199 },
+	{ 193, 196 }, { 194, 195 }, { -193, -194 }, { -201, -202 },
+	{ 197, 198 }, { -203, -206 }, { -211, -214 }, { 200, 203 },
+	{ 201, 202 }, { -219, -220 }, { -239, -241 }, { 204, 205 },
+	{ -243, -244 }, { -256, 206 }, { -204, -205 }, { 208, 223 },
+	{ 209, 216 }, { 210, 213 }, { 211, 212 }, { -212, -213 },
+	{ -215, -222 }, { 214, 215 }, { -223, -224 }, { -242, -245 },
+	{ 217, 220 }, { 218, 219 }, { -246, -247 }, { -248, -249 },
+	{ 221, 222 }, { -251, -252 }, { -253, -254 }, { 224, 238 },
+	{ 225, 231 }, { 226, 228 }, { -255, 227 }, { -3, -4 },
+	{ 229, 230 }, { -5, -6 }, { -7, -8 }, { 232, 235 },
+	{ 233, 234 }, { -9, -12 }, { -13, -15 }, { 236, 237 },
+	{ -16, -17 }, { -18, -19 }, { 239, 246 }, { 240, 243 },
+	{ 241, 242 }, { -20, -21 }, { -22, -24 }, { 244, 245 },
+	{ -25, -26 }, { -27, -28 }, { 247, 250 }, { 248, 249 },
+	{ -29, -30 }, { -31, -32 }, { 251, 252 }, { -128, -221 },
+	{ -250, 253 }, { 254, 255 }, { -11, -14 }, { -23, -257 },
+};
+
+struct hpack_field {
+	size_t namelen;
+	size_t vallen;
+	char *val;
+	char name[0];
+};
+
+/* the overhead RFC 7541 charges for each entry */
+#define FIELD_OVERHEAD 32
+
+/* dst must hold len * 8 / 5 bytes; the shortest code is 5 bits. */
+static int
+huff_decode(const unsigned char *src, size_t len, char *dst, size_t *dstlen)
+{
+	size_t i, n;
+	int b, node, child, depth, allones;
+
+	n = 0;
+	node = 0;
+	depth = 0;
+	allones = 1;
+	for (i = 0; i < len; i++) {
+		for (b = 7; b >= 0; b--) {
+			child = huff_tree[node][(src[i] >> b) & 1];
+			if (child < 0) {
+				if (child == -257)
+					return -1;	/* EOS */
+				dst[n++] = -child - 1;
+				node = 0;
+				depth = 0;
+				allones = 1;
+			} else {
+				node = child;
+				depth++;
+				allones &= (src[i] >> b) & 1;
+			}
+		}
+	}
+
+	/* padding must be a prefix of EOS and shorter than a byte */
+	if (depth > 7 || !allones)
+		return -1;
+
+	*dstlen = n;
+	return 0;
+}
+
+static int
+decode_int(const unsigned char **pp, const unsigned char *end, int prefix,
+	   size_t *out)
+{
+	const unsigned char *p = *pp;
+	size_t mask = (1 << prefix) - 1;
+	size_t val;
+	int shift;
+
+	if (p >= end)
+		return -1;
+	val = *p++ & mask;
+	if (val == mask) {
+		shift = 0;
+		do {
+			if (p >= end || shift > 21)
+				return -1;
+			val += (size_t)(*p & 0x7f) << shift;
+			shift += 7;
+		} while (*p++ & 0x80);
+	}
+
+	*pp = p;
+	*out = val;
+
+	return 0;
+}
+
+/* caller must free *out */
+static int
+decode_string(const unsigned char **pp, const unsigned char *end,
+	      char **out, size_t *outlen)
+{
+	const unsigned char *p = *pp;
+	size_t len;
+	int huff;
+	char *str;
+
+	if (p >= end)
+		return -1;
+	huff = *p & 0x80;
+	if (decode_int(&p, end, 7, &len) < 0 || len > (size_t)(end - p))
+		return -1;
+
+	if (huff) {
+		str = mem_malloc(len * 8 / 5 + 1);
+		if (huff_decode(p, len, str, outlen) < 0) {
+			mem_free(str);
+			return -1;
+		}
+	} else {
+		str = mem_malloc(len + 1);
+		memcpy(str, p, len);
+		*outlen = len;
+	}
+	str[*outlen] = '\0';
+
+	*pp = p + len;
+	*out = str;
+
+	return 0;
+}
+
+static struct hpack_field *
+table_get(struct hpack_table *table, size_t i)
+{
+	assert(i < table->nfields);
+	return table->fields[(table->first + i) % table->cap];
+}
+
+static void
+table_evict(struct hpack_table *table, size_t max)
+{
+	struct hpack_field *f;
+
+	while (table->size > max) {
+		assert(table->nfields > 0);
+		f = table_get(table, table->nfields - 1);
+		table->size -= FIELD_OVERHEAD + f->namelen + f->vallen;
+		table->nfields--;
+		mem_free(f);
+	}
+}
+
+static void
+table_insert(struct hpack_table *table, const char *name, size_t namelen,
+	     const char *val, size_t vallen)
+{
+	struct hpack_field *f, **fields;
+	size_t i, size;
+
+	size = FIELD_OVERHEAD + namelen + vallen;
+	if (size > table->max_size) {
+		/* too big for the table; it just empties it */
+		table_evict(table, 0);
+		return;
+	}
+	table_evict(table, table->max_size - size);
+
+	if (table->nfields == table->cap) {
+		fields = mem_calloc(table->cap ? table->cap * 2 : 16,
+				    sizeof(*fields));
+		for (i = 0; i < table->nfields; i++)
+			fields[i] = table_get(table, i);
+		mem_free(table->fields);
+		table->fields = fields;
+		table->cap = table->cap ? table->cap * 2 : 16;
+		table->first = 0;
+	}
+
+	f = mem_malloc(sizeof(*f) + namelen + vallen + 2);
+	f->namelen = namelen;
+	f->vallen = vallen;
+	memcpy(f->name, name, namelen);
+	f->name[namelen] = '\0';
+	f->val = f->name + namelen + 1;
+	memcpy(f->val, val, vallen);
+	f->val[vallen] = '\0';
+
+	table->first = (table->first + table->cap - 1) % table->cap;
+	table->fields[table->first] = f;
+	table->nfields++;
+	table->size += size;
+}
+
+static int
+lookup(struct hpack_table *table, size_t idx, const char **name,
+       size_t *namelen, const char **val, size_t *vallen)
+{
+	struct hpack_field *f;
+
+	if (idx == 0)
+		return -1;
+	if (idx <= STATIC_TABLE_LEN) {
+		*name = static_table[idx - 1].name;
+		*namelen = strlen(*name);
+		*val = static_table[idx - 1].val;
+		*vallen = strlen(*val);
+		return 0;
+	}
+	idx -= STATIC_TABLE_LEN + 1;
+	if (idx >= table->nfields)
+		return -1;
+	f = table_get(table, idx);
+	*name = f->name;
+	*namelen = f->namelen;
+	*val = f->val;
+	*vallen = f->vallen;
+
+	return 0;
+}
+
+void
+hpack_table_init(struct hpack_table *table, size_t limit)
+{
+	memset(table, 0, sizeof(*table));
+	table->max_size = limit;
+	table->limit = limit;
+}
+
+void
+hpack_table_clear(struct hpack_table *table)
+{
+	table_evict(table, 0);
+	mem_free(table->fields);
+	table->fields = NULL;
+	table->cap = 0;
+	table->first = 0;
+}
+
+/* a literal field; prefix is the size of the index field. */
+static int
+decode_literal(struct hpack_table *table, const unsigned char **pp,
+	       const unsigned char *end, int prefix, int indexed,
+	       hpack_header_cb cb, void *arg)
+{
+	const char *sname, *sval;
+	char *name, *val;
+	size_t idx, namelen, vallen;
+	int ret;
+
+	name = val = NULL;
+	ret = -1;
+
+	if (decode_int(pp, end, prefix, &idx) < 0)
+		return -1;
+	if (idx) {
+		if (lookup(table, idx, &sname, &namelen, &sval, &vallen) < 0)
+			return -1;
+		name = mem_strdup_n(sname, namelen);
+	} else if (decode_string(pp, end, &name, &namelen) < 0)
+		return -1;
+
+	if (decode_string(pp, end, &val, &vallen) < 0)
+		goto out;
+
+	if (cb(name, namelen, val, vallen, arg) < 0)
+		goto out;
+
+	if (indexed)
+		table_insert(table, name, namelen, val, vallen);
+	ret = 0;
+
+out:
+	mem_free(name);
+	mem_free(val);
+
+	return ret;
+}
+
+int
+hpack_decode(struct hpack_table *table, const unsigned char *block,
+	     size_t len, hpack_header_cb cb, void *arg)
+{
+	const unsigned char *p = block, *end = block + len;
+	const char *name, *val;
+	size_t idx, namelen, vallen;
+
+	while (p < end) {
+		if (*p & 0x80) {
+			/* indexed header field */
+			if (decode_int(&p, end, 7, &idx) < 0 ||
+			    lookup(table, idx, &name, &namelen,
+				   &val, &vallen) < 0)
+				return -1;
+			if (cb(name, namelen, val, vallen, arg) < 0)
+				return -1;
+		} else if (*p & 0x40) {
+			/* literal with incremental indexing */
+			if (decode_literal(table, &p, end, 6, 1, cb, arg) < 0)
+				return -1;
+		} else if (*p & 0x20) {
+			/* dynamic table size update */
+			if (decode_int(&p, end, 5, &idx) < 0 ||
+			    idx > table->limit)
+				return -1;
+			table->max_size = idx;
+			table_evict(table, idx);
+		} else {
+			/* literal without indexing, or never indexed */
+			if (decode_literal(table, &p, end, 4, 0, cb, arg) < 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+encode_int(struct evbuffer *out, unsigned char first, int prefix, size_t val)
+{
+	unsigned char buf[16];
+	size_t mask = (1 << prefix) - 1;
+	size_t n = 0;
+
+	if (val < mask)
+		buf[n++] = first | val;
+	else {
+		buf[n++] = first | mask;
+		val -= mask;
+		while (val >= 128) {
+			buf[n++] = (val & 0x7f) | 0x80;
+			val >>= 7;
+		}
+		buf[n++] = val;
+	}
+
+	evbuffer_add(out, buf, n);
+}
+
+static void
+encode_string(struct evbuffer *out, const char *str, size_t len)
+{
+	encode_int(out, 0x00, 7, len);
+	evbuffer_add(out, str, len);
+}
+
+void
+hpack_encode_status(struct evbuffer *out, int code)
+{
+	char buf[16];
+	size_t i;
+
+	evutil_snprintf(buf, sizeof(buf), "%d", code);
+
+	for (i = 0; i < STATIC_TABLE_LEN; i++) {
+		if (!strcmp(static_table[i].name, ":status") &&
+		    !strcmp(static_table[i].val, buf)) {
+			encode_int(out, 0x80, 7, i + 1);
+			return;
+		}
+	}
+
+	/* literal without indexing, name from the table */
+	encode_int(out, 0x00, 4, 8);
+	encode_string(out, buf, strlen(buf));
+}
+
+void
+hpack_encode_header(struct evbuffer *out, const char *name, const char *val)
+{
+	char *lower;
+	size_t i, len;
+
+	for (i = 0; i < STATIC_TABLE_LEN; i++) {
+		if (!evutil_ascii_strcasecmp(static_table[i].name, name))
+			break;
+	}
+
+	if (i < STATIC_TABLE_LEN)
+		encode_int(out, 0x00, 4, i + 1);
+	else {
+		/* h2 wants lower case names */
+		len = strlen(name);
+		lower = mem_strdup(name);
+		for (i = 0; i < len; i++) {
+			if (lower[i] >= 'A' && lower[i] <= 'Z')
+				lower[i] += 'a' - 'A';
+		}
+		encode_int(out, 0x00, 4, 0);
+		encode_string(out, lower, len);
+		mem_free(lower);
+	}
+
+	encode_string(out, val, strlen(val));
+}
+
+#ifdef TEST_HPACK
+#include <stdio.h>
+
+/* RFC 7541, appendix B. the code is canonical, so the lengths are
+   enough to rebuild it; symbol 256 is EOS. */
+static const unsigned char huff_lens[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+
+static void
+huff_build(short tree[256][2])
+{
+	int order[257];
+	int i, j, sym, len, prevlen, node, bit, nnodes;
+	ev_uint32_t code;
+
+	for (i = 0; i < 257; i++) {
+		/* insertion sort by (length, symbol) */
+		for (j = i; j > 0 && huff_lens[order[j - 1]] > huff_lens[i];
+		     j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	nnodes = 1;
+	code = 0;
+	prevlen = huff_lens[order[0]];
+	for (i = 0; i < 257; i++) {
+		sym = order[i];
+		len = huff_lens[sym];
+		if (i > 0)
+			code++;
+		code <<= len - prevlen;
+		prevlen = len;
+
+		node = 0;
+		for (j = len - 1; j > 0; j--) {
+			bit = (code >> j) & 1;
+			if (!tree[node][bit]) {
+				assert(nnodes < 256);
+				tree[node][bit] = nnodes++;
+			}
+			node = tree[node][bit];
+		}
+		tree[node][code & 1] = -(sym + 1);
+	}
+}
+
+static int
+print_header(const char *name, size_t namelen, const char *val,
+	     size_t vallen, void *arg)
+{
+	printf("%s: %s\n", name, val);
+	return 0;
+}
+
+/* decode the header blocks from RFC 7541, C.4, which share one table */
+int
+main(int argc, char **argv)
+{
+	static const char *blocks[] = {
+		"828684418cf1e3c2e5f23a6ba0ab90f4ff",
+		"828684be5886a8eb10649cbf",
+		"828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+		NULL
+	};
+	static short tree[256][2];
+	struct hpack_table table;
+	unsigned char buf[256];
+	unsigned int c;
+	size_t i, n;
+
+	huff_build(tree);
+	if (memcmp(tree, huff_tree, sizeof(tree))) {
+		printf("huffman tree doesn't match the code lengths\n");
+		return 1;
+	}
+
+	hpack_table_init(&table, 4096);
+
+	for (i = 0; blocks[i]; i++) {
+		for (n = 0; sscanf(blocks[i] + n * 2, "%2x", &c) == 1; n++)
+			buf[n] = c;
+		if (hpack_decode(&table, buf, n, print_header, NULL) < 0) {
+			printf("block %u: FAILED\n", (unsigned)i);
+			return 1;
+		}
+		printf("-- table size %u\n", (unsigned)table.size);
+	}
+
+	hpack_table_clear(&table);
+
+	return 0;
+}
+#endif
@@ -0,0 +1,36 @@
+#ifndef _HPACK_H_
+#define _HPACK_H_
+
+#include <event2/util.h>
+
+struct evbuffer;
+struct hpack_field;
+
+/* a decoder's dynamic table (RFC 7541, section 2.3.2) */
+struct hpack_table {
+	struct hpack_field **fields;	/* ring, newest entry at first */
+	size_t cap;
+	size_t first;
+	size_t nfields;
+	size_t size;
+	size_t max_size;		/* as set by the encoder */
+	size_t limit;			/* the most we let it set */
+};
+
+/* name and val are nul terminated. return -1 to stop decoding. */
+typedef int (*hpack_header_cb)(const char *name, size_t namelen,
+			       const char *val, size_t vallen, void *arg);
+
+void hpack_table_init(struct hpack_table *table, size_t limit);
+void hpack_table_clear(struct hpack_table *table);
+
+/* return: -1 on a compression error or if cb stopped us, 0 ok. */
+int hpack_decode(struct hpack_table *table, const unsigned char *block,
+		 size_t len, hpack_header_cb cb, void *arg);
+
+/* the encoder never indexes, so it needs no state. */
+void hpack_encode_status(struct evbuffer *out, int code);
+void hpack_encode_header(struct evbuffer *out, const char *name,
+			 const char *val);
+
+#endif
@@ -12,6 +12,8 @@
 #include <event2/buffer.h>
 
 #include "httpconn.h"
+#include "workpool.h"
+#include "relay.h"
 #include "conn.h"
 #include "headers.h"
 #include "util.h"
@@ -30,38 +32,127 @@
 
 /* max amount of data we can have backlogged on outbuf before choaking */
 static size_t max_write_backlog = 50 * 1024;
+/* ... and pieces of body out with a worker */
+static size_t max_work_backlog = 8;
+
+/* tunnels move bulk data, so let them use fewer, larger syscalls */
+static size_t max_tunnel_backlog = 256 * 1024;
+static size_t tunnel_io_size = 64 * 1024;
+
+/* what an optimistic tunnel will read from its client before the far end
+   is connected; enough for a TLS ClientHello */
+static size_t max_tunnel_early_data = 16 * 1024;
+
+/* how long a hung up tunnel direction may sit on unwritten data */
+static struct timeval tunnel_flush_timeout = {30, 0};
+
+/* how much work a single read wakeup may do before yielding to the loop */
+static ev_ssize_t max_bytes_per_wakeup = 64 * 1024;
+static int max_msgs_per_wakeup = 4;
+
+/* max bytes to pull off the socket per read, by role. clients mostly
+   send headers; servers send bodies, which we can move around cheaply. */
+static size_t client_max_single_read = 8 * 1024;
+static size_t server_max_single_read = 32 * 1024;
 
 /* the number of seconds to keep an idle connections hanging around */
 static struct timeval idle_client_timeout = {120, 0};
 static struct timeval idle_server_timeout = {120, 0};
 
+/* a body filter attached to a message */
+struct body_filter {
+	TAILQ_ENTRY(body_filter) next;
+	const struct http_filter *filter;
+	void *arg;
+	void *state;
+	struct evbuffer *in;
+};
+TAILQ_HEAD(body_filter_list, body_filter);
+
+/* a message's filters, when they run on a worker */
+struct filter_chain {
+	struct body_filter_list filters;
+	unsigned njobs;		/* handed over and not back yet */
+	int ended;		/* and no more are coming */
+	int failed;		/* only looked at by the worker */
+};
+
+/* work queue job tags */
+#define JOB_CHUNKED	0x01
+#define JOB_FINISH	0x02
+
+/* one way through a tunnel */
+enum tunnel_dir {
+	TUNNEL_DIR_OPEN,
+	TUNNEL_DIR_DRAINING,	/* the sender hung up; writing what it sent */
+	TUNNEL_DIR_SHUT		/* and the receiver has been told */
+};
+
 struct http_conn {
 	enum http_state state;
 	enum http_version vers;
 	enum http_te te;
 	enum http_type type;
 	enum http_te output_te;
+	enum http_priority priority;
 	int choked;
 	int has_body;
 	int read_paused;
 	int tunnel_read_paused;
+	int tunnel_optimistic;
+	struct evbuffer *tunnel_early;	/* conn.c's, while connecting */
+	enum tunnel_dir tunnel_up;	/* client to server */
+	enum tunnel_dir tunnel_down;	/* server to client */
+	struct timeval tunnel_idle;
+	struct timeval tunnel_lifetime;
+	struct timeval tunnel_started;
+	struct timeval tunnel_active;
+	ev_uint64_t tunnel_bytes_up;
+	ev_uint64_t tunnel_bytes_down;
 	int msg_complete_on_eof;
 	int persistent;
 	int expect_continue;
 	int will_flush;
 	int will_free;
+	int filter_failed;
+	ev_ssize_t bytes_budget;
+	int msgs_budget;
 	const struct http_cbs *cbs;
 	void *cbarg;
 	ev_int64_t body_length;
 	ev_int64_t data_remaining;
 	char *firstline;
+	char *connect_error;
 	struct header_list *headers;
 	struct event_base *base;
 	struct bufferevent *bev;
 	struct bufferevent *tunnel_bev;
 	struct evbuffer *inbuf_processed;
+	struct event *resume_ev;
+	struct event *tunnel_expire_ev;
+	/* added for the next message, and running on the current one */
+	struct body_filter_list pending_filters;
+	struct body_filter_list filters;
+	struct evbuffer *filter_out;
+	/* with a work pool, filters run on a worker instead */
+	struct work_pool *work_pool;
+	struct work_queue *work;
+	struct filter_chain *chain;	/* the current message's */
+	struct evbuffer *work_held;	/* written while body is out */
+	int work_choked;
+	int work_failed;
+	int work_waiting;		/* to open a tunnel or release bev */
+	int will_release;
+	/* with a relay pool, open tunnels are carried on its threads */
+	struct relay_pool *relay_pool;
+	struct relay *relay;
 };
 
+static struct evbuffer *conn_output(struct http_conn *conn);
+static int work_pending(struct http_conn *conn);
+static int work_wait(struct http_conn *conn);
+static void release_bev(struct http_conn *conn);
+
 static int
 method_from_string(enum http_method *m, const char *method)
 {
@@ -75,6 +166,14 @@ method_from_string(enum http_method *m, const char *method)
 		*m = METH_PUT;
 	else if (!evutil_ascii_strcasecmp(method, "CONNECT"))
 		*m = METH_CONNECT;
+	else if (!evutil_ascii_strcasecmp(method, "OPTIONS"))
+		*m = METH_OPTIONS;
+	else if (!evutil_ascii_strcasecmp(method, "DELETE"))
+		*m = METH_DELETE;
+	else if (!evutil_ascii_strcasecmp(method, "TRACE"))
+		*m = METH_TRACE;
+	else if (!evutil_ascii_strcasecmp(method, "PATCH"))
+		*m = METH_PATCH;
 	else {
 		log_warn("method_from_string: unknown method, '%s'", method);
 		return -1;
@@ -97,6 +196,14 @@ http_method_to_string(enum http_method m)
 		return "PUT";
 	case METH_CONNECT:
 		return "CONNECT";
+	case METH_OPTIONS:
+		return "OPTIONS";
+	case METH_DELETE:
+		return "DELETE";
+	case METH_TRACE:
+		return "TRACE";
+	case METH_PATCH:
+		return "PATCH";
 	}
 
 	log_fatal("http_method_to_string: unknown method %d", m);
@@ -172,11 +279,25 @@ http_conn_error_to_string(enum http_conn_error err)
 		return "Tunnel connection failed";
 	case ERROR_TUNNEL_CLOSED:
 		return "Tunnel closed";
+	case ERROR_TUNNEL_TIMEDOUT:
+		return "Tunnel timed out";
 	}
 
 	return "???";
 }
 
+static void
+set_priority(struct http_conn *conn, enum http_priority prio)
+{
+	if (conn->priority == prio)
+		return;
+	conn->priority = prio;
+	bufferevent_priority_set(conn->bev, prio);
+	event_priority_set(conn->resume_ev, prio);
+	if (conn->tunnel_bev)
+		bufferevent_priority_set(conn->tunnel_bev, prio);
+}
+
 static void
 begin_message(struct http_conn *conn)
 {
@@ -184,6 +305,7 @@ begin_message(struct http_conn *conn)
 	conn->headers = mem_calloc(1, sizeof(*conn->headers));
 	TAILQ_INIT(conn->headers);
 	conn->state = HTTP_STATE_IDLE;
+	set_priority(conn, HTTP_PRIORITY_HIGH);
 	if (!conn->read_paused)
 		bufferevent_enable(conn->bev, EV_READ);
 	// XXX we should have a separate function to tell that server is idle.
@@ -259,6 +381,7 @@ build_request(struct http_conn *conn)
 	req->url = u;
 	u = NULL;
 	req->headers = conn->headers;
+	event_base_gettimeofday_cached(conn->base, &req->received);
 
 out:
 	url_free(u);
@@ -315,7 +438,7 @@ parse_chunk_len(struct http_conn *conn)
 	char *line;
 	ev_int64_t len;
 
-	while ((line = evbuffer_readln(inbuf, NULL, EVBUFFER_EOL_CRLF))) {
+	while ((line = mem_readln(inbuf))) {
 		if (*line == '\0') {
 			mem_free(line);
 			continue;
@@ -343,7 +466,8 @@ read_chunk(struct http_conn *conn)
 	char *line;
 	int ret;
 	
-	while ((len = evbuffer_get_length(inbuf)) > 0) {
+	while ((len = evbuffer_get_length(inbuf)) > 0 &&
+	       conn->bytes_budget > 0) {
 		if (conn->data_remaining < 0) {
 			ret = parse_chunk_len(conn);
 			if (ret <= 0) {
@@ -353,7 +477,7 @@ read_chunk(struct http_conn *conn)
 				return;
 			}
 		} else if (conn->data_remaining == 0) {
-			line = evbuffer_readln(inbuf, NULL, EVBUFFER_EOL_CRLF);
+			line = mem_readln(inbuf);
 			if (line) {
 				/* XXX doesn't handle trailers */
 				mem_free(line);		
@@ -364,11 +488,14 @@ read_chunk(struct http_conn *conn)
 			/* XXX should mind potential overflow */
 			if (len >= (size_t)conn->data_remaining)
 				len = (size_t)conn->data_remaining;
+			if (len > (size_t)conn->bytes_budget)
+				len = (size_t)conn->bytes_budget;
 
 			evbuffer_remove_buffer(inbuf, conn->inbuf_processed,
 					       len);
 			EVENT1(conn, on_read_body, conn->inbuf_processed);
 			conn->data_remaining -= len;
+			conn->bytes_budget -= len;
 
 			if (conn->data_remaining == 0)
 				conn->data_remaining = -1;
@@ -393,22 +520,57 @@ read_body(struct http_conn *conn)
 	if (len) {
 		/* XXX should mind potential overflow */
 		if (conn->data_remaining >= 0 &&
-		    len > (size_t)conn->data_remaining) {
+		    len > (size_t)conn->data_remaining)
 			len = (size_t)conn->data_remaining;
+		/* the rest waits for the next pass, as headers do */
+		if (len > (size_t)conn->bytes_budget)
+			len = (size_t)conn->bytes_budget;
+		if (len == evbuffer_get_length(inbuf))
+			evbuffer_add_buffer(conn->inbuf_processed, inbuf);
+		else
 			evbuffer_remove_buffer(inbuf, conn->inbuf_processed,
 					       len);
-			EVENT1(conn, on_read_body, conn->inbuf_processed);
-		} else {
-			evbuffer_add_buffer(conn->inbuf_processed, inbuf);
-			EVENT1(conn, on_read_body, conn->inbuf_processed);
-		}
+		EVENT1(conn, on_read_body, conn->inbuf_processed);
 
 		conn->data_remaining -= len;
+		conn->bytes_budget -= len;
 		if (conn->data_remaining == 0)
 			end_message(conn, ERROR_NONE);
 	}
 }
 
+static int
+has_conn_token(struct http_conn *conn, const char *token)
+{
+	if (headers_has_token(conn->headers, "Connection", token))
+		return 1;
+	return conn->type == HTTP_CLIENT &&
+	       headers_has_token(conn->headers, "Proxy-Connection", token);
+}
+
+/* headers that only describe the connection they arrived on. if upgrade
+   is set, Upgrade is kept. return: 1 if Upgrade was kept. */
+static int
+remove_hop_headers(struct header_list *headers, int upgrade)
+{
+	char *proto = NULL;
+
+	if (upgrade)
+		proto = headers_find(headers, "Upgrade");
+	headers_remove_listed(headers, "Connection");
+	headers_remove(headers, "Connection");
+	headers_remove(headers, "Proxy-Connection");
+	headers_remove(headers, "Keep-Alive");
+	headers_remove(headers, "Upgrade");
+	if (!proto)
+		return 0;
+
+	headers_add_key_val(headers, "Upgrade", proto);
+	mem_free(proto);
+
+	return 1;
+}
+
 static enum http_conn_error
 check_headers(struct http_conn *conn, struct http_request *req,
 	   struct http_response *resp)
@@ -428,12 +590,23 @@ check_headers(struct http_conn *conn, struct http_request *req,
 
 	if (conn->type == HTTP_CLIENT) {
 		vers = req->vers;
-		conn->has_body = 0;
-		if (req->meth == METH_POST ||
-		    req->meth == METH_PUT)
-			conn->has_body = 1;
-		else if (req->meth == METH_CONNECT)
+		switch (req->meth) {
+		case METH_POST:
+		case METH_PUT:
+		case METH_PATCH:
+			break;
+		case METH_CONNECT:
 			tunnel = 1;
+			conn->has_body = 0;
+			break;
+		default:
+			/* anything else only has a body if it's framed */
+			conn->has_body =
+			    headers_has_key(conn->headers,
+					    "transfer-encoding") ||
+			    headers_has_key(conn->headers, "content-length");
+			break;
+		}
 
 		val = headers_find(conn->headers, "Expect");
 		if (val) {
@@ -498,26 +671,32 @@ check_headers(struct http_conn *conn, struct http_request *req,
 
 	assert(vers != HTTP_UNKNOWN);
 
+	/* 1.1 persists unless told otherwise; 1.0 only with the keep-alive
+	   extension. Either needs us to know where the body ends. Clients
+	   talking to a proxy often say Proxy-Connection instead. */
 	persistent = 0;
-	if (!tunnel && !conn->msg_complete_on_eof && vers == HTTP_11)
-		persistent = 1;
+	if (!tunnel && !conn->msg_complete_on_eof) {
+		if (vers == HTTP_11)
+			persistent = 1;
+		else if (has_conn_token(conn, "keep-alive"))
+			persistent = 1;
+		if (has_conn_token(conn, "close"))
+			persistent = 0;
+	}
 
 	if (conn->vers != HTTP_UNKNOWN && conn->vers != vers) {
 		log_warn("http_conn: http version changed!");
 		persistent = 0;
 	}
 	conn->vers = vers;
-
-	if (persistent) {
-		val = headers_find(conn->headers, "connection");
-		if (val) {
-			if (!evutil_ascii_strcasecmp(val, "close"))
-				persistent = 0;
-			mem_free(val);
-		}
-	}
 	conn->persistent = persistent;
 
+	/* nothing may follow an upgrade request until we see the answer */
+	if (conn->type == HTTP_CLIENT && !tunnel && !conn->has_body &&
+	    headers_has_token(conn->headers, "Connection", "upgrade") &&
+	    headers_has_key(conn->headers, "Upgrade"))
+		req->upgrade = 1;
+
 	return ERROR_NONE;
 }
 
@@ -543,6 +722,15 @@ read_headers(struct http_conn *conn)
 
 	assert(conn->firstline);
 
+	if (conn->type == HTTP_CLIENT && conn->cbs->on_client_h2_preface &&
+	    !strcmp(conn->firstline, "PRI * HTTP/2.0") &&
+	    TAILQ_EMPTY(conn->headers)) {
+		mem_free(conn->firstline);
+		conn->firstline = NULL;
+		EVENT0(conn, on_client_h2_preface);
+		return;
+	}
+
 	if (conn->type == HTTP_CLIENT) {
 		req = build_request(conn);
 		if (!req)
@@ -568,6 +756,8 @@ read_headers(struct http_conn *conn)
 	if (err == ERROR_NONE) {
 		int server_continuation = 0;
 
+		conn->msgs_budget--;
+
 		/* ownership of req or resp is now passed on */
 		if (req)
 			EVENT1(conn, on_client_request, req);
@@ -581,12 +771,20 @@ read_headers(struct http_conn *conn)
 				EVENT1(conn, on_server_response, resp);
 		}
 
+		/* the callback may have let go of us */
+		if (conn->will_free)
+			return;
+
+		/* a CONNECT may have been given a tunnel straight away */
 		if (!server_continuation &&
-		    conn->state != HTTP_STATE_TUNNEL_CONNECTING) {
-			if (!conn->has_body)
+		    conn->state != HTTP_STATE_TUNNEL_CONNECTING &&
+		    conn->state != HTTP_STATE_TUNNEL_OPEN) {
+			if (!conn->has_body) {
 				end_message(conn, ERROR_NONE);
-			else
+			} else {
 				conn->state = HTTP_STATE_READ_BODY;
+				set_priority(conn, HTTP_PRIORITY_LOW);
+			}
 		}
 	} else {
 		http_request_free(req);
@@ -601,14 +799,21 @@ tunnel_transfer_data(struct http_conn *conn, struct bufferevent *to,
 {
 	struct evbuffer *frombuf = bufferevent_get_input(from);
 	struct evbuffer *tobuf = bufferevent_get_output(to);
+	size_t len = evbuffer_get_length(frombuf);
 
-	if (evbuffer_get_length(frombuf) == 0)
+	if (len == 0)
 		return;
 
+	if (from == conn->bev)
+		conn->tunnel_bytes_up += len;
+	else
+		conn->tunnel_bytes_down += len;
+	event_base_gettimeofday_cached(conn->base, &conn->tunnel_active);
+
 	evbuffer_add_buffer(tobuf, frombuf);
-	if (evbuffer_get_length(tobuf) > max_write_backlog) {
+	if (evbuffer_get_length(tobuf) > max_tunnel_backlog) {
 		bufferevent_setwatermark(to, EV_WRITE,
-					 max_write_backlog / 2, 0);
+					 max_tunnel_backlog / 2, 0);
 		bufferevent_disable(from, EV_READ);
 		if (from == conn->bev) {
 			log_debug("tunnel: throttling client read");
@@ -620,11 +825,104 @@ tunnel_transfer_data(struct http_conn *conn, struct bufferevent *to,
 	}
 }
 
+/* the direction that writes to bev */
+static enum tunnel_dir *
+tunnel_dir_into(struct http_conn *conn, struct bufferevent *bev)
+{
+	return bev == conn->bev ? &conn->tunnel_down : &conn->tunnel_up;
+}
+
+static void
+tunnel_close(struct http_conn *conn, enum http_conn_error err)
+{
+	bufferevent_setcb(conn->bev, NULL, NULL, NULL, NULL);
+	bufferevent_setcb(conn->tunnel_bev, NULL, NULL, NULL, NULL);
+	if (conn->tunnel_expire_ev)
+		evtimer_del(conn->tunnel_expire_ev);
+	EVENT1(conn, on_error, err);
+}
+
+/* tunnels mostly share a few timeout values, which libevent can keep
+   in plain queues rather than its heap */
+static const struct timeval *
+tunnel_timeout(struct http_conn *conn, const struct timeval *tv)
+{
+	const struct timeval *common;
+
+	common = event_base_init_common_timeout(conn->base, tv);
+
+	return common ? common : tv;
+}
+
+/* what's queued for bev must start moving within the flush timeout */
+static void
+tunnel_set_flush_deadline(struct http_conn *conn, struct bufferevent *bev)
+{
+	const struct timeval *idle = NULL;
+
+	if (evutil_timerisset(&conn->tunnel_idle))
+		idle = tunnel_timeout(conn, &conn->tunnel_idle);
+	bufferevent_set_timeouts(bev, idle,
+				 tunnel_timeout(conn, &tunnel_flush_timeout));
+}
+
+/* bev's output is empty; pass its peer's hang up on. closes the tunnel
+   once both ways are done. */
+static void
+tunnel_shutdown(struct http_conn *conn, struct bufferevent *bev)
+{
+	evutil_socket_t fd = bufferevent_getfd(bev);
+
+	*tunnel_dir_into(conn, bev) = TUNNEL_DIR_SHUT;
+	if (fd >= 0)
+		shutdown(fd, SHUT_WR);
+	else	/* a pair: its partner reads EOF */
+		bufferevent_flush(bev, EV_WRITE, BEV_FINISHED);
+
+	if (conn->tunnel_up == TUNNEL_DIR_SHUT &&
+	    conn->tunnel_down == TUNNEL_DIR_SHUT) {
+		log_debug("tunnel: both sides hung up");
+		tunnel_close(conn, ERROR_TUNNEL_CLOSED);
+	}
+}
+
+/* from won't send any more. the other way stays open. */
+static void
+tunnel_eof(struct http_conn *conn, struct bufferevent *from)
+{
+	struct bufferevent *to;
+
+	if (from == conn->bev) {
+		to = conn->tunnel_bev;
+		conn->read_paused = 0;
+	} else {
+		to = conn->bev;
+		conn->tunnel_read_paused = 0;
+	}
+	/* a pair can say it twice */
+	if (*tunnel_dir_into(conn, to) != TUNNEL_DIR_OPEN)
+		return;
+
+	*tunnel_dir_into(conn, to) = TUNNEL_DIR_DRAINING;
+	bufferevent_disable(from, EV_READ);
+	tunnel_transfer_data(conn, to, from);
+	bufferevent_setwatermark(to, EV_WRITE, 0, 0);
+
+	if (evbuffer_get_length(bufferevent_get_output(to)) == 0)
+		tunnel_shutdown(conn, to);
+	else
+		tunnel_set_flush_deadline(conn, to);
+}
+
 static void
 tunnel_writecb(struct bufferevent *bev, void *_conn)
 {
 	struct http_conn *conn = _conn;
 
+	/* an optimistic 200 went out */
+	if (conn->state == HTTP_STATE_TUNNEL_CONNECTING)
+		return;
+
 	if (conn->state == HTTP_STATE_TUNNEL_OPEN) {
 		if (conn->tunnel_read_paused && bev == conn->bev) {
 			log_debug("tunnel: unthrottling server read");
@@ -637,33 +935,116 @@ tunnel_writecb(struct bufferevent *bev, void *_conn)
 			bufferevent_enable(conn->bev, EV_READ);
 			bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
 		}
+		if (*tunnel_dir_into(conn, bev) == TUNNEL_DIR_DRAINING &&
+		    !evbuffer_get_length(bufferevent_get_output(bev)))
+			tunnel_shutdown(conn, bev);
 	} else {
 		log_debug("tunnel: flushed!");
-		bufferevent_setcb(conn->bev, NULL, NULL, NULL, NULL);
-		bufferevent_setcb(conn->tunnel_bev, NULL, NULL, NULL, NULL);
-		EVENT1(conn, on_error, ERROR_TUNNEL_CLOSED);
+		tunnel_close(conn, ERROR_TUNNEL_CLOSED);
 	}
 }
 
+/* hand what an optimistic client sends ahead over to conn.c, up to a
+   cap; past that, stop reading until the far end is up */
+static void
+tunnel_take_early(struct http_conn *conn)
+{
+	struct evbuffer *in = bufferevent_get_input(conn->bev);
+	size_t have = evbuffer_get_length(conn->tunnel_early);
+
+	if (have < max_tunnel_early_data)
+		evbuffer_remove_buffer(in, conn->tunnel_early,
+				       max_tunnel_early_data - have);
+	if (evbuffer_get_length(in))
+		bufferevent_disable(conn->bev, EV_READ);
+}
+
 static void
 tunnel_readcb(struct bufferevent *bev, void *_conn)
 {
 	struct http_conn *conn = _conn;
 
+	if (conn->state == HTTP_STATE_TUNNEL_CONNECTING) {
+		if (conn->tunnel_early)
+			tunnel_take_early(conn);
+		else
+			bufferevent_disable(bev, EV_READ);
+		return;
+	}
+
 	if (bev == conn->bev)
 		tunnel_transfer_data(conn, conn->tunnel_bev, bev);
 	else
 		tunnel_transfer_data(conn, conn->bev, bev);
 }
 
+/* the read timeouts are per side, but a tunnel is only idle when
+   neither side has sent anything, so one quiet side is let off while
+   the other is busy. that can leave a tunnel up to twice the limit. */
+static void
+tunnel_timedout(struct http_conn *conn, struct bufferevent *bev, short what)
+{
+	struct timeval now, idle;
+
+	if (conn->state == HTTP_STATE_TUNNEL_OPEN &&
+	    (what & BEV_EVENT_READING)) {
+		event_base_gettimeofday_cached(conn->base, &now);
+		evutil_timersub(&now, &conn->tunnel_active, &idle);
+		if (evutil_timercmp(&idle, &conn->tunnel_idle, <)) {
+			bufferevent_enable(bev, EV_READ);
+			return;
+		}
+	}
+
+	if (what & BEV_EVENT_WRITING)
+		log_info("tunnel: closing, couldn't write");
+	else
+		log_info("tunnel: closing, idle for %ld seconds",
+			 (long)conn->tunnel_idle.tv_sec);
+	tunnel_close(conn, ERROR_TUNNEL_TIMEDOUT);
+}
+
+static void
+tunnel_expirecb(evutil_socket_t fd, short what, void *_conn)
+{
+	struct http_conn *conn = _conn;
+
+	log_info("tunnel: closing, open for %ld seconds",
+		 (long)conn->tunnel_lifetime.tv_sec);
+	tunnel_close(conn, ERROR_TUNNEL_TIMEDOUT);
+}
+
 static void
 tunnel_errorcb(struct bufferevent *bev, short what, void *_conn)
 {
 	struct http_conn *conn = _conn;
 	struct evbuffer *buf;
 
+	if (what & BEV_EVENT_TIMEOUT) {
+		tunnel_timedout(conn, bev, what);
+		return;
+	}
+
 	switch (conn->state) {
+	case HTTP_STATE_TUNNEL_CONNECTING:
+		/* only an optimistic client is listened to this early */
+		if (what == (BEV_EVENT_EOF | BEV_EVENT_READING)) {
+			log_debug("tunnel: client hung up before we connected");
+			bufferevent_disable(bev, EV_READ);
+			conn->tunnel_up = TUNNEL_DIR_DRAINING;
+			break;
+		}
+		log_debug("tunnel: client left before we connected");
+		tunnel_close(conn, ERROR_TUNNEL_CLOSED);
+		break;
 	case HTTP_STATE_TUNNEL_OPEN:
+		if (what == (BEV_EVENT_EOF | BEV_EVENT_READING)) {
+			log_debug("tunnel: %s hung up",
+				  bev == conn->bev ? "client" : "server");
+			tunnel_eof(conn, bev);
+			break;
+		}
+		/* the connection is gone; see what it sent out and quit */
 		if (bev == conn->bev) {
 			log_debug("tunnel: client closed conn...");
 			bev = conn->tunnel_bev;
@@ -679,14 +1060,13 @@ tunnel_errorcb(struct bufferevent *bev, short what, void *_conn)
 			bufferevent_disable(bev, EV_READ);
 			bufferevent_setcb(bev, NULL, tunnel_writecb,
 					  tunnel_errorcb, conn);
+			tunnel_set_flush_deadline(conn, bev);
 			break;
 		}
 		/* nothing left to write.. lets just fall thru... */
 	case HTTP_STATE_TUNNEL_FLUSHING:
 		/* an error happend while flushing, lets just give up. */
-		bufferevent_setcb(conn->bev, NULL, NULL, NULL, NULL);
-		bufferevent_setcb(conn->tunnel_bev, NULL, NULL, NULL, NULL);
-		EVENT1(conn, on_error, ERROR_TUNNEL_CLOSED);
+		tunnel_close(conn, ERROR_TUNNEL_CLOSED);
 		break;
 	default:
 		log_fatal("tunnel: errorcb called in invalid state!");
@@ -694,28 +1074,149 @@ tunnel_errorcb(struct bufferevent *bev, short what, void *_conn)
 }
 
 static void
-tunnel_connectcb(struct bufferevent *bev, int ok, void *_conn)
+tunnel_tune_io(struct bufferevent *bev)
+{
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+	bufferevent_set_max_single_read(bev, tunnel_io_size);
+	bufferevent_set_max_single_write(bev, tunnel_io_size);
+#endif
+}
+
+static void
+set_connect_error(struct http_conn *conn, const char *err)
+{
+	mem_free(conn->connect_error);
+	conn->connect_error = err ? mem_strdup(err) : NULL;
+}
+
+static void
+tunnel_relay_done(void *_conn, enum relay_end end, ev_uint64_t up,
+		  ev_uint64_t down)
+{
+	struct http_conn *conn = _conn;
+
+	conn->relay = NULL;
+	conn->tunnel_bytes_up += up;
+	conn->tunnel_bytes_down += down;
+	tunnel_close(conn, end == RELAY_TIMEDOUT ? ERROR_TUNNEL_TIMEDOUT :
+		     ERROR_TUNNEL_CLOSED);
+}
+
+/* hand both sockets to a relay thread. the bufferevents stay, without
+   sockets, until the tunnel is closed there. */
+static void
+tunnel_relay(struct http_conn *conn)
+{
+	evutil_socket_t client = bufferevent_getfd(conn->bev);
+	evutil_socket_t server = bufferevent_getfd(conn->tunnel_bev);
+
+	/* a pair has no socket to hand over */
+	if (client < 0 || server < 0)
+		return;
+	if (relay_pool_full(conn->relay_pool)) {
+		log_debug("tunnel: relay threads are full");
+		return;
+	}
+
+	bufferevent_disable(conn->bev, EV_READ | EV_WRITE);
+	bufferevent_disable(conn->tunnel_bev, EV_READ | EV_WRITE);
+	bufferevent_setfd(conn->bev, -1);
+	bufferevent_setfd(conn->tunnel_bev, -1);
+	if (conn->tunnel_expire_ev)
+		evtimer_del(conn->tunnel_expire_ev);
+	conn->relay = relay_start(conn->relay_pool, client, server,
+				  bufferevent_get_output(conn->tunnel_bev),
+				  bufferevent_get_output(conn->bev),
+				  &conn->tunnel_idle, &conn->tunnel_lifetime,
+				  tunnel_relay_done, conn);
+	log_debug("tunnel: handed to a relay thread");
+}
+
+static void
+tunnel_open(struct http_conn *conn)
+{
+	const struct timeval *tv;
+
+	/* tunnel data mustn't overtake the body of a response before;
+	   both sides wait, unread, until on_work_done brings us back */
+	if (work_wait(conn)) {
+		log_debug("tunnel: waiting for a body to be written first");
+		conn->state = HTTP_STATE_TUNNEL_CONNECTING;
+		bufferevent_disable(conn->bev, EV_READ);
+		bufferevent_disable(conn->tunnel_bev, EV_READ);
+		bufferevent_setcb(conn->tunnel_bev, NULL, NULL, NULL, NULL);
+		return;
+	}
+	conn->state = HTTP_STATE_TUNNEL_OPEN;
+	set_priority(conn, HTTP_PRIORITY_LOW);
+	bufferevent_setcb(conn->tunnel_bev, tunnel_readcb,
+			  tunnel_writecb, tunnel_errorcb, conn);
+	tunnel_tune_io(conn->bev);
+	tunnel_tune_io(conn->tunnel_bev);
+	event_base_gettimeofday_cached(conn->base, &conn->tunnel_started);
+	conn->tunnel_active = conn->tunnel_started;
+	if (evutil_timerisset(&conn->tunnel_idle)) {
+		tv = tunnel_timeout(conn, &conn->tunnel_idle);
+		bufferevent_set_timeouts(conn->bev, tv, tv);
+		bufferevent_set_timeouts(conn->tunnel_bev, tv, tv);
+	}
+	if (evutil_timerisset(&conn->tunnel_lifetime)) {
+		conn->tunnel_expire_ev = evtimer_new(conn->base,
+						     tunnel_expirecb, conn);
+		if (!conn->tunnel_expire_ev)
+			log_fatal("http_conn: failed to create event");
+		evtimer_add(conn->tunnel_expire_ev,
+			    tunnel_timeout(conn, &conn->tunnel_lifetime));
+	}
+	bufferevent_enable(conn->bev, EV_READ);
+	bufferevent_enable(conn->tunnel_bev, EV_READ);
+	conn->read_paused = 0;
+	conn->tunnel_read_paused = 0;
+	/* either side may have sent ahead */
+	tunnel_transfer_data(conn, conn->tunnel_bev, conn->bev);
+	tunnel_transfer_data(conn, conn->bev, conn->tunnel_bev);
+	/* and an optimistic client may already have hung up */
+	if (conn->tunnel_up == TUNNEL_DIR_DRAINING) {
+		conn->tunnel_up = TUNNEL_DIR_OPEN;
+		tunnel_eof(conn, conn->bev);
+	} else if (conn->relay_pool)
+		tunnel_relay(conn);
+}
+
+static void
+write_tunnel_established(struct http_conn *conn)
+{
+	evbuffer_add_printf(conn_output(conn),
+			    "%s 200 Connection established\r\n\r\n",
+			    http_version_to_string(conn->vers));
+}
+
+static void
+tunnel_connectcb(struct bufferevent *bev, int ok, const char *err,
+		 void *_conn)
 {
 	struct http_conn *conn = _conn;
 
 	assert(conn->state == HTTP_STATE_TUNNEL_CONNECTING);
+	set_connect_error(conn, err);
+	/* conn.c has sent what was in it, or dropped it */
+	conn->tunnel_early = NULL;
 
 	if (ok) {
-		conn->state = HTTP_STATE_TUNNEL_OPEN;
-		bufferevent_setcb(conn->tunnel_bev, tunnel_readcb,
-				  tunnel_writecb, tunnel_errorcb, conn);
-		bufferevent_enable(conn->bev, EV_READ);
-		bufferevent_enable(conn->tunnel_bev, EV_READ);
-		conn->read_paused = 0;
-		conn->tunnel_read_paused = 0;
-		tunnel_transfer_data(conn, conn->tunnel_bev, conn->bev);
-		evbuffer_add_printf(bufferevent_get_output(conn->bev),
-				"%s 200 Connection established\r\n\r\n",
-				http_version_to_string(conn->vers));
+		if (!conn->tunnel_optimistic)
+			write_tunnel_established(conn);
+		if (conn->cbs->on_connect)
+			EVENT0(conn, on_connect);
+		tunnel_open(conn);
 	} else {
 		bufferevent_setcb(conn->tunnel_bev, NULL, NULL,
 				  NULL, NULL);
-		EVENT1(conn, on_error, ERROR_TUNNEL_CONNECT_FAILED);
+		/* too late for an error response; hang up */
+		if (conn->tunnel_optimistic) {
+			log_info("tunnel: connection failed: %s", err);
+			tunnel_close(conn, ERROR_TUNNEL_CLOSED);
+		} else
+			EVENT1(conn, on_error, ERROR_TUNNEL_CONNECT_FAILED);
 	}
 }
 
@@ -749,6 +1250,11 @@ http_errorcb(struct bufferevent *bev, short what, void *_conn)
 		else
 			end_message(conn, ERROR_INCOMPLETE_BODY);
 		break;
+	case HTTP_STATE_MANGLED:
+		/* a bufferevent pair reports its partner going away even
+		   when we aren't reading; there's no one left to write to */
+		end_message(conn, ERROR_WRITE_FAILED);
+		break;
 	default:
 		log_fatal("http_conn: errorcb called in invalid state");
 	}
@@ -766,8 +1272,7 @@ process_one_step(struct http_conn *conn)
 		/* fallthru... */
 	case HTTP_STATE_READ_FIRSTLINE:
 		assert(conn->firstline == NULL);
-		conn->firstline = evbuffer_readln(inbuf, NULL,
-						  EVBUFFER_EOL_CRLF);
+		conn->firstline = mem_readln(inbuf);
 		if (conn->firstline)
 			conn->state = HTTP_STATE_READ_HEADERS;
 		break;	
@@ -791,12 +1296,30 @@ process_inbuf(struct http_conn *conn)
 	if (evbuffer_get_length(inbuf) == 0)
 		return;
 
+	conn->bytes_budget = max_bytes_per_wakeup;
+	conn->msgs_budget = max_msgs_per_wakeup;
+
 	do {
 		state_before = conn->state;
 		process_one_step(conn);
 	} while (!conn->read_paused &&
 		 evbuffer_get_length(inbuf) > 0 &&
-		 state_before != conn->state);
+		 state_before != conn->state &&
+		 conn->bytes_budget > 0 && conn->msgs_budget > 0);
+
+	/* out of budget; let everyone else have a go before we continue */
+	if ((conn->bytes_budget <= 0 || conn->msgs_budget <= 0) &&
+	    !conn->read_paused && !conn->will_free &&
+	    evbuffer_get_length(inbuf) > 0) {
+		log_debug("http_conn: %p out of read budget, deferring", conn);
+		event_active(conn->resume_ev, EV_TIMEOUT, 1);
+	}
+}
+
+static void
+deferred_process_inbuf(evutil_socket_t s, short what, void *_conn)
+{
+	process_inbuf(_conn);
 }
 
 static void
@@ -814,19 +1337,22 @@ http_writecb(struct bufferevent *bev, void *_conn)
 	if (conn->choked) {
 		bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
 		conn->choked = 0;
-		EVENT0(conn, on_write_more);
-	} else if (evbuffer_get_length(outbuf) == 0) {
+		/* nothing more is coming while it waits on a worker */
+		if (!conn->work_waiting)
+			EVENT0(conn, on_write_more);
+	} else if (!evbuffer_get_length(outbuf) && !work_pending(conn)) {
 		if (!conn->will_flush)
 			EVENT0(conn, on_flush);
 	}
 }
 
 static void
-http_connectcb(struct bufferevent *bev, int ok, void *_conn)
+http_connectcb(struct bufferevent *bev, int ok, const char *err, void *_conn)
 {
 	struct http_conn *conn = _conn;
 
 	assert(conn->state == HTTP_STATE_CONNECTING);
+	set_connect_error(conn, err);
 	bufferevent_setcb(conn->bev, http_readcb, http_writecb,
 			  http_errorcb, conn);
 
@@ -839,10 +1365,9 @@ http_connectcb(struct bufferevent *bev, int ok, void *_conn)
 	}
 }
 
-
-struct http_conn *
-http_conn_new(struct event_base *base, evutil_socket_t sock,
-	      enum http_type type, const struct http_cbs *cbs, void *cbarg)
+static struct http_conn *
+conn_new(struct event_base *base, struct bufferevent *bev,
+	 enum http_type type, const struct http_cbs *cbs, void *cbarg)
 {
 	struct http_conn *conn;
 
@@ -851,14 +1376,37 @@ http_conn_new(struct event_base *base, evutil_socket_t sock,
 	conn->type = type;
 	conn->cbs = cbs;
 	conn->cbarg = cbarg;
-	conn->bev = bufferevent_socket_new(base, sock,
-			BEV_OPT_CLOSE_ON_FREE);
-	if (!conn->bev)
-		log_fatal("http_conn: failed to create bufferevent");
+	conn->bev = bev;
+	conn->resume_ev = event_new(base, -1, 0, deferred_process_inbuf, conn);
+	if (!conn->resume_ev)
+		log_fatal("http_conn: failed to create event");
+	conn->priority = HTTP_PRIORITY_NORMAL;
+	set_priority(conn, HTTP_PRIORITY_HIGH);
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+	bufferevent_set_max_single_read(conn->bev, type == HTTP_SERVER ?
+			server_max_single_read : client_max_single_read);
+#endif
 
 	conn->inbuf_processed = evbuffer_new();
 	if (!conn->inbuf_processed)
 		log_fatal("http_conn: failed to create evbuffer");
+	TAILQ_INIT(&conn->pending_filters);
+	TAILQ_INIT(&conn->filters);
+
+	return conn;
+}
+
+struct http_conn *
+http_conn_new(struct event_base *base, evutil_socket_t sock,
+	      enum http_type type, const struct http_cbs *cbs, void *cbarg)
+{
+	struct http_conn *conn;
+	struct bufferevent *bev;
+
+	bev = bufferevent_socket_new(base, sock, BEV_OPT_CLOSE_ON_FREE);
+	if (!bev)
+		log_fatal("http_conn: failed to create bufferevent");
+	conn = conn_new(base, bev, type, cbs, cbarg);
 
 	if (type != HTTP_SERVER)
 		bufferevent_setcb(conn->bev, http_readcb, http_writecb,
@@ -870,14 +1418,336 @@ http_conn_new(struct event_base *base, evutil_socket_t sock,
 	return conn;
 }
 
+struct http_conn *
+http_conn_new_bev(struct event_base *base, struct bufferevent *bev,
+		  enum http_type type, const struct http_cbs *cbs, void *cbarg)
+{
+	struct http_conn *conn;
+
+	conn = conn_new(base, bev, type, cbs, cbarg);
+	bufferevent_setcb(conn->bev, http_readcb, http_writecb,
+			  http_errorcb, conn);
+	begin_message(conn);
+
+	return conn;
+}
+
 int
 http_conn_connect(struct http_conn *conn, struct evdns_base *dns,
-		      int family, const char *host, int port)
+		  const struct socks_server *socks,
+		  int family, const char *host, int port)
 {
 	assert(conn->type == HTTP_SERVER);
 	conn->state = HTTP_STATE_CONNECTING;
-	return conn_connect_bufferevent(conn->bev, dns, family, host, port,
-				        http_connectcb, conn);
+	return conn_connect_bufferevent(conn->bev, dns, socks, family,
+					host, port, NULL, http_connectcb, conn);
+}
+
+const char *
+http_conn_get_connect_error(struct http_conn *conn)
+{
+	return conn->connect_error;
+}
+
+static void
+filters_clear(struct body_filter_list *filters)
+{
+	struct body_filter *f;
+
+	while ((f = TAILQ_FIRST(filters))) {
+		TAILQ_REMOVE(filters, f, next);
+		if (f->state && f->filter->free)
+			f->filter->free(f->state);
+		if (f->in)
+			evbuffer_free(f->in);
+		mem_free(f);
+	}
+}
+
+static void
+chain_free(struct filter_chain *chain)
+{
+	filters_clear(&chain->filters);
+	mem_free(chain);
+}
+
+/* no more of the current message's body is coming. the chain goes once
+   the worker is done with it. */
+static void
+chain_end(struct http_conn *conn)
+{
+	struct filter_chain *chain = conn->chain;
+
+	if (!chain)
+		return;
+	conn->chain = NULL;
+	chain->ended = 1;
+	if (!chain->njobs)
+		chain_free(chain);
+}
+
+static int
+work_pending(struct http_conn *conn)
+{
+	return conn->work && work_queue_length(conn->work);
+}
+
+/* where to write now: behind any body that's still out with a worker */
+static struct evbuffer *
+conn_output(struct http_conn *conn)
+{
+	if (work_pending(conn)) {
+		if (!conn->work_held)
+			conn->work_held = evbuffer_new();
+		return conn->work_held;
+	}
+
+	return bufferevent_get_output(conn->bev);
+}
+
+/* what was waiting on body work can go on */
+static void
+work_resume(struct http_conn *conn)
+{
+	conn->work_waiting = 0;
+	conn->work_choked = 0;
+	if (conn->will_release)
+		release_bev(conn);
+	else
+		tunnel_open(conn);
+}
+
+/* filtered body back from a worker, in the order it was handed over */
+static void
+on_work_done(void *arg, void *state, int tag, struct evbuffer *out,
+	     int result)
+{
+	struct http_conn *conn = arg;
+	struct filter_chain *chain = state;
+	struct evbuffer *outbuf;
+	size_t len = evbuffer_get_length(out);
+
+	if (chain && !--chain->njobs && chain->ended)
+		chain_free(chain);
+	if (!conn)
+		return;
+
+	outbuf = bufferevent_get_output(conn->bev);
+	if (result < 0)
+		conn->work_failed = 1;
+	else if (!conn->work_failed) {
+		if ((tag & JOB_CHUNKED) && len)
+			evbuffer_add_printf(outbuf, "%x\r\n", (unsigned)len);
+		evbuffer_add_buffer(outbuf, out);
+		if ((tag & JOB_CHUNKED) && len)
+			evbuffer_add(outbuf, "\r\n", 2);
+		if ((tag & JOB_CHUNKED) && (tag & JOB_FINISH))
+			evbuffer_add(outbuf, "0\r\n\r\n", 5);
+	}
+
+	if (!work_pending(conn)) {
+		if (conn->work_failed) {
+			/* a body that can't be finished can only be cut
+			   short, and whatever followed it with it */
+			log_warn("http_conn: filters on a worker failed");
+			conn->work_failed = 0;
+			conn->persistent = 0;
+			if (conn->work_held)
+				evbuffer_drain(conn->work_held, -1);
+			conn->work_waiting = 0;
+			EVENT1(conn, on_error, ERROR_WRITE_FAILED);
+			return;
+		}
+		if (conn->work_held)
+			evbuffer_add_buffer(outbuf, conn->work_held);
+	}
+
+	if (!conn->choked && evbuffer_get_length(outbuf) > max_write_backlog) {
+		bufferevent_setwatermark(conn->bev, EV_WRITE,
+					 max_write_backlog / 2, 0);
+		conn->choked = 1;
+	}
+	if (conn->work_waiting) {
+		if (!work_pending(conn))
+			work_resume(conn);
+		return;
+	}
+	if (conn->work_choked &&
+	    work_queue_length(conn->work) <= max_work_backlog / 2) {
+		conn->work_choked = 0;
+		if (!conn->choked)
+			EVENT0(conn, on_write_more);
+	}
+	/* http_writecb reports a flush, unless there's nothing to write */
+	if (!conn->will_free && !work_pending(conn) &&
+	    !evbuffer_get_length(outbuf) && !conn->will_flush)
+		EVENT0(conn, on_flush);
+}
+
+/* hand the current message's filters over to the conn's worker */
+static void
+chain_start(struct http_conn *conn)
+{
+	struct filter_chain *chain;
+	struct body_filter *f;
+
+	chain = mem_calloc(1, sizeof(*chain));
+	TAILQ_INIT(&chain->filters);
+	while ((f = TAILQ_FIRST(&conn->filters))) {
+		TAILQ_REMOVE(&conn->filters, f, next);
+		TAILQ_INSERT_TAIL(&chain->filters, f, next);
+	}
+	if (!conn->work)
+		conn->work = work_queue_new(conn->work_pool, on_work_done,
+					    conn);
+	conn->chain = chain;
+}
+
+static void
+work_add(struct http_conn *conn, work_fn fn, struct evbuffer *buf,
+	 int tag)
+{
+	/* whatever was written while earlier body was out goes first */
+	if (conn->work_held && evbuffer_get_length(conn->work_held))
+		work_queue_add(conn->work, NULL, NULL, conn->work_held, 0);
+	if (conn->output_te == TE_CHUNKED)
+		tag |= JOB_CHUNKED;
+	conn->chain->njobs++;
+	work_queue_add(conn->work, fn, conn->chain, buf, tag);
+	if (work_queue_length(conn->work) > max_work_backlog)
+		conn->work_choked = 1;
+}
+
+/* the rest of a conn's body work has to be written before it can go
+   on. 1 if some is still out; on_work_done calls work_resume once it's
+   all back. */
+static int
+work_wait(struct http_conn *conn)
+{
+	if (!work_pending(conn))
+		return 0;
+	conn->work_waiting = 1;
+
+	return 1;
+}
+
+/* set up the filters added for the message whose headers are about to
+   be written */
+static void
+filters_start(struct http_conn *conn, struct header_list *headers)
+{
+	struct body_filter *f;
+	int rv, resized = 0, offload = 1;
+
+	/* whatever ran on a message that turned out to have no body */
+	filters_clear(&conn->filters);
+	chain_end(conn);
+	conn->filter_failed = 0;
+
+	while ((f = TAILQ_FIRST(&conn->pending_filters))) {
+		TAILQ_REMOVE(&conn->pending_filters, f, next);
+		rv = f->filter->init ?
+		     f->filter->init(&f->state, headers, f->arg) : 1;
+		if (rv <= 0) {
+			if (rv < 0)
+				log_warn("http_conn: %s filter couldn't start",
+					 f->filter->name);
+			mem_free(f);
+			continue;
+		}
+		f->in = evbuffer_new();
+		TAILQ_INSERT_TAIL(&conn->filters, f, next);
+		resized |= f->filter->changes_length;
+		offload &= f->filter->offload;
+	}
+	if (TAILQ_EMPTY(&conn->filters))
+		return;
+
+	if (conn->work_pool && offload)
+		chain_start(conn);
+	else if (!conn->filter_out)
+		conn->filter_out = evbuffer_new();
+	if (!resized)
+		return;
+
+	headers_remove(headers, "Content-Length");
+	if (conn->vers == HTTP_11 && conn->persistent)
+		conn->output_te = TE_CHUNKED;
+	else {
+		conn->output_te = TE_IDENTITY;
+		conn->persistent = 0;
+	}
+}
+
+/* push what's in the first filter's input through the chain. each
+   filter writes straight into the next one's input; the last writes to
+   out. */
+static int
+filters_run(struct body_filter_list *filters, struct evbuffer *out,
+	    int finish)
+{
+	struct body_filter *f, *next;
+	struct evbuffer *to;
+	int rv;
+
+	TAILQ_FOREACH(f, filters, next) {
+		next = TAILQ_NEXT(f, next);
+		to = next ? next->in : out;
+		if (finish) {
+			rv = f->filter->finish(f->state, f->in, to);
+			f->state = NULL;
+		} else if (evbuffer_get_length(f->in))
+			rv = f->filter->process(f->state, f->in, to);
+		else
+			rv = 0;
+		if (rv < 0) {
+			log_warn("http_conn: %s filter failed",
+				 f->filter->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* these two run on a worker */
+static int
+chain_process(void *state, struct evbuffer *in, struct evbuffer *out)
+{
+	struct filter_chain *chain = state;
+
+	if (chain->failed)
+		return -1;
+	evbuffer_add_buffer(TAILQ_FIRST(&chain->filters)->in, in);
+	if (filters_run(&chain->filters, out, 0) < 0) {
+		chain->failed = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+chain_finish(void *state, struct evbuffer *in, struct evbuffer *out)
+{
+	struct filter_chain *chain = state;
+
+	if (chain->failed || filters_run(&chain->filters, out, 1) < 0) {
+		chain->failed = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* a body that can't be finished can only be cut short */
+static void
+filters_fail(struct http_conn *conn)
+{
+	filters_clear(&conn->filters);
+	evbuffer_drain(conn->filter_out, evbuffer_get_length(conn->filter_out));
+	conn->filter_failed = 1;
+	conn->persistent = 0;
 }
 
 static void
@@ -887,24 +1757,92 @@ deferred_free(evutil_socket_t s, short what, void *arg)
 	bufferevent_free(conn->bev);
 	if (conn->tunnel_bev)
 		bufferevent_free(conn->tunnel_bev);
+	event_free(conn->resume_ev);
+	if (conn->tunnel_expire_ev)
+		event_free(conn->tunnel_expire_ev);
 	evbuffer_free(conn->inbuf_processed);
+	filters_clear(&conn->pending_filters);
+	filters_clear(&conn->filters);
+	if (conn->filter_out)
+		evbuffer_free(conn->filter_out);
+	if (conn->work_held)
+		evbuffer_free(conn->work_held);
+	mem_free(conn->connect_error);
+	mem_free(conn->firstline);
+	if (conn->headers) {
+		headers_clear(conn->headers);
+		mem_free(conn->headers);
+	}
 	mem_free(conn);
 }
 
 void
 http_conn_free(struct http_conn *conn)
 {
+	struct bufferevent *partner;
+
 	if (conn->will_free)
 		return;
 
 	conn->will_free = 1;
+	/* a worker may still have the chain; it goes when that's done */
+	chain_end(conn);
+	work_queue_free(conn->work);
+	conn->work = NULL;
+	if (conn->relay) {
+		relay_cancel(conn->relay);
+		conn->relay = NULL;
+	}
+	/* the only way the far end of a bufferevent pair learns we're gone.
+	   a plain EOF would look like a tunnel's half close, so say more. */
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+	partner = bufferevent_pair_get_partner(conn->bev);
+	if (partner) {
+		bufferevent_flush(conn->bev, EV_WRITE, BEV_FLUSH);
+		bufferevent_trigger_event(partner, BEV_EVENT_READING |
+					  BEV_EVENT_EOF | BEV_EVENT_ERROR, 0);
+	}
+#else
+	bufferevent_flush(conn->bev, EV_WRITE, BEV_FINISHED);
+#endif
 	http_conn_stop_reading(conn);
+	event_del(conn->resume_ev);
 	bufferevent_disable(conn->bev, EV_WRITE);
 	bufferevent_setcb(conn->bev, NULL, NULL, NULL, NULL);
 	conn->cbs = NULL;
 	event_base_once(conn->base, -1, EV_TIMEOUT, deferred_free, conn, NULL);
 }
 
+static void
+release_bev(struct http_conn *conn)
+{
+	struct bufferevent *bev = conn->bev;
+
+	conn->will_release = 0;
+	bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+	conn->state = HTTP_STATE_MANGLED;
+
+	/* leave conn something harmless to free */
+	conn->bev = bufferevent_socket_new(conn->base, -1, 0);
+	if (!conn->bev)
+		log_fatal("http_conn: failed to create bufferevent");
+
+	EVENT1(conn, on_released, bev);
+}
+
+void
+http_conn_release_bev(struct http_conn *conn)
+{
+	assert(conn->tunnel_bev == NULL);
+
+	http_conn_stop_reading(conn);
+	event_del(conn->resume_ev);
+	bufferevent_set_timeouts(conn->bev, NULL, NULL);
+	conn->will_release = 1;
+	if (!work_wait(conn))
+		release_bev(conn);
+}
+
 void
 http_conn_write_request(struct http_conn *conn, struct http_request *req)
 {
@@ -912,7 +1850,11 @@ http_conn_write_request(struct http_conn *conn, struct http_request *req)
 
 	assert(conn->type == HTTP_SERVER);
 
-	headers_remove(req->headers, "connection");
+	/* keep-alive lets a 1.0 origin keep the connection for us */
+	if (remove_hop_headers(req->headers, req->upgrade))
+		headers_add_key_val(req->headers, "Connection", "Upgrade");
+	else
+		headers_add_key_val(req->headers, "Connection", "keep-alive");
 	req->vers = HTTP_11;
 		
 	outbuf = bufferevent_get_output(conn->bev);
@@ -938,7 +1880,7 @@ http_conn_write_continue(struct http_conn *conn)
 
 	if (conn->expect_continue) {
 		log_debug("httpconn: writing continue status");
-		outbuf = bufferevent_get_output(conn->bev);
+		outbuf = conn_output(conn);
 		conn->expect_continue = 0;
 		assert(conn->vers == HTTP_11);
 		evbuffer_add_printf(outbuf, "HTTP/1.1 100 Continue\r\n\r\n");
@@ -953,21 +1895,33 @@ http_conn_write_response(struct http_conn *conn, struct http_response *resp)
 	assert(conn->type == HTTP_CLIENT);
 	assert(conn->vers != HTTP_UNKNOWN);
 
-	headers_remove(resp->headers, "connection");
+	remove_hop_headers(resp->headers, resp->code == 101);
 	headers_remove(resp->headers, "transfer-encoding");
 	resp->vers = conn->vers;
+	if (!TAILQ_EMPTY(&conn->pending_filters) ||
+	    !TAILQ_EMPTY(&conn->filters))
+		filters_start(conn, resp->headers);
+
+	/* a 1.0 client can't take chunks, so an unknown length has to be
+	   delimited by closing */
+	if (conn->vers == HTTP_10 && conn->output_te == TE_CHUNKED) {
+		conn->output_te = TE_IDENTITY;
+		conn->persistent = 0;
+	}
 
-	if (conn->vers == HTTP_10 || !conn->persistent) {
-		if (conn->vers == HTTP_10)
-			conn->output_te = TE_IDENTITY;
+	if (resp->code == 101) {
+		headers_add_key_val(resp->headers, "Connection", "Upgrade");
+	} else if (!conn->persistent) {
 		headers_add_key_val(resp->headers, "Connection", "close");
-	} 
+	} else if (conn->vers == HTTP_10) {
+		headers_add_key_val(resp->headers, "Connection", "keep-alive");
+	}
 	if (conn->output_te == TE_CHUNKED) {
 		headers_add_key_val(resp->headers,
 			            "Transfer-Encoding", "chunked");
 	}
 
-	outbuf = bufferevent_get_output(conn->bev);
+	outbuf = conn_output(conn);
 
 	evbuffer_add_printf(outbuf, "%s %d %s\r\n",
 		        http_version_to_string(conn->vers),
@@ -977,12 +1931,26 @@ http_conn_write_response(struct http_conn *conn, struct http_response *resp)
 	headers_dump(resp->headers, outbuf);	
 }
 
-int
-http_conn_write_buf(struct http_conn *conn, struct evbuffer *buf)
+void
+http_conn_add_filter(struct http_conn *conn, const struct http_filter *filter,
+		     void *arg)
+{
+	struct body_filter *f;
+
+	assert(conn->type == HTTP_CLIENT);
+
+	f = mem_calloc(1, sizeof(*f));
+	f->filter = filter;
+	f->arg = arg;
+	TAILQ_INSERT_TAIL(&conn->pending_filters, f, next);
+}
+
+static int
+write_body(struct http_conn *conn, struct evbuffer *buf)
 {
 	struct evbuffer *outbuf;
 	
-	outbuf = bufferevent_get_output(conn->bev);
+	outbuf = conn_output(conn);
 
 	if (conn->output_te == TE_CHUNKED)
 		evbuffer_add_printf(outbuf, "%x\r\n",
@@ -1002,13 +1970,65 @@ http_conn_write_buf(struct http_conn *conn, struct evbuffer *buf)
 	return 1;
 }
 
+static int
+write_filtered(struct http_conn *conn, struct evbuffer *buf)
+{
+	if (conn->filter_failed) {
+		evbuffer_drain(buf, evbuffer_get_length(buf));
+		return 1;
+	}
+
+	evbuffer_add_buffer(TAILQ_FIRST(&conn->filters)->in, buf);
+	if (filters_run(&conn->filters, conn->filter_out, 0) < 0) {
+		filters_fail(conn);
+		return 1;
+	}
+	/* an empty chunk would end the body */
+	if (!evbuffer_get_length(conn->filter_out))
+		return !conn->choked;
+
+	return write_body(conn, conn->filter_out);
+}
+
+int
+http_conn_write_buf(struct http_conn *conn, struct evbuffer *buf)
+{
+	if (conn->chain) {
+		/* the error comes when the worker's done */
+		if (conn->work_failed)
+			evbuffer_drain(buf, evbuffer_get_length(buf));
+		else
+			work_add(conn, chain_process, buf, 0);
+		return !conn->choked && !conn->work_choked;
+	}
+	if (TAILQ_EMPTY(&conn->filters) && !conn->filter_failed)
+		return write_body(conn, buf);
+
+	return write_filtered(conn, buf);
+}
+
 void
 http_conn_write_finished(struct http_conn *conn)
 {
-	if (conn->output_te == TE_CHUNKED)
-		bufferevent_write(conn->bev, "0\r\n\r\n", 5);
+	if (conn->chain) {
+		/* the worker's result ends the body */
+		work_add(conn, chain_finish, NULL, JOB_FINISH);
+		chain_end(conn);
+		conn->output_te = TE_IDENTITY;
+		return;
+	}
+	if (!TAILQ_EMPTY(&conn->filters)) {
+		if (filters_run(&conn->filters, conn->filter_out, 1) < 0)
+			filters_fail(conn);
+		else if (evbuffer_get_length(conn->filter_out))
+			write_body(conn, conn->filter_out);
+		filters_clear(&conn->filters);
+	}
+	/* leave a failed body unterminated so the client can tell */
+	if (conn->output_te == TE_CHUNKED && !conn->filter_failed)
+		evbuffer_add(conn_output(conn), "0\r\n\r\n", 5);
 	conn->output_te = TE_IDENTITY;
-		
+	conn->filter_failed = 0;
 }
 
 int
@@ -1061,12 +2081,6 @@ http_conn_stop_reading(struct http_conn *conn)
 	conn->read_paused = 1;
 }
 
-static void
-deferred_process_inbuf(evutil_socket_t s, short what, void *_conn)
-{
-	process_inbuf(_conn);
-}
-
 void
 http_conn_start_reading(struct http_conn *conn)
 {
@@ -1075,8 +2089,7 @@ http_conn_start_reading(struct http_conn *conn)
 	bufferevent_enable(conn->bev, EV_READ);
 	conn->read_paused = 0;
 	if (evbuffer_get_length(inbuf) > 0)
-		event_base_once(conn->base, -1, EV_TIMEOUT,
-				deferred_process_inbuf, conn, NULL);
+		event_active(conn->resume_ev, EV_TIMEOUT, 1);
 }
 
 static void
@@ -1085,10 +2098,11 @@ deferred_flush(evutil_socket_t fd, short what, void *_conn)
 	struct http_conn *conn = _conn;
 	struct evbuffer *outbuf = bufferevent_get_output(conn->bev);
 
-	if (evbuffer_get_length(outbuf) == 0) {
-		conn->will_flush = 0;
+	/* if there's still output, writecb reports the flush, or
+	   on_work_done if a worker has some */
+	conn->will_flush = 0;
+	if (evbuffer_get_length(outbuf) == 0 && !work_pending(conn))
 		EVENT0(conn, on_flush);
-	}
 }
 
 void
@@ -1099,18 +2113,25 @@ http_conn_flush(struct http_conn *conn)
 	event_base_once(conn->base, -1, EV_TIMEOUT, deferred_flush, conn, NULL);
 }
 
-void
-http_conn_send_error(struct http_conn *conn, int code, const char *fmt, ...)
+/* retry_after < 0 leaves Retry-After out */
+static void
+send_error(struct http_conn *conn, int code, int retry_after,
+	   const char *fmt, va_list ap)
 {
 	char length[64];
 	char reason[256];
 	struct evbuffer *msg;
 	struct http_response resp;
 	struct header_list headers;
-	va_list ap;
 
 	assert(conn->type == HTTP_CLIENT);
 
+	/* our own pages go out as they are */
+	filters_clear(&conn->pending_filters);
+	filters_clear(&conn->filters);
+	chain_end(conn);
+	conn->filter_failed = 0;
+
 	TAILQ_INIT(&headers);
 	msg = evbuffer_new();
 	resp.headers = &headers;
@@ -1119,9 +2140,7 @@ http_conn_send_error(struct http_conn *conn, int code, const char *fmt, ...)
 		conn->vers = HTTP_11;
 
 	
-	va_start(ap, fmt);
 	evutil_vsnprintf(reason, sizeof(reason), fmt, ap);
-	va_end(ap);
 
 	conn->output_te = TE_IDENTITY;
 	resp.vers = HTTP_11;
@@ -1146,6 +2165,10 @@ http_conn_send_error(struct http_conn *conn, int code, const char *fmt, ...)
 	headers_add_key_val(&headers, "Expires", "0");
 	headers_add_key_val(&headers, "Cache-Control", "no-cache");
 	headers_add_key_val(&headers, "Pragma", "no-cache");
+	if (retry_after >= 0) {
+		evutil_snprintf(length, sizeof(length), "%d", retry_after);
+		headers_add_key_val(&headers, "Retry-After", length);
+	}
 
 	http_conn_write_response(conn, &resp);
 	http_conn_write_buf(conn, msg);
@@ -1153,23 +2176,132 @@ http_conn_send_error(struct http_conn *conn, int code, const char *fmt, ...)
 	evbuffer_free(msg);
 }
 
+void
+http_conn_send_error(struct http_conn *conn, int code, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	send_error(conn, code, -1, fmt, ap);
+	va_end(ap);
+}
+
+void
+http_conn_send_error_retry(struct http_conn *conn, int code,
+			   int retry_after, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	send_error(conn, code, retry_after, fmt, ap);
+	va_end(ap);
+}
+
 int
 http_conn_start_tunnel(struct http_conn *conn, struct evdns_base *dns,
-		       int family, const char *host, int port)
+		       const struct socks_server *socks,
+		       int family, const char *host, int port, int optimistic)
 {
+	int rv;
+
 	assert(conn->type == HTTP_CLIENT);
 	assert(conn->tunnel_bev == NULL);
 
 	http_conn_stop_reading(conn);
 	conn->tunnel_bev = bufferevent_socket_new(conn->base, -1,
 						  BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_priority_set(conn->tunnel_bev, conn->priority);
 	bufferevent_setcb(conn->bev, tunnel_readcb,
 			  tunnel_writecb, tunnel_errorcb, conn);
 	log_info("tunnel: attempting connection to %s:%d",
 		 log_scrub(host), port);
 	conn->state = HTTP_STATE_TUNNEL_CONNECTING;
-	return conn_connect_bufferevent(conn->tunnel_bev, dns, family,
-				host, port, tunnel_connectcb, conn);
+	conn->tunnel_optimistic = optimistic;
+	if (optimistic) {
+		write_tunnel_established(conn);
+		bufferevent_enable(conn->bev, EV_READ);
+	}
+	rv = conn_connect_bufferevent(conn->tunnel_bev, dns, socks, family,
+				host, port,
+				optimistic ? &conn->tunnel_early : NULL,
+				tunnel_connectcb, conn);
+	/* anything that came in behind the CONNECT */
+	if (conn->tunnel_early)
+		tunnel_take_early(conn);
+
+	return rv;
+}
+
+static void
+tunnel_adopt(struct http_conn *conn, struct bufferevent *bev)
+{
+	assert(conn->type == HTTP_CLIENT);
+	assert(conn->tunnel_bev == NULL);
+
+	http_conn_stop_reading(conn);
+	event_del(conn->resume_ev);
+	bufferevent_set_timeouts(conn->bev, NULL, NULL);
+	conn->tunnel_bev = bev;
+	bufferevent_setcb(conn->bev, tunnel_readcb,
+			  tunnel_writecb, tunnel_errorcb, conn);
+}
+
+void
+http_conn_start_tunnel_bev(struct http_conn *conn, struct bufferevent *bev)
+{
+	tunnel_adopt(conn, bev);
+	tunnel_open(conn);
+}
+
+void
+http_conn_adopt_tunnel(struct http_conn *conn, struct bufferevent *bev)
+{
+	tunnel_adopt(conn, bev);
+	log_info("tunnel: using a connection opened ahead of time");
+	write_tunnel_established(conn);
+	tunnel_open(conn);
+}
+
+void
+http_conn_set_work_pool(struct http_conn *conn, struct work_pool *pool)
+{
+	assert(conn->type == HTTP_CLIENT);
+	conn->work_pool = pool;
+}
+
+void
+http_conn_set_relay_pool(struct http_conn *conn, struct relay_pool *pool)
+{
+	assert(conn->type == HTTP_CLIENT);
+	conn->relay_pool = pool;
+}
+
+void
+http_conn_set_tunnel_timeouts(struct http_conn *conn,
+			      const struct timeval *idle,
+			      const struct timeval *lifetime)
+{
+	evutil_timerclear(&conn->tunnel_idle);
+	evutil_timerclear(&conn->tunnel_lifetime);
+	if (idle)
+		conn->tunnel_idle = *idle;
+	if (lifetime)
+		conn->tunnel_lifetime = *lifetime;
+}
+
+void
+http_conn_get_tunnel_stats(struct http_conn *conn, ev_uint64_t *up,
+			   ev_uint64_t *down, struct timeval *duration)
+{
+	struct timeval now;
+
+	*up = conn->tunnel_bytes_up;
+	*down = conn->tunnel_bytes_down;
+	evutil_timerclear(duration);
+	if (evutil_timerisset(&conn->tunnel_started)) {
+		event_base_gettimeofday_cached(conn->base, &now);
+		evutil_timersub(&now, &conn->tunnel_started, duration);
+	}
 }
 
 void
@@ -1180,6 +2312,7 @@ http_request_free(struct http_request *req)
 
 	url_free(req->url);
 	headers_clear(req->headers);
+	mem_free(req->headers);
 	mem_free(req);
 }
 
@@ -1297,7 +2430,8 @@ static struct http_cbs test_proxy_cbs = {
 	proxy_read_body,
 	proxy_msg_complete,
 	proxy_write_more,
-	proxy_flush
+	proxy_flush,
+	0
 };
 
 
@@ -1342,7 +2476,7 @@ main(int argc, char **argv)
 	dns = evdns_base_new(base, 1);
 
 	http = http_conn_new(base, -1, HTTP_SERVER, &test_proxy_cbs, url);
-	http_conn_connect(http, dns, AF_UNSPEC, url->host, url->port);
+	http_conn_connect(http, dns, NULL, AF_UNSPEC, url->host, url->port);
 
 	event_base_dispatch(base);
 
@@ -29,7 +29,11 @@ enum http_method {
 	METH_HEAD,
 	METH_POST,
 	METH_PUT,
-	METH_CONNECT
+	METH_CONNECT,
+	METH_OPTIONS,
+	METH_DELETE,
+	METH_TRACE,
+	METH_PATCH
 };
 
 enum http_te {
@@ -49,17 +53,31 @@ enum http_conn_error {
 	ERROR_CHUNK_PARSE_FAILED,
 	ERROR_WRITE_FAILED,
 	ERROR_TUNNEL_CONNECT_FAILED,
-	ERROR_TUNNEL_CLOSED
+	ERROR_TUNNEL_CLOSED,
+	ERROR_TUNNEL_TIMEDOUT
+};
+
+/* event priorities; header processing runs ahead of bulk data transfer.
+   the event base must be initialized with HTTP_NUM_PRIORITIES. */
+enum http_priority {
+	HTTP_PRIORITY_HIGH,
+	HTTP_PRIORITY_NORMAL,
+	HTTP_PRIORITY_LOW,
+	HTTP_NUM_PRIORITIES
 };
 
 #define HTTP_ERROR_RESPONSE(c) (c >= 400 && c <= 599)
 
 struct evbuffer;
+struct bufferevent;
 struct event_base;
 struct evdns_base;
 struct http_conn;
 struct header_list;
 struct url;
+struct socks_server;
+struct work_pool;
+struct relay_pool;
 
 struct http_request {
 	TAILQ_ENTRY(http_request) next;
@@ -67,6 +85,9 @@ struct http_request {
 	struct url *url;
 	enum http_version vers;
 	struct header_list *headers;
+	/* asks to switch protocols; Upgrade survives being forwarded */
+	int upgrade;
+	struct timeval received;	/* when its headers were read */
 };
 TAILQ_HEAD(http_request_list, http_request);
 
@@ -77,7 +98,36 @@ struct http_response {
 	struct header_list *headers;
 };
 
+/* A body filter transforms a message body as it streams out, say to
+   compress it. Filters are added to a connection for the next message
+   it writes and are dropped when that message is finished. */
+struct http_filter {
+	const char *name;
+	/* the message is starting with these headers, which init may
+	   change. set *state for the calls that follow. return: 1 to
+	   filter the body, 0 to leave it alone, -1 on error. may be NULL
+	   to always filter. */
+	int (*init)(void **state, struct header_list *headers, void *arg);
+	/* move what can be transformed so far from in to out; whatever is
+	   left in in comes back with the next data. -1 on error. */
+	int (*process)(void *state, struct evbuffer *in, struct evbuffer *out);
+	/* the body is over: write everything left to out and free state.
+	   -1 on error. */
+	int (*finish)(void *state, struct evbuffer *in, struct evbuffer *out);
+	/* free state of a message that ended early */
+	void (*free)(void *state);
+	/* nonzero if the output may be a different length than the input;
+	   the message is then sent chunked, or closed after on HTTP/1.0 */
+	int changes_length;
+	/* nonzero if process and finish may run on a worker thread, when
+	   the connection has a work pool. they must then touch nothing but
+	   their state and buffers. */
+	int offload;
+};
+
 struct http_cbs {
+	/* a server's connection is up, or a client's tunnel's; may be NULL
+	   for clients */
 	void (*on_connect)(struct http_conn *, void *);
 	void (*on_error)(struct http_conn *, enum http_conn_error, void *);
 	void (*on_client_request)(struct http_conn *, struct http_request *, void *);
@@ -90,22 +140,49 @@ struct http_cbs {
 	void (*on_write_more)(struct http_conn *, void *);
 
 	void (*on_flush)(struct http_conn *, void *);
+
+	/* a client opened with the HTTP/2 connection preface; may be NULL
+	   to treat it as a bad request */
+	void (*on_client_h2_preface)(struct http_conn *, void *);
+
+	/* the bufferevent http_conn_release_bev() let go of; may be NULL
+	   if that's never called */
+	void (*on_released)(struct http_conn *, struct bufferevent *, void *);
 };
 
 struct http_conn *http_conn_new(struct event_base *base, evutil_socket_t sock,
 				enum http_type type, const struct http_cbs *cbs,
 				void *cbarg);
+/* wrap an already connected bufferevent, such as one end of a pair */
+struct http_conn *http_conn_new_bev(struct event_base *base,
+				    struct bufferevent *bev,
+				    enum http_type type,
+				    const struct http_cbs *cbs, void *cbarg);
 
+/* socks may be NULL to connect directly. */
 int http_conn_connect(struct http_conn *conn, struct evdns_base *dns,
+		      const struct socks_server *socks,
 		      int family, const char *host, int port);
+/* why the last connection attempt failed; NULL if it didn't. */
+const char *http_conn_get_connect_error(struct http_conn *conn);
 
 void http_conn_free(struct http_conn *conn);
+/* take the connection away from conn, say to switch protocols, once any
+   body still out with a worker has been written; on_released gets it,
+   maybe before this returns. conn stops reading right away, and should
+   be freed after. */
+void http_conn_release_bev(struct http_conn *conn);
 
 void http_conn_write_request(struct http_conn *conn, struct http_request *req);
 int http_conn_expect_continue(struct http_conn *conn);
 void http_conn_write_continue(struct http_conn *conn);
 void http_conn_write_response(struct http_conn *conn, struct http_response *resp);
 
+/* filter the body of the next response conn writes, after any filters
+   already added. only for messages that have a body. */
+void http_conn_add_filter(struct http_conn *conn,
+			  const struct http_filter *filter, void *arg);
+
 /* return: 0 on choaked, 1 on queued. */
 int http_conn_write_buf(struct http_conn *conn, struct evbuffer *buf);
 void http_conn_write_finished(struct http_conn *conn);
@@ -127,9 +204,40 @@ void http_conn_flush(struct http_conn *conn);
 
 void http_conn_send_error(struct http_conn *conn, int code,
 			  const char *fmt, ...);
+/* ... asking the client to try again after retry_after seconds */
+void http_conn_send_error_retry(struct http_conn *conn, int code,
+				int retry_after, const char *fmt, ...);
 
+/* optimistic: say 200 now and let the client start talking; a failed
+   connection then just closes it. */
 int http_conn_start_tunnel(struct http_conn *conn, struct evdns_base *dns,
-		      int family, const char *host, int port);
+			   const struct socks_server *socks,
+			   int family, const char *host, int port,
+			   int optimistic);
+/* relay conn's client to bev, a server that has just switched protocols,
+   as if it were an open CONNECT tunnel. conn frees bev. */
+void http_conn_start_tunnel_bev(struct http_conn *conn,
+				struct bufferevent *bev);
+/* answer a CONNECT with bev, already connected to its target. */
+void http_conn_adopt_tunnel(struct http_conn *conn, struct bufferevent *bev);
+/* run body filters that allow it on pool's workers, so they don't hold
+   up the loop. the body's order and everything written around it are
+   kept; writing blocks as usual when the workers fall behind. */
+void http_conn_set_work_pool(struct http_conn *conn, struct work_pool *pool);
+/* once a tunnel is open, carry it on one of pool's threads. only its
+   close, and the bytes it carried, come back to conn. */
+void http_conn_set_relay_pool(struct http_conn *conn,
+			      struct relay_pool *pool);
+/* close a tunnel with ERROR_TUNNEL_TIMEDOUT once nothing has crossed it
+   for idle, or once it has been open for lifetime. NULL or zero means
+   no limit. takes effect when the tunnel opens. */
+void http_conn_set_tunnel_timeouts(struct http_conn *conn,
+				   const struct timeval *idle,
+				   const struct timeval *lifetime);
+/* bytes relayed from the client (up) and to it (down), and how long the
+   tunnel has been open. */
+void http_conn_get_tunnel_stats(struct http_conn *conn, ev_uint64_t *up,
+				ev_uint64_t *down, struct timeval *duration);
 
 const char *http_conn_error_to_string(enum http_conn_error err);
 const char *http_method_to_string(enum http_method m);
@@ -81,6 +81,9 @@ void
 log_msg_va(enum log_level lvl, int serr, const char *msg, va_list ap)
 {
 	if (lvl >= min_log_level) {
+		/* embedders may never set a log file */
+		if (!log_file)
+			log_file = stderr;
 		vfprintf(log_file, msg, ap);
 		if (serr)
 			fprintf(log_file, ": %s", socket_error_string(-1));
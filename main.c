@@ -13,47 +13,19 @@
 #include <event2/util.h>
 
 #include "config.h"
-#include "proxy.h"
-#include "conn.h"
+#include "shim.h"
 #include "log.h"
-#include "util.h"
 
 #define DEFAULT_LISTEN_ADDR "127.0.0.1"
 #define DEFAULT_LISTEN_PORT "8123"
 
-static void
-set_socks_server(const char *socks)
-{
-	struct url *url;
-	enum socks_ver socksv;
-
-	url = url_tokenize(socks);
-	if (!url || !url->scheme) {
-		log_error("shim: bad socks server, %s", socks);
-		exit(1);
-	}
-	if (url->port < 0)
-		url->port = 1080;
-
-	if (!evutil_ascii_strcasecmp(url->scheme, "socks4"))
-		socksv = SOCKS_4;
-	else if (!evutil_ascii_strcasecmp(url->scheme, "socks4a"))
-		socksv = SOCKS_4a;
-	else {
-		log_error("shim: unknown socks version, %s",
-			  url->scheme);
-		exit(1);
-	}
-
-	if (conn_set_socks_server(url->host, url->port, socksv) < 0)
-		exit(1);
-
-	url_free(url);	
-}
+static const char *blocklist_path = NULL;
+static const char *routes_path = NULL;
+static const char *policy_path = NULL;
 
 static void
-start_listening(struct event_base *base, struct evdns_base *dns,
-		const char *laddr, const char *lport)
+start_listening(struct shim_proxy *proxy, const char *laddr,
+		const char *lport)
 {
 	struct evutil_addrinfo hints;
 	struct evutil_addrinfo *ai = NULL;
@@ -76,8 +48,10 @@ start_listening(struct event_base *base, struct evdns_base *dns,
 		exit(1);
         }
 	
-	if (proxy_init(base, dns, ai->ai_addr, ai->ai_addrlen) < 0)
+	if (shim_proxy_listen(proxy, ai->ai_addr, ai->ai_addrlen) < 0)
 		exit(1);
+
+	evutil_freeaddrinfo(ai);
 }
 
 static void
@@ -142,41 +116,215 @@ init_socket_stuff()
 #endif
 }
 
+static struct event_base *
+new_event_base(const char *backend)
+{
+	struct event_config *cfg;
+	struct event_base *base;
+	const char **methods;
+	int i, found;
+
+	if (!backend)
+		return event_base_new();
+
+	/* libevent picks its preferred method itself, so steer it towards
+	 * the requested one by avoiding every other method it knows about */
+	cfg = event_config_new();
+	methods = event_get_supported_methods();
+	found = 0;
+	for (i = 0; methods[i]; ++i) {
+		if (!evutil_ascii_strcasecmp(methods[i], backend))
+			found = 1;
+		else
+			event_config_avoid_method(cfg, methods[i]);
+	}
+
+	if (!found) {
+		log_error("shim: unsupported I/O backend, %s", backend);
+		for (i = 0; methods[i]; ++i)
+			log_error("shim: available backend: %s", methods[i]);
+		exit(1);
+	}
+
+	base = event_base_new_with_config(cfg);
+	event_config_free(cfg);
+	if (!base) {
+		log_error("shim: couldn't initialize I/O backend %s", backend);
+		exit(1);
+	}
+
+	return base;
+}
+
+#ifndef WIN32
+static void
+reload_lists(evutil_socket_t sig, short what, void *arg)
+{
+	struct shim_proxy *proxy = arg;
+
+	if (blocklist_path) {
+		log_notice("shim: reloading %s", blocklist_path);
+		shim_proxy_set_blocklist(proxy, blocklist_path);
+	}
+	if (routes_path) {
+		log_notice("shim: reloading %s", routes_path);
+		shim_proxy_set_routes(proxy, routes_path);
+	}
+	if (policy_path) {
+		log_notice("shim: reloading %s", policy_path);
+		shim_proxy_set_header_policy(proxy, policy_path);
+	}
+}
+#endif
+
 static void
 usage(void)
 {
-	printf("shim [-l host] [-p port] [-qVv] "
+	printf("shim [-b blocklist] [-e backend] [-f failures] [-H policy] "
+	       "[-l host] [-M kbytes] [-p port] [-OoqUVv] [-P spares] "
+	       "[-Q target[:interval]] [-R max[:any]] [-r routes] "
+	       "[-t threads] [-T idle[:lifetime]] [-w threads] [-z level] "
 	       "[ socks_version://address[:port] ]\n");
 	exit(1);
 }
 
+/* idle[:lifetime], in seconds */
+static void
+parse_tunnel_timeouts(const char *arg, struct timeval *idle,
+		      struct timeval *lifetime)
+{
+	char *end;
+
+	evutil_timerclear(idle);
+	evutil_timerclear(lifetime);
+	idle->tv_sec = strtol(arg, &end, 10);
+	if (*end == ':')
+		lifetime->tv_sec = strtol(end + 1, &end, 10);
+	if (*end || idle->tv_sec < 0 || lifetime->tv_sec < 0) {
+		log_error("shim: bad tunnel timeouts, %s", arg);
+		exit(1);
+	}
+}
+
+/* max[:any] */
+static void
+parse_redirects(const char *arg, int *max, int *cross_host)
+{
+	char *end;
+
+	*max = strtol(arg, &end, 10);
+	*cross_host = 0;
+	if (!strcmp(end, ":any"))
+		*cross_host = 1;
+	else if (*end || *max < 0) {
+		log_error("shim: bad redirect limit, %s", arg);
+		exit(1);
+	}
+}
+
+/* target[:interval], in milliseconds */
+static void
+parse_queue_delay(const char *arg, struct timeval *target,
+		  struct timeval *interval)
+{
+	long t, i = 0;
+	char *end;
+
+	t = strtol(arg, &end, 10);
+	if (*end == ':')
+		i = strtol(end + 1, &end, 10);
+	if (*end || t <= 0 || i < 0) {
+		log_error("shim: bad queue delay, %s", arg);
+		exit(1);
+	}
+	target->tv_sec = t / 1000;
+	target->tv_usec = t % 1000 * 1000;
+	interval->tv_sec = i / 1000;
+	interval->tv_usec = i % 1000 * 1000;
+}
+
 int
 main(int argc, char **argv)
 {
 	struct event_base *base;
 	struct evdns_base *dns = NULL;
-	int opt;
-	const char *laddr, *lport;
+	struct shim_proxy *proxy;
+#ifndef WIN32
+	struct event *hup = NULL;
+#endif
+	int opt, optimistic = 0, onions = 0, spares = 0, compress = 0;
+	int threads = 0, relays = 0, redirects = 0, cross_host = 0;
+	int failures = 0, uring = 0;
+	long cache_kb = 1024;
+	const char *laddr, *lport, *backend, *timeouts, *queue_delay;
+	struct timeval idle, lifetime, target, interval;
 
 	init_socket_stuff();
 
-	base = event_base_new();
-#ifndef DISABLE_DIRECT_CONNECTIONS
-	dns = evdns_base_new(base, 1);
-#endif
 	log_set_file(NULL);
 
 	laddr = DEFAULT_LISTEN_ADDR;
 	lport = DEFAULT_LISTEN_PORT;
+	backend = NULL;
+	timeouts = NULL;
+	queue_delay = NULL;
 
-	while ((opt = getopt(argc, argv, "l:p:Vvq")) >= 0) {
+	while ((opt = getopt(argc, argv, "b:e:f:H:l:M:p:OoP:Q:R:r:t:T:UVvqw:z:")) >= 0) {
 		switch (opt) {
+		case 'b':
+			blocklist_path = optarg;
+			break;
+		case 'e':
+			backend = optarg;
+			break;
+		case 'f':
+			failures = atoi(optarg);
+			if (failures < 1)
+				usage();
+			break;
+		case 'H':
+			policy_path = optarg;
+			break;
 		case 'l':
 			laddr = optarg;
 			break;
+		case 'M':
+			cache_kb = atol(optarg);
+			if (cache_kb < 0)
+				usage();
+			break;
 		case 'p':
 			lport = optarg;
 			break;
+		case 'O':
+			optimistic = 1;
+			break;
+		case 'o':
+			onions = 1;
+			break;
+		case 'P':
+			spares = atoi(optarg);
+			break;
+		case 'Q':
+			queue_delay = optarg;
+			break;
+		case 'R':
+			parse_redirects(optarg, &redirects, &cross_host);
+			break;
+		case 'r':
+			routes_path = optarg;
+			break;
+		case 't':
+			relays = atoi(optarg);
+			if (relays < 1)
+				usage();
+			break;
+		case 'T':
+			timeouts = optarg;
+			break;
+		case 'U':
+			uring = 1;
+			break;
 		case 'V':
 			printf("%s\n", PACKAGE_STRING);
 			exit(1);
@@ -186,6 +334,16 @@ main(int argc, char **argv)
 		case 'q':
 			decrease_log_verbosity();
 			break;
+		case 'w':
+			threads = atoi(optarg);
+			if (threads < 1)
+				usage();
+			break;
+		case 'z':
+			compress = atoi(optarg);
+			if (compress < 1 || compress > 9)
+				usage();
+			break;
 		default:
 			usage();
 		}
@@ -194,10 +352,69 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc)
-		set_socks_server(argv[0]);
-	start_listening(base, dns, laddr, lport);
+	/* io_uring needs relay threads to carry tunnels on */
+	if (uring && !relays)
+		relays = 1;
+
+	if (shim_use_event_allocator(cache_kb * 1024) < 0)
+		log_warn("shim: libevent is using its own allocator");
+	base = new_event_base(backend);
+	log_info("shim: using %s I/O backend", event_base_get_method(base));
+	if (shim_event_base_init_priorities(base) < 0)
+		log_warn("shim: couldn't set up event priorities");
+#ifndef DISABLE_DIRECT_CONNECTIONS
+	dns = evdns_base_new(base, 1);
+#endif
+	proxy = shim_proxy_new(base, dns);
+	shim_proxy_set_optimistic_connect(proxy, optimistic);
+	shim_proxy_set_onion_location(proxy, onions);
+	shim_proxy_set_follow_redirects(proxy, redirects, cross_host);
+	shim_proxy_set_circuit_breaker(proxy, failures);
+	if (spares > 0)
+		shim_proxy_set_max_spare_tunnels(proxy, spares);
+	if (timeouts) {
+		parse_tunnel_timeouts(timeouts, &idle, &lifetime);
+		shim_proxy_set_tunnel_timeouts(proxy, &idle, &lifetime);
+	}
+	if (queue_delay) {
+		parse_queue_delay(queue_delay, &target, &interval);
+		shim_proxy_set_queue_delay(proxy, &target, &interval);
+	}
+
+	if (blocklist_path &&
+	    shim_proxy_set_blocklist(proxy, blocklist_path) < 0)
+		exit(1);
+	if (routes_path && shim_proxy_set_routes(proxy, routes_path) < 0)
+		exit(1);
+	if (policy_path &&
+	    shim_proxy_set_header_policy(proxy, policy_path) < 0)
+		exit(1);
+	if (compress && shim_proxy_set_compression(proxy, compress) < 0)
+		exit(1);
+	if (threads && shim_proxy_set_worker_threads(proxy, threads) < 0)
+		exit(1);
+	shim_proxy_set_relay_io_uring(proxy, uring);
+	if (relays && shim_proxy_set_relay_threads(proxy, relays) < 0)
+		exit(1);
+#ifndef WIN32
+	if (blocklist_path || routes_path || policy_path) {
+		hup = evsignal_new(base, SIGHUP, reload_lists, proxy);
+		evsignal_add(hup, NULL);
+	}
+#endif
+
+	if (argc && shim_proxy_set_socks_server(proxy, argv[0]) < 0)
+		exit(1);
+	start_listening(proxy, laddr, lport);
 	event_base_dispatch(base);
 
+#ifndef WIN32
+	if (hup)
+		event_free(hup);
+#endif
+	shim_proxy_free(proxy);
+	/* let the connections it closed go */
+	event_base_loop(base, EVLOOP_NONBLOCK);
+
 	return 0;	
 }
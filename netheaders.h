@@ -2,11 +2,13 @@
 #define _NETHEADERS_H_
 
 #ifndef WIN32
+#include <sys/socket.h>
 #include <netinet/in.h>
 #else
 #include <windows.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#define SHUT_WR SD_SEND
 #endif
 
 #endif
@@ -0,0 +1,246 @@
+#include <sys/queue.h>
+#include <string.h>
+
+#include <event2/util.h>
+#include <event2/event.h>
+
+#include "onion.h"
+#include "util.h"
+#include "log.h"
+
+/* how long a mapping lasts after the site last advertised it, and how
+   long a dropped one is ignored when the site advertises it again */
+static struct timeval mapping_ttl = {3600, 0};
+/* failed connections in a row before a mapping is dropped */
+static unsigned max_failures = 3;
+/* a mapping whose connections average longer than this is dropped, once
+   it has been tried often enough to tell */
+static struct timeval max_latency = {10, 0};
+static unsigned min_latency_samples = 3;
+
+#define MAX_MAPPINGS 256
+
+struct mapping {
+	TAILQ_ENTRY(mapping) next;
+	const char *host;		/* atoms */
+	int port;
+	const char *onion;
+	int onion_port;
+	struct timeval expires;
+	unsigned nconnects;
+	unsigned nfailures;		/* in a row */
+	long avg_latency_ms;		/* moving average of connect times */
+	int dropped;
+};
+TAILQ_HEAD(mapping_list, mapping);
+
+struct onion_cache {
+	struct event_base *base;
+	struct mapping_list mappings;		/* most recently used first */
+	size_t size;				/* dropped ones too */
+	struct onion_cache_stats stats;
+};
+
+static void
+mapping_free(struct onion_cache *cache, struct mapping *m)
+{
+	TAILQ_REMOVE(&cache->mappings, m, next);
+	cache->size--;
+	if (!m->dropped)
+		cache->stats.nmappings--;
+	host_atom_unref(m->host);
+	host_atom_unref(m->onion);
+	mem_free(m);
+}
+
+/* kept around so the site's next Onion-Location doesn't bring it back */
+static void
+mapping_drop(struct onion_cache *cache, struct mapping *m, const char *why)
+{
+	struct timeval now;
+
+	log_notice("onion: no longer using %s for %s:%d: %s",
+		   log_scrub(m->onion), log_scrub(m->host), m->port, why);
+	cache->stats.ndropped++;
+	cache->stats.nmappings--;
+	m->dropped = 1;
+	event_base_gettimeofday_cached(cache->base, &now);
+	evutil_timeradd(&now, &mapping_ttl, &m->expires);
+}
+
+static struct mapping *
+mapping_find(struct onion_cache *cache, const char *host, int port)
+{
+	struct mapping *m;
+	struct timeval now;
+
+	TAILQ_FOREACH(m, &cache->mappings, next) {
+		if (m->host == host && m->port == port)
+			break;
+	}
+	if (!m)
+		return NULL;
+
+	event_base_gettimeofday_cached(cache->base, &now);
+	if (evutil_timercmp(&now, &m->expires, >)) {
+		mapping_free(cache, m);
+		return NULL;
+	}
+
+	TAILQ_REMOVE(&cache->mappings, m, next);
+	TAILQ_INSERT_HEAD(&cache->mappings, m, next);
+
+	return m;
+}
+
+static int
+is_onion(const char *host)
+{
+	size_t len = strlen(host);
+
+	return len > 6 && !evutil_ascii_strcasecmp(host + len - 6, ".onion");
+}
+
+struct onion_cache *
+onion_cache_new(struct event_base *base)
+{
+	struct onion_cache *cache;
+
+	cache = mem_calloc(1, sizeof(*cache));
+	cache->base = base;
+	TAILQ_INIT(&cache->mappings);
+
+	return cache;
+}
+
+void
+onion_cache_free(struct onion_cache *cache)
+{
+	struct mapping *m;
+
+	if (!cache)
+		return;
+
+	while ((m = TAILQ_FIRST(&cache->mappings)))
+		mapping_free(cache, m);
+	mem_free(cache);
+}
+
+int
+onion_cache_learn(struct onion_cache *cache, const char *host, int port,
+		  const char *location)
+{
+	struct mapping *m;
+	struct url *url;
+	struct timeval now;
+
+	if (is_onion(host))
+		return 0;
+	url = url_tokenize(location);
+	if (!url || !url->scheme || !url->host ||
+	    evutil_ascii_strcasecmp(url->scheme, "http") ||
+	    !is_onion(url->host)) {
+		log_debug("onion: ignoring Onion-Location from %s:%d",
+			  log_scrub(host), port);
+		url_free(url);
+		return 0;
+	}
+	if (url->port < 0)
+		url->port = 80;
+
+	m = mapping_find(cache, host, port);
+	if (m && (m->onion_port != url->port ||
+		  m->onion != url->host)) {
+		/* the site moved; start over with the new address */
+		mapping_free(cache, m);
+		m = NULL;
+	}
+	if (m && m->dropped) {
+		url_free(url);
+		return 0;
+	}
+	if (!m) {
+		if (cache->size == MAX_MAPPINGS)
+			mapping_free(cache, TAILQ_LAST(&cache->mappings,
+						       mapping_list));
+		m = mem_calloc(1, sizeof(*m));
+		m->host = host_atom_ref(host);
+		m->port = port;
+		m->onion = host_atom_ref(url->host);
+		m->onion_port = url->port;
+		TAILQ_INSERT_HEAD(&cache->mappings, m, next);
+		cache->size++;
+		cache->stats.nmappings++;
+		cache->stats.nlearned++;
+		log_info("onion: %s:%d is also at %s:%d", log_scrub(host),
+			 port, log_scrub(m->onion), m->onion_port);
+	}
+
+	event_base_gettimeofday_cached(cache->base, &now);
+	evutil_timeradd(&now, &mapping_ttl, &m->expires);
+	url_free(url);
+
+	return 1;
+}
+
+const char *
+onion_cache_lookup(struct onion_cache *cache, const char *host, int port,
+		   int *onion_port)
+{
+	struct mapping *m;
+
+	m = mapping_find(cache, host, port);
+	if (!m || m->dropped)
+		return NULL;
+
+	*onion_port = m->onion_port;
+
+	return m->onion;
+}
+
+void
+onion_cache_connected(struct onion_cache *cache, const char *host, int port,
+		      const struct timeval *elapsed)
+{
+	struct mapping *m;
+	long ms;
+
+	cache->stats.nconnects++;
+	m = mapping_find(cache, host, port);
+	if (!m || m->dropped)
+		return;
+
+	ms = elapsed->tv_sec * 1000 + elapsed->tv_usec / 1000;
+	if (!m->nconnects)
+		m->avg_latency_ms = ms;
+	else
+		m->avg_latency_ms += (ms - m->avg_latency_ms) / 4;
+	m->nconnects++;
+	m->nfailures = 0;
+	log_debug("onion: connected to %s in %ld ms (average %ld over %u)",
+		  log_scrub(m->onion), ms, m->avg_latency_ms, m->nconnects);
+
+	if (m->nconnects >= min_latency_samples &&
+	    m->avg_latency_ms > max_latency.tv_sec * 1000 +
+				max_latency.tv_usec / 1000)
+		mapping_drop(cache, m, "too slow");
+}
+
+void
+onion_cache_failed(struct onion_cache *cache, const char *host, int port)
+{
+	struct mapping *m;
+
+	cache->stats.nconnects++;
+	cache->stats.nfailures++;
+	m = mapping_find(cache, host, port);
+	if (m && !m->dropped && ++m->nfailures >= max_failures)
+		mapping_drop(cache, m, "connections keep failing");
+}
+
+void
+onion_cache_get_stats(struct onion_cache *cache,
+		      struct onion_cache_stats *stats)
+{
+	*stats = cache->stats;
+}
@@ -0,0 +1,45 @@
+#ifndef _ONION_H_
+#define _ONION_H_
+
+#include <event2/util.h>
+
+/* Onion-Location mappings. A site that answers with an Onion-Location
+   header is remembered for a while, so later plain HTTP requests for it
+   can be sent to its onion service instead. Each mapping keeps track of
+   how connections through it go, and one that keeps failing or is much
+   slower than it should be is forgotten. */
+
+struct event_base;
+struct onion_cache;
+
+struct onion_cache_stats {
+	size_t nmappings;		/* known right now */
+	ev_uint64_t nlearned;		/* new mappings seen */
+	ev_uint64_t nconnects;		/* connections made through one */
+	ev_uint64_t nfailures;		/* ... that failed */
+	ev_uint64_t ndropped;		/* mappings given up on */
+};
+
+struct onion_cache *onion_cache_new(struct event_base *base);
+void onion_cache_free(struct onion_cache *cache);
+
+/* host:port sent location, an Onion-Location value. Only http:// onion
+   addresses are taken. return: 1 if host:port now has a mapping. */
+int onion_cache_learn(struct onion_cache *cache, const char *host, int port,
+		      const char *location);
+
+/* the onion host to connect to for host:port, or NULL. It's only good
+   until the cache is next used. */
+const char *onion_cache_lookup(struct onion_cache *cache, const char *host,
+			       int port, int *onion_port);
+
+/* how a connection made for host:port through its mapping went. */
+void onion_cache_connected(struct onion_cache *cache, const char *host,
+			   int port, const struct timeval *elapsed);
+void onion_cache_failed(struct onion_cache *cache, const char *host,
+			int port);
+
+void onion_cache_get_stats(struct onion_cache *cache,
+			   struct onion_cache_stats *stats);
+
+#endif
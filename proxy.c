@@ -4,9 +4,22 @@
 #include <event2/event.h>
 #include <event2/listener.h>
 #include <event2/buffer.h>
-#include "proxy.h"
+#include <event2/bufferevent.h>
+#include "shim.h"
 #include "conn.h"
 #include "httpconn.h"
+#include "h2.h"
+#include "tunnelpool.h"
+#include "blocklist.h"
+#include "route.h"
+#include "onion.h"
+#include "headerpolicy.h"
+#include "compress.h"
+#include "workpool.h"
+#include "relay.h"
+#include "breaker.h"
+#include "codel.h"
+#include "alloc.h"
 #include "util.h"
 #include "headers.h"
 #include "log.h"
@@ -23,10 +36,17 @@ struct server {
 	TAILQ_ENTRY(server) next;
 	enum server_state state;
 	size_t nserviced;
-	char *host;
+	const char *host;		/* an atom */
 	int port;
+	/* where we're really connected, if the site has an onion service */
+	const char *onion;
+	int onion_port;
+	struct timeval connect_start;
+	/* fails the connection without trying; the host keeps failing */
+	struct event *fail_ev;
 	struct http_conn *conn;
 	struct client *client;
+	struct shim_proxy *proxy;
 };
 TAILQ_HEAD(server_list, server);
 
@@ -38,11 +58,75 @@ enum client_state {
 };
 
 struct client {
+	TAILQ_ENTRY(client) next;
 	enum client_state state;
 	struct http_request_list requests;
 	size_t nrequests;
 	struct http_conn *conn;
 	struct server *server;
+	/* what a tunnel was opened for, off the queue */
+	struct http_request *tunnel_req;
+	/* an h2c upgrade waiting for the connection to be let go */
+	struct http_request *h2_req;
+	char *h2_settings;
+	/* a close-delimited response we're waiting to see the end of */
+	struct http_response *held_resp;
+	struct evbuffer *held_body;
+	/* on this machine, so compressing for it saves nothing */
+	int local;
+	/* redirects followed for the first request, and where to */
+	int nredirects;
+	struct token_list visited;
+	struct url *redirect;		/* the current response's */
+	struct server *next_server;	/* ... connecting while it's read */
+	/* how long its requests wait to go out */
+	struct codel codel;
+	struct shim_proxy *proxy;
+};
+TAILQ_HEAD(client_list, client);
+
+/* an HTTP/2 connection; its streams are clients of their own */
+struct h2_client {
+	TAILQ_ENTRY(h2_client) next;
+	struct h2_session *session;
+	int local;
+	struct shim_proxy *proxy;
+};
+TAILQ_HEAD(h2_client_list, h2_client);
+
+struct listener {
+	TAILQ_ENTRY(listener) next;
+	struct evconnlistener *lev;
+};
+TAILQ_HEAD(listener_list, listener);
+
+struct shim_proxy {
+	struct event_base *base;
+	struct evdns_base *dns;
+	struct socks_server *socks;
+	struct listener_list listeners;
+	struct client_list clients;
+	struct h2_client_list h2_clients;
+	struct server_list idle_servers;
+	struct tunnel_pool *spares;
+	struct blocklist *blocklist;
+	struct route_table *routes;
+	struct onion_cache *onions;
+	struct header_policy *header_policy;
+	struct compressor *compressor;
+	struct work_pool *workers;
+	struct relay_pool *relays;
+	int relay_uring;
+	struct breaker *breaker;
+	size_t max_pending_requests;
+	size_t max_buffered_body;
+	struct codel_params queue_delay;	/* target 0 for none */
+	int optimistic_connect;
+	int max_redirects;
+	int follow_cross_host;
+	struct timeval tunnel_idle_timeout;
+	struct timeval tunnel_max_lifetime;
+	struct shim_stats stats;
 };
 
 static void on_client_error(struct http_conn *, enum http_conn_error, void *);
@@ -51,6 +135,10 @@ static void on_client_read_body(struct http_conn *, struct evbuffer *, void *);
 static void on_client_msg_complete(struct http_conn *, void *);
 static void on_client_write_more(struct http_conn *, void *);
 static void on_client_flush(struct http_conn *, void *);
+static void on_client_h2_preface(struct http_conn *, void *);
+static void on_client_tunnel_connected(struct http_conn *, void *);
+static void on_client_released(struct http_conn *, struct bufferevent *,
+			       void *);
 
 static void on_server_connected(struct http_conn *, void *);
 static void on_server_error(struct http_conn *, enum http_conn_error, void *);
@@ -60,9 +148,11 @@ static void on_server_read_body(struct http_conn *, struct evbuffer *, void *);
 static void on_server_msg_complete(struct http_conn *, void *);
 static void on_server_write_more(struct http_conn *, void *);
 static void on_server_flush(struct http_conn *, void *);
+static void on_server_released(struct http_conn *, struct bufferevent *,
+			       void *);
 
 static const struct http_cbs client_methods = {
-	0,
+	on_client_tunnel_connected,
 	on_client_error,
 	on_client_request,
 	0,
@@ -70,7 +160,9 @@ static const struct http_cbs client_methods = {
 	on_client_read_body,
 	on_client_msg_complete,
 	on_client_write_more,
-	on_client_flush
+	on_client_flush,
+	on_client_h2_preface,
+	on_client_released
 };
 
 static const struct http_cbs server_methods = {
@@ -82,14 +174,18 @@ static const struct http_cbs server_methods = {
 	on_server_read_body,
 	on_server_msg_complete,
 	on_server_write_more,
-	on_server_flush
+	on_server_flush,
+	0,
+	on_server_released
 };
 
-static struct event_base *proxy_event_base;
-static struct evdns_base *proxy_evdns_base;
-static struct evconnlistener *listener = NULL;
-static struct server_list idle_servers;
-static size_t max_pending_requests = 8;
+static void on_h2_stream(struct h2_session *, struct bufferevent *, void *);
+static void on_h2_close(struct h2_session *, void *);
+
+static const struct h2_cbs h2_methods = {
+	on_h2_stream,
+	on_h2_close
+};
 
 static struct server *
 server_new(const char *host, int port, struct client *client)
@@ -97,11 +193,13 @@ server_new(const char *host, int port, struct client *client)
 	struct server *server;
 
 	server = mem_calloc(1, sizeof(*server));
-	server->host = mem_strdup(host);
+	server->host = host_atom_ref(host);
 	server->port = port;
 	server->client = client;
-	server->conn = http_conn_new(proxy_event_base, -1, HTTP_SERVER,
+	server->proxy = client->proxy;
+	server->conn = http_conn_new(server->proxy->base, -1, HTTP_SERVER,
 				&server_methods, server);
+	server->proxy->stats.nservers++;
 	log_debug("proxy: new server: %p, %s:%d",
 		  server, server->host, server->port);
 
@@ -111,8 +209,7 @@ server_new(const char *host, int port, struct client *client)
 static inline int
 server_match(const struct server *server, const char *host, int port)
 {
-	return (!evutil_ascii_strcasecmp(server->host, host) &&
-		server->port == port);
+	return server->host == host && server->port == port;
 }
 
 static void
@@ -126,43 +223,157 @@ server_free(struct server *server)
 	log_debug("proxy: freeing server: %p, %s:%d",
 		  server, server->host, server->port);
 
-	TAILQ_FOREACH(tmp, &idle_servers, next) {
+	TAILQ_FOREACH(tmp, &server->proxy->idle_servers, next) {
 		if (tmp == server)
 			log_fatal("proxy: idle server %p still queued!",
 				  server);
 	}
 
-	mem_free(server->host);
+	server->proxy->stats.nservers--;
+	host_atom_unref(server->host);
+	host_atom_unref(server->onion);
+	if (server->fail_ev)
+		event_free(server->fail_ev);
 	http_conn_free(server->conn);
 	mem_free(server);
 }
 
+/* where connections to host:port go: socks is set, NULL to connect
+   directly, or -1 if a rule refuses them. */
+static int
+route_target(const char *host, int port, const struct socks_server **socks,
+	     void *arg)
+{
+	struct shim_proxy *proxy = arg;
+
+	*socks = proxy->socks;
+	if (!proxy->routes)
+		return 0;
+
+	switch (route_lookup(proxy->routes, host, port, socks)) {
+	case ROUTE_DIRECT:
+		*socks = NULL;
+		return 0;
+	case ROUTE_REJECT:
+		return -1;
+	default:
+		return 0;
+	}
+}
+
+/* send a site's requests to the onion service it advertised, if there
+   is one and it can be reached through a SOCKS 4a server */
+static void
+server_use_onion(struct server *server)
+{
+	struct shim_proxy *proxy = server->proxy;
+	const struct socks_server *socks;
+	const char *onion;
+	int port;
+
+	if (!proxy->onions)
+		return;
+	onion = onion_cache_lookup(proxy->onions, server->host, server->port,
+				   &port);
+	if (!onion || route_target(onion, port, &socks, proxy) < 0 ||
+	    !socks || socks_server_get_version(socks) != SOCKS_4a)
+		return;
+
+	server->onion = host_atom_ref(onion);
+	server->onion_port = port;
+}
+
+static void server_fail_fast(evutil_socket_t, short, void *);
+static void client_close_on_flush(struct client *);
+static void client_request_serviced(struct client *);
+
 static int
 server_connect(struct server *server)
 {
+	struct shim_proxy *proxy = server->proxy;
+	const struct socks_server *socks;
+	const char *host = server->host;
+	int port = server->port;
+
 	server->state = SERVER_STATE_CONNECTING;
+	if (server->onion) {
+		host = server->onion;
+		port = server->onion_port;
+		event_base_gettimeofday_cached(server->proxy->base,
+					       &server->connect_start);
+	} else if (proxy->breaker &&
+		   breaker_allow(proxy->breaker, host, port) < 0) {
+		/* fail it from the loop, as a real failure would be */
+		server->fail_ev = evtimer_new(proxy->base, server_fail_fast,
+					      server);
+		event_active(server->fail_ev, EV_TIMEOUT, 1);
+		return 0;
+	}
 	log_debug("proxy: server %p, %s:%d connecting",
-		  server, server->host, server->port);
+		  server, host, port);
+	/* rejects were turned away when the request came in; if the rules
+	   have since been reloaded, that decision stands */
+	if (route_target(host, port, &socks, server->proxy) < 0)
+		socks = server->proxy->socks;
 	// XXX AF_UNSPEC seems to cause crashes w/ IPv6 queries
-	return http_conn_connect(server->conn, proxy_evdns_base, AF_INET,
-				 server->host, server->port);
+	return http_conn_connect(server->conn, server->proxy->dns,
+				 socks, AF_INET, host, port);
 }
 
+/* bev, if set, is used instead of sock */
 static struct client *
-client_new(evutil_socket_t sock)
+client_new(struct shim_proxy *proxy, evutil_socket_t sock,
+	   struct bufferevent *bev)
 {
 	struct client *client;
 
 	client = mem_calloc(1, sizeof(*client));
 	TAILQ_INIT(&client->requests);
-	client->conn = http_conn_new(proxy_event_base, sock, HTTP_CLIENT,
+	TAILQ_INIT(&client->visited);
+	client->proxy = proxy;
+	if (bev)
+		client->conn = http_conn_new_bev(proxy->base, bev,
+				HTTP_CLIENT, &client_methods, client);
+	else {
+		client->conn = http_conn_new(proxy->base, sock, HTTP_CLIENT,
 				&client_methods, client);
+		client->local = socket_peer_is_local(sock);
+	}
+	http_conn_set_work_pool(client->conn, proxy->workers);
+	http_conn_set_relay_pool(client->conn, proxy->relays);
+	http_conn_set_tunnel_timeouts(client->conn, &proxy->tunnel_idle_timeout,
+				      &proxy->tunnel_max_lifetime);
+	TAILQ_INSERT_TAIL(&proxy->clients, client, next);
+	proxy->stats.nclients++;
 
 	log_debug("proxy: new client %p", client);
 
 	return client;
 }
 
+static void
+client_drop_held_response(struct client *client)
+{
+	if (!client->held_resp)
+		return;
+
+	http_response_free(client->held_resp);
+	evbuffer_free(client->held_body);
+	client->held_resp = NULL;
+	client->held_body = NULL;
+}
+
+static void
+client_clear_redirects(struct client *client)
+{
+	client->nredirects = 0;
+	token_list_clear(&client->visited);
+	url_free(client->redirect);
+	client->redirect = NULL;
+	server_free(client->next_server);
+	client->next_server = NULL;
+}
+
 static void
 client_free(struct client *client)
 {
@@ -177,12 +388,89 @@ client_free(struct client *client)
 		TAILQ_REMOVE(&client->requests, req, next);
 		http_request_free(req);
 	}
+	http_request_free(client->tunnel_req);
+	http_request_free(client->h2_req);
+	mem_free(client->h2_settings);
+
+	TAILQ_REMOVE(&client->proxy->clients, client, next);
+	client->proxy->stats.nclients--;
 
+	client_drop_held_response(client);
+	client_clear_redirects(client);
 	server_free(client->server);
 	http_conn_free(client->conn);
 	mem_free(client);
 }
 
+static struct h2_client *
+h2_client_new(struct shim_proxy *proxy, int local)
+{
+	struct h2_client *h2;
+
+	h2 = mem_calloc(1, sizeof(*h2));
+	h2->proxy = proxy;
+	h2->local = local;
+	TAILQ_INSERT_TAIL(&proxy->h2_clients, h2, next);
+	proxy->stats.nh2_sessions++;
+
+	return h2;
+}
+
+static void
+h2_client_free(struct h2_client *h2)
+{
+	TAILQ_REMOVE(&h2->proxy->h2_clients, h2, next);
+	h2->proxy->stats.nh2_sessions--;
+	mem_free(h2);
+}
+
+/* a first request asking to switch to h2c, with nothing to read after it */
+static int
+client_wants_h2(struct client *client, struct http_request *req)
+{
+	char *val;
+	int ok = 0;
+
+	if (client->nrequests || req->meth == METH_CONNECT ||
+	    http_conn_current_message_has_body(client->conn) ||
+	    !headers_has_key(req->headers, "HTTP2-Settings"))
+		return 0;
+
+	val = headers_find(req->headers, "Upgrade");
+	if (val) {
+		ok = !evutil_ascii_strcasecmp(val, "h2c");
+		mem_free(val);
+	}
+
+	return ok;
+}
+
+static void
+client_upgrade_h2(struct client *client, struct http_request *req)
+{
+	struct http_response resp;
+	struct header_list headers;
+
+	log_debug("proxy: client %p upgrading to h2c", client);
+
+	client->h2_settings = headers_find(req->headers, "HTTP2-Settings");
+	headers_remove(req->headers, "HTTP2-Settings");
+	headers_remove(req->headers, "Upgrade");
+
+	TAILQ_INIT(&headers);
+	headers_add_key_val(&headers, "Upgrade", "h2c");
+	resp.vers = HTTP_11;
+	resp.code = 101;
+	resp.reason = "Switching Protocols";
+	resp.headers = &headers;
+	http_conn_set_output_encoding(client->conn, TE_IDENTITY);
+	http_conn_write_response(client->conn, &resp);
+	headers_clear(&headers);
+
+	client->h2_req = req;
+	http_conn_release_bev(client->conn);
+}
+
 static int
 client_scrub_request(struct client *client, struct http_request *req)
 {
@@ -214,7 +502,8 @@ client_scrub_request(struct client *client, struct http_request *req)
 		mem_free(host);	
 	}
 
-	// XXX remove proxy auth msgs?
+	header_policy_apply(client->proxy->header_policy, HEADER_REQUEST,
+			    req->headers);
 
 	return 0;
 
@@ -231,7 +520,8 @@ client_disassociate_server(struct client *client)
 
 	if (http_conn_is_persistent(client->server->conn)) {
 		assert(client->server->state == SERVER_STATE_IDLE);
-		TAILQ_INSERT_TAIL(&idle_servers, client->server, next);
+		TAILQ_INSERT_TAIL(&client->proxy->idle_servers, client->server,
+				  next);
 		client->server->client = NULL;
 		client->server = NULL;
 	} else {
@@ -266,10 +556,14 @@ client_associate_server(struct client *client)
 	if (req->meth == METH_CONNECT)
 		return 0;
 
+	/* the one we have will do */
+	if (client->server)
+		return 0;
+
 	/* try to find an idle server */
-	TAILQ_FOREACH(it, &idle_servers, next) {
+	TAILQ_FOREACH(it, &client->proxy->idle_servers, next) {
 		if (server_match(it, url->host, url->port)) {
-			TAILQ_REMOVE(&idle_servers, it, next);
+			TAILQ_REMOVE(&client->proxy->idle_servers, it, next);
 			assert(it->client == NULL);
 			client->server = it;
 			it->client = client;
@@ -281,6 +575,7 @@ client_associate_server(struct client *client)
 
 	/* we didn't find one. lets setup a new one. */
 	client->server = server_new(url->host, url->port, client);
+	server_use_onion(client->server);
 
 	return server_connect(client->server);	
 }
@@ -303,6 +598,59 @@ client_start_reading_request_body(struct client *client, int on_continue)
 	}
 }
 
+/* how many requests a client may have waiting; while its requests are
+   being shed, just the one */
+static size_t
+client_max_pending(struct client *client)
+{
+	if (client->codel.shedding)
+		return 1;
+	return client->proxy->max_pending_requests;
+}
+
+/* 1 if req, about to go out, has waited so long that it's answered with
+   a 503 instead, so the client's requests behind it wait less. */
+static int
+client_shed_request(struct client *client, struct http_request *req)
+{
+	struct shim_proxy *proxy = client->proxy;
+	struct timeval now, sojourn;
+	int retry_after;
+
+	if (!evutil_timerisset(&proxy->queue_delay.target))
+		return 0;
+
+	event_base_gettimeofday_cached(proxy->base, &now);
+	evutil_timersub(&now, &req->received, &sojourn);
+	if (!codel_should_shed(&client->codel, &proxy->queue_delay, &now,
+			       &sojourn, client->nrequests - 1))
+		return 0;
+
+	log_info("proxy: shedding %s request for %s after %ld ms",
+		 http_method_to_string(req->meth), log_scrub(req->url->host),
+		 (long)(sojourn.tv_sec * 1000 + sojourn.tv_usec / 1000));
+	proxy->stats.nshed_requests++;
+	retry_after = proxy->queue_delay.interval.tv_sec +
+		      (proxy->queue_delay.interval.tv_usec > 0);
+	http_conn_send_error_retry(client->conn, 503, retry_after,
+				   "Too busy; try again shortly");
+	client_request_serviced(client);
+
+	return 1;
+}
+
+/* the tunnel carries everything from here on; the request it was
+   opened for leaves the queue, kept only for the tunnel's target */
+static void
+client_tunnel_begin(struct client *client)
+{
+	struct http_request *req = TAILQ_FIRST(&client->requests);
+
+	TAILQ_REMOVE(&client->requests, req, next);
+	client->nrequests--;
+	client->tunnel_req = req;
+}
+
 /* returns 1 when there's a request we can dispatch with the associated
    server. */
 static int
@@ -316,9 +664,41 @@ client_dispatch_request(struct client *client)
 		return 0;
 
 	if (req->meth == METH_CONNECT) {
+		struct shim_proxy *proxy = client->proxy;
+		const struct socks_server *socks;
+		struct bufferevent *bev;
+
 		assert(server == NULL);
-		http_conn_start_tunnel(client->conn, proxy_evdns_base, AF_INET,
-				       req->url->host, req->url->port);
+		proxy->stats.ntunnels++;
+		bev = tunnel_pool_take(proxy->spares, req->url->host,
+				       req->url->port);
+		if (!bev && proxy->breaker &&
+		    breaker_allow(proxy->breaker, req->url->host,
+				  req->url->port) < 0) {
+			log_info("proxy: not connecting to %s:%d; it keeps "
+				 "failing", log_scrub(req->url->host),
+				 req->url->port);
+			client_close_on_flush(client);
+			http_conn_send_error(client->conn, 504,
+				"Host keeps failing; not trying it for now");
+			client_request_serviced(client);
+			return 0;
+		}
+		client_tunnel_begin(client);
+		if (bev)
+			http_conn_adopt_tunnel(client->conn, bev);
+		else {
+			if (route_target(req->url->host, req->url->port,
+					 &socks, proxy) < 0)
+				socks = proxy->socks;
+			http_conn_start_tunnel(client->conn, proxy->dns,
+					       socks, AF_INET,
+					       req->url->host, req->url->port,
+					       proxy->optimistic_connect);
+		}
+		tunnel_pool_note_connect(proxy->spares, proxy->dns,
+					 route_target, proxy, req->url->host,
+					 req->url->port);
 		return 0;
 	}
 	
@@ -329,6 +709,8 @@ client_dispatch_request(struct client *client)
 
 	/* it might be nice to support pipelining... */
 	if (server_match(server, req->url->host, req->url->port)) {
+		if (client_shed_request(client, req))
+			return 0;
 		log_debug("proxy: writing %s request from client %p to "
 			  "server %p, %s:%d", 
 			  http_method_to_string(req->meth),
@@ -364,7 +746,75 @@ client_close_on_flush(struct client *client)
 	http_conn_flush(client->conn);
 }
 
+/* gzip the body on its way out, if the client wants that */
 static void
+client_compress_response(struct client *client, struct http_response *resp)
+{
+	struct http_request *req = TAILQ_FIRST(&client->requests);
+
+	if (!client->proxy->compressor || client->local ||
+	    req->meth == METH_HEAD || resp->code == 206 ||
+	    !compress_accepted(req->headers))
+		return;
+
+	compressor_add_filter(client->proxy->compressor, client->conn);
+}
+
+/* a small close-delimited body is worth reading to the end so the client
+   can be given a Content-Length and keep its connection. */
+static int
+client_hold_response(struct client *client, struct http_response *resp)
+{
+	struct http_conn *conn = client->server->conn;
+
+	if (!client->proxy->max_buffered_body ||
+	    !http_conn_current_message_has_body(conn) ||
+	    http_conn_get_current_message_body_encoding(conn) == TE_CHUNKED ||
+	    http_conn_get_current_message_body_length(conn) >= 0)
+		return 0;
+
+	log_debug("proxy: holding response for client %p", client);
+	client->held_resp = resp;
+	client->held_body = evbuffer_new();
+
+	return 1;
+}
+
+/* complete: the server closed, so we know the length. otherwise the body
+   outgrew the buffer and is streamed like any other. return: 0 if the
+   client is choked. */
+static int
+client_release_response(struct client *client, int complete)
+{
+	struct http_response *resp = client->held_resp;
+	struct evbuffer *body = client->held_body;
+	char length[32];
+	int ok = 1;
+
+	client->held_resp = NULL;
+	client->held_body = NULL;
+
+	http_conn_set_output_encoding(client->conn, TE_IDENTITY);
+	if (complete) {
+		evutil_snprintf(length, sizeof(length), "%u",
+				(unsigned)evbuffer_get_length(body));
+		headers_add_key_val(resp->headers, "Content-Length", length);
+	} else if (http_conn_is_persistent(client->conn)) {
+		http_conn_set_output_encoding(client->conn, TE_CHUNKED);
+	}
+	client_compress_response(client, resp);
+	http_conn_write_response(client->conn, resp);
+	http_response_free(resp);
+
+	if (evbuffer_get_length(body))
+		ok = http_conn_write_buf(client->conn, body);
+	evbuffer_free(body);
+
+	return ok;
+}
+
+/* return: 1 if resp was kept to be sent later */
+static int
 client_write_response(struct client *client, struct http_response *resp)
 {
 	struct http_request *req;
@@ -383,19 +833,27 @@ client_write_response(struct client *client, struct http_response *resp)
 	if (req->meth == METH_HEAD)
 		http_conn_set_current_message_bodyless(client->server->conn);
 
+	if (client_hold_response(client, resp))
+		return 1;
+
 	http_conn_set_output_encoding(client->conn, TE_IDENTITY);
 	if (http_conn_current_message_has_body(client->server->conn) &&
 	    http_conn_is_persistent(client->conn) &&
 	    http_conn_get_current_message_body_length(client->server->conn) < 0)
 		http_conn_set_output_encoding(client->conn, TE_CHUNKED);
-	
+	if (http_conn_current_message_has_body(client->server->conn))
+		client_compress_response(client, resp);
+
 	http_conn_write_response(client->conn, resp);
+
+	return 0;
 }
 
 static void
 client_request_serviced(struct client *client)
 {
 	struct http_request *req;
+	int sent;
 
 	req = TAILQ_FIRST(&client->requests);
 	assert(req && client->nrequests > 0);
@@ -405,10 +863,18 @@ client_request_serviced(struct client *client)
 	TAILQ_REMOVE(&client->requests, req, next);
 	http_request_free(req);
 	client->nrequests--;
+	client_clear_redirects(client);
 
 	if (client->state == CLIENT_STATE_ACTIVE) {
-		if (client->server)
+		if (client->server) {
+			sent = client->server->state ==
+			    SERVER_STATE_REQUEST_SENT;
 			client->server->state = SERVER_STATE_IDLE;
+			/* it's closing after the response it just sent */
+			if (sent &&
+			    !http_conn_is_persistent(client->server->conn))
+				client_disassociate_server(client);
+		}
 		if (client->nrequests) {
 			client_associate_server(client);
 			client_dispatch_request(client);
@@ -418,12 +884,37 @@ client_request_serviced(struct client *client)
 		if (!http_conn_is_persistent(client->conn)) {
 			client_close_on_flush(client);
 		} else if (!http_conn_current_message_has_body(client->conn) &&
-			   client->nrequests < max_pending_requests) {
+			   client->nrequests < client_max_pending(client)) {
 			http_conn_start_reading(client->conn);
 		}
 	}
 }
 
+/* 1 if req is for a blocked or rejected host and has been answered */
+static int
+client_blocked(struct client *client, struct http_request *req)
+{
+	struct shim_proxy *proxy = client->proxy;
+	const struct socks_server *socks;
+
+	if (proxy->blocklist &&
+	    blocklist_match(proxy->blocklist, req->url->host))
+		proxy->stats.nblocked++;
+	else if (route_target(req->url->host, req->url->port, &socks,
+			      proxy) < 0)
+		proxy->stats.nrejected++;
+	else
+		return 0;
+
+	log_info("proxy: blocked %s request for %s",
+		 http_method_to_string(req->meth), log_scrub(req->url->host));
+	client_discard_input(client);
+	http_conn_send_error(client->conn, 403, "Blocked");
+	http_request_free(req);
+
+	return 1;
+}
+
 static void
 client_notice_server_failed(struct client *client, const char *msg)
 {
@@ -431,9 +922,10 @@ client_notice_server_failed(struct client *client, const char *msg)
 	struct server *server = client->server;
 
 	client->server = NULL;
+	client_drop_held_response(client);
 
 	while ((req = TAILQ_FIRST(&client->requests))) {
-		if (evutil_ascii_strcasecmp(req->url->host, server->host) ||
+		if (req->url->host != server->host ||
 		    req->url->port != server->port)
 			break;
 		http_conn_send_error(client->conn, 502, "%s", msg);
@@ -441,6 +933,298 @@ client_notice_server_failed(struct client *client, const char *msg)
 	}
 }
 
+/* length of path's directory: up to its last '/', ignoring the query */
+static size_t
+path_dir_len(const char *path)
+{
+	size_t len = strcspn(path, "?");
+
+	while (len && path[len - 1] != '/')
+		len--;
+
+	return len;
+}
+
+/* url as an absolute http URL, with rel resolved against it. rel may
+   be NULL, or relative; dot segments are left to the client. */
+static char *
+url_absolute(const struct url *url, const char *rel)
+{
+	const char *path = url->path;
+	char port[16] = "";
+	size_t len, plen;
+	char *abs;
+
+	if (!rel)
+		rel = "";
+	if (rel[0] == '/' && rel[1] == '/') {
+		len = strlen(rel) + 6;
+		abs = mem_malloc(len);
+		evutil_snprintf(abs, len, "http:%s", rel);
+		return abs;
+	}
+	if (*rel == '/')
+		plen = 0;
+	else if (*rel == '?')
+		plen = strcspn(path, "?");
+	else if (*rel)
+		plen = path_dir_len(path);
+	else
+		plen = strlen(path);
+
+	if (url->port != 80)
+		evutil_snprintf(port, sizeof(port), ":%d", url->port);
+	len = strlen(url->host) + strlen(port) + plen + strlen(rel) + 8;
+	abs = mem_malloc(len);
+	evutil_snprintf(abs, len, "http://%s%s%.*s%s", url->host, port,
+			(int)plen, path, rel);
+
+	return abs;
+}
+
+/* where a redirect from url to loc goes, if shim can go there itself:
+   plain http, with no fragment the client would have to keep, and
+   nothing that needs resolving */
+static struct url *
+redirect_target(const struct url *url, const char *loc)
+{
+	struct url *to;
+	char *abs;
+
+	if (!*loc || strpbrk(loc, " \t\r\n#") || strstr(loc, "/."))
+		return NULL;
+
+	if (strstr(loc, "://"))
+		to = url_tokenize(loc);
+	else {
+		abs = url_absolute(url, loc);
+		to = url_tokenize(abs);
+		mem_free(abs);
+	}
+	if (!to)
+		return NULL;
+	if (!to->scheme || evutil_ascii_strcasecmp(to->scheme, "http")) {
+		url_free(to);
+		return NULL;
+	}
+	if (to->port < 0)
+		to->port = 80;
+
+	return to;
+}
+
+/* 1 if the client's request has already been to url; adds it if not */
+static int
+client_visited(struct client *client, const struct url *url)
+{
+	struct token *t;
+	size_t len;
+	char *key;
+
+	len = strlen(url->host) + strlen(url->path) + 8;
+	key = mem_malloc(len);
+	evutil_snprintf(key, len, "%s:%d%s", url->host, url->port, url->path);
+	TAILQ_FOREACH(t, &client->visited, next) {
+		if (!strcmp(t->token, key)) {
+			mem_free(key);
+			return 1;
+		}
+	}
+	t = mem_calloc(1, sizeof(*t));
+	t->token = key;
+	TAILQ_INSERT_TAIL(&client->visited, t, next);
+
+	return 0;
+}
+
+/* connect to where a redirect goes while the rest of it is read, unless
+   there's an idle connection there to use */
+static void
+client_preconnect(struct client *client, const struct url *to)
+{
+	struct server *it;
+
+	TAILQ_FOREACH(it, &client->proxy->idle_servers, next) {
+		if (server_match(it, to->host, to->port))
+			return;
+	}
+
+	client->next_server = server_new(to->host, to->port, client);
+	server_use_onion(client->next_server);
+	server_connect(client->next_server);
+}
+
+/* 1 if resp is a redirect to follow rather than pass on. the request is
+   sent to its new place once resp's body has been read and dropped. */
+static int
+client_follow_redirect(struct client *client, struct http_response *resp)
+{
+	struct shim_proxy *proxy = client->proxy;
+	struct http_request *req = TAILQ_FIRST(&client->requests);
+	const struct socks_server *socks;
+	struct url *to;
+	size_t dlen;
+	char *loc;
+	int same_host;
+
+	if (!proxy->max_redirects || client->state != CLIENT_STATE_ACTIVE ||
+	    req->meth != METH_GET || req->upgrade ||
+	    client->nredirects >= proxy->max_redirects)
+		return 0;
+	switch (resp->code) {
+	case 301:
+	case 302:
+	case 303:
+	case 307:
+	case 308:
+		break;
+	default:
+		return 0;
+	}
+	/* the client would never see the cookies */
+	if (headers_has_key(resp->headers, "Set-Cookie"))
+		return 0;
+
+	loc = headers_find(resp->headers, "Location");
+	to = loc ? redirect_target(req->url, loc) : NULL;
+	mem_free(loc);
+	if (!to)
+		return 0;
+
+	/* the browser resolves the page's relative links against the URL
+	   it asked for, so only a move within its directory is safe */
+	dlen = path_dir_len(req->url->path);
+	if (path_dir_len(to->path) != dlen ||
+	    strncmp(to->path, req->url->path, dlen))
+		goto pass;
+
+	/* another site mustn't get this one's credentials, nor one the
+	   client couldn't go to itself */
+	same_host = to->host == req->url->host && to->port == req->url->port;
+	if (!same_host &&
+	    (!proxy->follow_cross_host ||
+	     headers_has_key(req->headers, "Cookie") ||
+	     headers_has_key(req->headers, "Authorization") ||
+	     (proxy->blocklist &&
+	      blocklist_match(proxy->blocklist, to->host)) ||
+	     route_target(to->host, to->port, &socks, proxy) < 0))
+		goto pass;
+
+	/* a loop is the client's to deal with */
+	if (TAILQ_EMPTY(&client->visited))
+		client_visited(client, req->url);
+	if (client_visited(client, to)) {
+		log_info("proxy: redirect loop at %s", log_scrub(to->host));
+		goto pass;
+	}
+
+	log_debug("proxy: client %p following %d redirect to %s:%d%s",
+		  client, resp->code, log_scrub(to->host), to->port,
+		  log_scrub(to->path));
+	client->nredirects++;
+	proxy->stats.nredirects++;
+	client->redirect = to;
+	if (!same_host)
+		client_preconnect(client, to);
+
+	return 1;
+
+pass:
+	url_free(to);
+	return 0;
+}
+
+/* send the request on to where the redirect just read pointed */
+static void
+client_redirect(struct client *client)
+{
+	struct http_request *req = TAILQ_FIRST(&client->requests);
+	struct server *next = client->next_server;
+	size_t len;
+	char *host;
+
+	url_free(req->url);
+	req->url = client->redirect;
+	client->redirect = NULL;
+	client->next_server = NULL;
+
+	len = strlen(req->url->host) + 7;
+	host = mem_malloc(len);
+	if (req->url->port == 80)
+		evutil_snprintf(host, len, "%s", req->url->host);
+	else
+		evutil_snprintf(host, len, "%s:%d", req->url->host,
+				req->url->port);
+	headers_remove(req->headers, "Host");
+	headers_add_key_val(req->headers, "Host", host);
+	mem_free(host);
+
+	client->server->state = SERVER_STATE_IDLE;
+	if (next || !http_conn_is_persistent(client->server->conn))
+		client_disassociate_server(client);
+	if (next)
+		client->server = next;
+	if (client_associate_server(client) < 0)
+		return;
+	client_dispatch_request(client);
+}
+
+/* say where the final response of a redirected request came from. a
+   redirect passed on as it is is relative to there, not to where the
+   client asked. */
+static void
+client_add_content_location(struct client *client,
+			    struct http_response *resp)
+{
+	struct url *url = TAILQ_FIRST(&client->requests)->url;
+	char *val, *loc;
+
+	loc = headers_find(resp->headers, "Location");
+	if (loc && !strstr(loc, "://")) {
+		val = url_absolute(url, loc);
+		headers_remove(resp->headers, "Location");
+		headers_add_key_val(resp->headers, "Location", val);
+		mem_free(val);
+	}
+	mem_free(loc);
+
+	val = url_absolute(url, NULL);
+	headers_remove(resp->headers, "Content-Location");
+	headers_add_key_val(resp->headers, "Content-Location", val);
+	mem_free(val);
+}
+
+static void
+client_tunnel_closed(struct client *client)
+{
+	struct http_request *req = client->tunnel_req;
+	struct shim_stats *stats = &client->proxy->stats;
+	struct timeval duration;
+	ev_uint64_t up, down;
+
+	http_conn_get_tunnel_stats(client->conn, &up, &down, &duration);
+	stats->ntunnel_bytes_up += up;
+	stats->ntunnel_bytes_down += down;
+
+	log_debug("proxy: tunnel to %s:%d closed after %ld seconds, "
+		  "%llu bytes up, %llu down",
+		  req ? log_scrub(req->url->host) : "?",
+		  req ? req->url->port : 0,
+		  (long)duration.tv_sec, (unsigned long long)up,
+		  (unsigned long long)down);
+}
+
+/* a CONNECT request's connection failed */
+static void
+client_tunnel_failed(struct client *client)
+{
+	struct http_request *req = client->tunnel_req;
+
+	if (client->proxy->breaker && req)
+		breaker_failed(client->proxy->breaker, req->url->host,
+			       req->url->port);
+}
+
 /* http event slots */
 
 static void
@@ -459,10 +1243,12 @@ on_client_error(struct http_conn *conn, enum http_conn_error err, void *arg)
 		http_conn_send_error(conn, 417, "Expectation failed");
 		break;
 	case ERROR_TUNNEL_CONNECT_FAILED:
+		client_tunnel_failed(client);
 		// XXX need a better msg here
 		http_conn_send_error(conn, 504,
 				      "Connection failed");
-		client_request_serviced(client);
+		http_request_free(client->tunnel_req);
+		client->tunnel_req = NULL;
 		break;
 	case ERROR_HEADER_PARSE_FAILED:
 		client_close_on_flush(client);
@@ -479,8 +1265,14 @@ on_client_error(struct http_conn *conn, enum http_conn_error err, void *arg)
 		http_conn_send_error(conn, 400,
 				      "Chunk parse failed");
 		break;
+	case ERROR_TUNNEL_TIMEDOUT:
+		client->proxy->stats.ntunnel_timeouts++;
+		/* fallthru */
 	case ERROR_TUNNEL_CLOSED:
-		log_debug("proxy: tunnel closed.");
+		/* an optimistic tunnel whose connection failed */
+		if (http_conn_get_connect_error(conn))
+			client_tunnel_failed(client);
+		client_tunnel_closed(client);
 		client_free(client);
 		break;
 	case ERROR_INCOMPLETE_HEADERS:
@@ -504,8 +1296,16 @@ on_client_request(struct http_conn *conn, struct http_request *req, void *arg)
 	if (client_scrub_request(client, req) < 0)
 		return;
 
+	client->proxy->stats.nrequests++;
+	if (client_blocked(client, req))
+		return;
+	if (client_wants_h2(client, req)) {
+		client_upgrade_h2(client, req);
+		return;
+	}
+
 	TAILQ_INSERT_TAIL(&client->requests, req, next);
-	if (++client->nrequests > max_pending_requests ||
+	if (++client->nrequests > client_max_pending(client) ||
 	    http_conn_current_message_has_body(conn))
 		http_conn_stop_reading(conn);
 
@@ -516,6 +1316,8 @@ on_client_request(struct http_conn *conn, struct http_request *req, void *arg)
 
 	if (req->meth == METH_CONNECT)
 		client->state = CLIENT_STATE_TUNNEL;
+	else if (req->upgrade)
+		http_conn_stop_reading(conn);
 
 	if (!client->server && client_associate_server(client) < 0)
 		return;
@@ -553,7 +1355,9 @@ on_client_write_more(struct http_conn *conn, void *arg)
 {
 	struct client *client = arg;
 
-	http_conn_start_reading(client->server->conn);
+	/* the response may have finished while we were choked */
+	if (client->server)
+		http_conn_start_reading(client->server->conn);
 }
 
 static void
@@ -565,6 +1369,75 @@ on_client_flush(struct http_conn *conn, void *arg)
 		client_free(client);
 }
 
+static void
+on_client_h2_preface(struct http_conn *conn, void *arg)
+{
+	struct client *client = arg;
+
+	if (client->nrequests) {
+		client_close_on_flush(client);
+		http_conn_send_error(conn, 400, "Unexpected HTTP/2 preface");
+		return;
+	}
+
+	log_debug("proxy: client %p speaking h2c", client);
+	http_conn_release_bev(conn);
+}
+
+/* the client's connection is free to carry HTTP/2 now */
+static void
+on_client_released(struct http_conn *conn, struct bufferevent *bev,
+		   void *arg)
+{
+	struct client *client = arg;
+	struct shim_proxy *proxy = client->proxy;
+	struct http_request *req = client->h2_req;
+	char *settings = client->h2_settings;
+	struct h2_client *h2;
+
+	client->h2_req = NULL;
+	client->h2_settings = NULL;
+	h2 = h2_client_new(proxy, client->local);
+	client_free(client);
+
+	if (req)
+		h2->session = h2_session_upgrade(proxy->base, bev, req,
+						 settings, &h2_methods, h2);
+	else
+		h2->session = h2_session_new(proxy->base, bev, &h2_methods,
+					     h2);
+	mem_free(settings);
+}
+
+static void
+on_h2_stream(struct h2_session *session, struct bufferevent *bev, void *arg)
+{
+	struct h2_client *h2 = arg;
+	struct client *client;
+
+	h2->proxy->stats.nh2_streams++;
+	client = client_new(h2->proxy, -1, bev);
+	client->local = h2->local;
+}
+
+static void
+on_h2_close(struct h2_session *session, void *arg)
+{
+	h2_client_free(arg);
+}
+
+/* a CONNECT request's connection is up */
+static void
+on_client_tunnel_connected(struct http_conn *conn, void *arg)
+{
+	struct client *client = arg;
+	struct http_request *req = client->tunnel_req;
+
+	if (client->proxy->breaker && req)
+		breaker_connected(client->proxy->breaker, req->url->host,
+				  req->url->port);
+}
+
 static void
 on_server_connected(struct http_conn *conn, void *arg)
 {
@@ -574,24 +1447,99 @@ on_server_connected(struct http_conn *conn, void *arg)
 	server->state = SERVER_STATE_CONNECTED;
 	log_debug("proxy: server %p, %s:%d finished connecting",
 		  server, server->host, server->port);
+	if (!server->onion && server->proxy->breaker)
+		breaker_connected(server->proxy->breaker, server->host,
+				  server->port);
+	if (server->onion && server->proxy->onions) {
+		struct timeval now, elapsed;
+
+		event_base_gettimeofday_cached(server->proxy->base, &now);
+		evutil_timersub(&now, &server->connect_start, &elapsed);
+		onion_cache_connected(server->proxy->onions, server->host,
+				      server->port, &elapsed);
+	}
 	client_dispatch_request(server->client);
 }
 
+/* the host's circuit is open, so its connection fails straight away */
+static void
+server_fail_fast(evutil_socket_t fd, short what, void *arg)
+{
+	struct server *server = arg;
+	struct client *client = server->client;
+
+	log_info("proxy: not connecting to %s:%d; it keeps failing",
+		 log_scrub(server->host), server->port);
+	if (server == client->next_server)
+		client->next_server = NULL;
+	else
+		client_notice_server_failed(client,
+				"Host keeps failing; not trying it for now");
+	server_free(server);
+}
+
+/* the onion service didn't answer; go to the site itself instead */
+static void
+server_onion_failed(struct server *server, enum http_conn_error err)
+{
+	struct client *client = server->client;
+
+	log_info("proxy: onion service for %s:%d failed: %s",
+		 log_scrub(server->host), server->port,
+		 err == ERROR_CONNECT_FAILED ?
+		 http_conn_get_connect_error(server->conn) :
+		 http_conn_error_to_string(err));
+	if (server->proxy->onions)
+		onion_cache_failed(server->proxy->onions, server->host,
+				   server->port);
+
+	client->server = server_new(server->host, server->port, client);
+	server_free(server);
+	if (server_connect(client->server) < 0) {
+		server = client->server;
+		server->proxy->stats.nserver_failures++;
+		log_error("proxy: connection to %s:%d failed",
+			  log_scrub(server->host), server->port);
+		client_notice_server_failed(client, "connection failed");
+		server_free(server);
+	}
+}
+
 static void
 on_server_error(struct http_conn *conn, enum http_conn_error err, void *arg)
 {
 	struct server *server = arg;
 	const char *msg;
 
+	if (err == ERROR_CONNECT_FAILED && !server->onion &&
+	    server->proxy->breaker)
+		breaker_failed(server->proxy->breaker, server->host,
+			       server->port);
+
+	/* connecting ahead for a redirect; it'll be tried again */
+	if (server->client && server == server->client->next_server) {
+		log_debug("proxy: connection ahead to %s:%d failed",
+			  log_scrub(server->host), server->port);
+		server->client->next_server = NULL;
+		server_free(server);
+		return;
+	}
+
+	if (server->state == SERVER_STATE_CONNECTING && server->onion) {
+		server_onion_failed(server, err);
+		return;
+	}
+
 	switch (server->state) {
 	case SERVER_STATE_CONNECTING:
 	case SERVER_STATE_CONNECTED:
 	case SERVER_STATE_REQUEST_SENT:
 		// XXX if we haven't serviced any reqs on this server yet,
 		//     we should try resending the first request
+		server->proxy->stats.nserver_failures++;
 		if (err == ERROR_CONNECT_FAILED) {
 			assert(server->state == SERVER_STATE_CONNECTING);
-			msg = conn_get_connect_error();
+			msg = http_conn_get_connect_error(conn);
 			log_error("proxy: connection to %s:%d failed: %s",
 				  log_scrub(server->host), server->port, msg);
 		} else {
@@ -605,7 +1553,7 @@ on_server_error(struct http_conn *conn, enum http_conn_error err, void *arg)
 		break;
 	case SERVER_STATE_IDLE:
 		assert(server->client == NULL);
-		TAILQ_REMOVE(&idle_servers, server, next);
+		TAILQ_REMOVE(&server->proxy->idle_servers, server, next);
 		log_debug("proxy: idle server connection %p, %s:%d closed",
 			  server, server->host, server->port);
 		break;
@@ -625,30 +1573,108 @@ on_server_continuation(struct http_conn *conn, void *arg)
 	client_start_reading_request_body(server->client, 1);
 }
 
+/* the server agreed to an Upgrade; from here on both sides are relayed
+   like a CONNECT tunnel. */
+static void
+client_switch_protocols(struct client *client, struct http_response *resp)
+{
+	struct server *server = client->server;
+
+	log_debug("proxy: client %p switching protocols with %s:%d",
+		  client, log_scrub(server->host), server->port);
+
+	client->proxy->stats.nupgrades++;
+	client->state = CLIENT_STATE_TUNNEL;
+	client_tunnel_begin(client);
+	http_conn_set_output_encoding(client->conn, TE_IDENTITY);
+	http_conn_write_response(client->conn, resp);
+	http_conn_release_bev(server->conn);
+}
+
+static void
+on_server_released(struct http_conn *conn, struct bufferevent *bev,
+		   void *arg)
+{
+	struct server *server = arg;
+	struct client *client = server->client;
+
+	client->server = NULL;
+	server_free(server);
+	http_conn_start_tunnel_bev(client->conn, bev);
+}
+
 static void
 on_server_response(struct http_conn *conn, struct http_response *resp,
 		   void *arg)
 {
 	struct server *server = arg;
+	struct http_request *req;
+	char *onion;
+
+	if (server->proxy->onions && !server->onion) {
+		onion = headers_find(resp->headers, "Onion-Location");
+		/* don't keep this connection; the next one can go to the
+		   onion service */
+		if (onion && onion_cache_learn(server->proxy->onions,
+					       server->host, server->port,
+					       onion))
+			http_conn_disable_persistence(conn);
+		mem_free(onion);
+	}
+	header_policy_apply(server->proxy->header_policy, HEADER_RESPONSE,
+			    resp->headers);
+
+	if (resp->code == 101) {
+		req = TAILQ_FIRST(&server->client->requests);
+		if (req->upgrade) {
+			client_switch_protocols(server->client, resp);
+		} else {
+			log_warn("proxy: %s:%d switched protocols unasked",
+				 log_scrub(server->host), server->port);
+			client_notice_server_failed(server->client,
+						    "Unexpected protocol switch");
+			server_free(server);
+		}
+		http_response_free(resp);
+		return;
+	}
 
 	// XXX we should probably disable persistence on the server's
 	// connection if it sends an error response while we're sending
  	// client POST/PUT
-	client_write_response(server->client, resp);
+	if (client_follow_redirect(server->client, resp)) {
+		http_response_free(resp);
+		return;
+	}
+	if (server->client->nredirects)
+		client_add_content_location(server->client, resp);
 
 	if (http_conn_current_message_has_body(conn))
 		log_debug("proxy: will copy body from server %p to client %p",
 			  server, server->client);
 
-	http_response_free(resp);
+	if (!client_write_response(server->client, resp))
+		http_response_free(resp);
 }
 
 static void
 on_server_read_body(struct http_conn *conn, struct evbuffer *buf, void *arg)
 {
 	struct server *server = arg;
+	struct client *client = server->client;
 
-	if (!http_conn_write_buf(server->client->conn, buf))
+	if (client->redirect) {
+		evbuffer_drain(buf, -1);
+		return;
+	}
+	if (client->held_body) {
+		evbuffer_add_buffer(client->held_body, buf);
+		if (evbuffer_get_length(client->held_body) <=
+		    client->proxy->max_buffered_body)
+			return;
+		if (!client_release_response(client, 0))
+			http_conn_stop_reading(conn);
+	} else if (!http_conn_write_buf(client->conn, buf))
 		http_conn_stop_reading(conn);
 }
 
@@ -657,6 +1683,12 @@ on_server_msg_complete(struct http_conn *conn, void *arg)
 {
 	struct server *server = arg;
 
+	if (server->client->redirect) {
+		client_redirect(server->client);
+		return;
+	}
+	if (server->client->held_resp)
+		client_release_response(server->client, 1);
 	if (http_conn_current_message_has_body(conn))
 		http_conn_write_finished(server->client->conn);
 	client_request_serviced(server->client);
@@ -667,7 +1699,8 @@ on_server_write_more(struct http_conn *conn, void *arg)
 {
 	struct server *server = arg;
 
-	http_conn_start_reading(server->client->conn);
+	if (server->client)
+		http_conn_start_reading(server->client->conn);
 }
 
 static void
@@ -679,39 +1712,321 @@ static void
 client_accept(struct evconnlistener *ecs, evutil_socket_t s,
 	      struct sockaddr *addr, int len, void *arg) 
 {
-	struct client *client;
+	struct shim_proxy *proxy = arg;
 
 	log_info("proxy: new client connection from %s",
 		 format_addr(addr));
 
-	client = client_new(s);
-
-	// XXX do we want to keep track of the client obj somehow?
+	client_new(proxy, s, NULL);
 }
 
 /* public API */
 
+int
+shim_event_base_init_priorities(struct event_base *base)
+{
+	return event_base_priority_init(base, HTTP_NUM_PRIORITIES);
+}
+
+struct shim_proxy *
+shim_proxy_new(struct event_base *base, struct evdns_base *dns)
+{
+	struct shim_proxy *proxy;
+
+	proxy = mem_calloc(1, sizeof(*proxy));
+	proxy->base = base;
+	proxy->dns = dns;
+	proxy->max_pending_requests = 8;
+	proxy->max_buffered_body = 32768;
+	proxy->tunnel_idle_timeout.tv_sec = 300;
+	TAILQ_INIT(&proxy->listeners);
+	TAILQ_INIT(&proxy->clients);
+	TAILQ_INIT(&proxy->h2_clients);
+	TAILQ_INIT(&proxy->idle_servers);
+	proxy->spares = tunnel_pool_new(base);
+	proxy->header_policy = header_policy_new();
+
+	return proxy;
+}
+
+void
+shim_proxy_free(struct shim_proxy *proxy)
+{
+	struct listener *l;
+	struct client *client;
+	struct h2_client *h2;
+	struct server *server;
+
+	if (!proxy)
+		return;
+
+	while ((l = TAILQ_FIRST(&proxy->listeners))) {
+		TAILQ_REMOVE(&proxy->listeners, l, next);
+		evconnlistener_free(l->lev);
+		mem_free(l);
+	}
+	while ((h2 = TAILQ_FIRST(&proxy->h2_clients))) {
+		h2_session_free(h2->session);
+		h2_client_free(h2);
+	}
+	while ((client = TAILQ_FIRST(&proxy->clients)))
+		client_free(client);
+	while ((server = TAILQ_FIRST(&proxy->idle_servers))) {
+		TAILQ_REMOVE(&proxy->idle_servers, server, next);
+		server_free(server);
+	}
+	tunnel_pool_free(proxy->spares);
+	blocklist_free(proxy->blocklist);
+	route_table_free(proxy->routes);
+	onion_cache_free(proxy->onions);
+	header_policy_free(proxy->header_policy);
+	/* jobs still in the pool are finished with the compressor */
+	work_pool_free(proxy->workers);
+	compressor_free(proxy->compressor);
+	relay_pool_free(proxy->relays);
+	breaker_free(proxy->breaker);
+
+	socks_server_free(proxy->socks);
+	mem_free(proxy);
+}
+
+int
+shim_proxy_set_socks_server(struct shim_proxy *proxy, const char *socks)
+{
+	struct socks_server *server;
+
+	server = socks_server_parse(socks);
+	if (!server)
+		return -1;
+
+	socks_server_free(proxy->socks);
+	proxy->socks = server;
+
+	return 0;
+}
+
+void
+shim_proxy_set_max_pending_requests(struct shim_proxy *proxy, size_t nreqs)
+{
+	proxy->max_pending_requests = nreqs;
+}
+
+size_t
+shim_proxy_get_max_pending_requests(struct shim_proxy *proxy)
+{
+	return proxy->max_pending_requests;
+}
+
 void
-proxy_client_set_max_pending_requests(size_t nreqs)
+shim_proxy_set_max_buffered_body(struct shim_proxy *proxy, size_t len)
 {
-	max_pending_requests = nreqs;
+	proxy->max_buffered_body = len;
 }
 
 size_t
-proxy_client_get_max_pending_requests(void)
+shim_proxy_get_max_buffered_body(struct shim_proxy *proxy)
+{
+	return proxy->max_buffered_body;
+}
+
+void
+shim_proxy_set_optimistic_connect(struct shim_proxy *proxy, int enable)
 {
-	return max_pending_requests;
+	proxy->optimistic_connect = enable;
+}
+
+void
+shim_proxy_set_max_spare_tunnels(struct shim_proxy *proxy, size_t n)
+{
+	tunnel_pool_set_max_spares(proxy->spares, n);
 }
 
 int
-proxy_init(struct event_base *base, struct evdns_base *dns,
-	   const struct sockaddr *listen_here, int socklen)
+shim_proxy_set_blocklist(struct shim_proxy *proxy, const char *path)
 {
-	struct evconnlistener *lcs = NULL;
+	struct blocklist *bl = NULL;
+
+	if (path) {
+		bl = blocklist_load(path);
+		if (!bl)
+			return -1;
+		log_notice("proxy: blocking %lu hosts from %s",
+			   (unsigned long)blocklist_size(bl), path);
+	}
+	blocklist_free(proxy->blocklist);
+	proxy->blocklist = bl;
+
+	return 0;
+}
+
+int
+shim_proxy_set_routes(struct shim_proxy *proxy, const char *path)
+{
+	struct route_table *routes = NULL;
+
+	if (path) {
+		routes = route_table_load(path);
+		if (!routes)
+			return -1;
+		log_notice("proxy: %lu routing rules from %s",
+			   (unsigned long)route_table_size(routes), path);
+	}
+	route_table_free(proxy->routes);
+	proxy->routes = routes;
+
+	return 0;
+}
 
-	TAILQ_INIT(&idle_servers);
+int
+shim_proxy_set_header_policy(struct shim_proxy *proxy, const char *path)
+{
+	struct header_policy *policy;
+
+	if (path) {
+		policy = header_policy_load(path);
+		if (!policy)
+			return -1;
+		log_notice("proxy: %lu header rules from %s",
+			   (unsigned long)header_policy_size(policy), path);
+	} else
+		policy = header_policy_new();
+	header_policy_free(proxy->header_policy);
+	proxy->header_policy = policy;
+
+	return 0;
+}
+
+void
+shim_proxy_set_onion_location(struct shim_proxy *proxy, int enable)
+{
+	if (enable && !proxy->onions)
+		proxy->onions = onion_cache_new(proxy->base);
+	else if (!enable) {
+		onion_cache_free(proxy->onions);
+		proxy->onions = NULL;
+	}
+}
+
+int
+shim_proxy_set_compression(struct shim_proxy *proxy, int level)
+{
+	struct compressor *c = NULL;
+
+	if (level) {
+		c = compressor_new(level);
+		if (!c)
+			return -1;
+	}
+	compressor_free(proxy->compressor);
+	proxy->compressor = c;
+
+	return 0;
+}
+
+int
+shim_proxy_set_worker_threads(struct shim_proxy *proxy, int n)
+{
+	if (proxy->workers)
+		return -1;
+	proxy->workers = work_pool_new(proxy->base, n);
+	if (!proxy->workers)
+		return -1;
+	log_notice("proxy: %d worker threads", n);
+
+	return 0;
+}
+
+void
+shim_proxy_set_follow_redirects(struct shim_proxy *proxy, int max,
+				int cross_host)
+{
+	proxy->max_redirects = max;
+	proxy->follow_cross_host = cross_host;
+}
+
+int
+shim_proxy_set_relay_threads(struct shim_proxy *proxy, int n)
+{
+	if (proxy->relays)
+		return -1;
+	proxy->relays = relay_pool_new(proxy->base, n, proxy->relay_uring);
+	if (!proxy->relays)
+		return -1;
+	log_notice("proxy: %d tunnel relay threads%s", n,
+		   proxy->relay_uring ? " on io_uring" : "");
+
+	return 0;
+}
 
-	lcs = evconnlistener_new_bind(base, client_accept, NULL,
+void
+shim_proxy_set_relay_io_uring(struct shim_proxy *proxy, int on)
+{
+	proxy->relay_uring = on;
+}
+
+void
+shim_proxy_set_circuit_breaker(struct shim_proxy *proxy, unsigned failures)
+{
+	breaker_free(proxy->breaker);
+	proxy->breaker = NULL;
+	if (failures)
+		proxy->breaker = breaker_new(proxy->base, failures);
+}
+
+void
+shim_proxy_set_queue_delay(struct shim_proxy *proxy,
+			   const struct timeval *target,
+			   const struct timeval *interval)
+{
+	evutil_timerclear(&proxy->queue_delay.target);
+	if (!target || !evutil_timerisset(target))
+		return;
+
+	proxy->queue_delay.target = *target;
+	if (interval && evutil_timerisset(interval))
+		proxy->queue_delay.interval = *interval;
+	else {
+		/* CoDel's own proportions */
+		proxy->queue_delay.interval.tv_sec = target->tv_sec * 20 +
+						     target->tv_usec / 50000;
+		proxy->queue_delay.interval.tv_usec =
+					target->tv_usec % 50000 * 20;
+	}
+}
+
+void
+shim_proxy_set_tunnel_timeouts(struct shim_proxy *proxy,
+			       const struct timeval *idle,
+			       const struct timeval *lifetime)
+{
+	evutil_timerclear(&proxy->tunnel_idle_timeout);
+	evutil_timerclear(&proxy->tunnel_max_lifetime);
+	if (idle)
+		proxy->tunnel_idle_timeout = *idle;
+	if (lifetime)
+		proxy->tunnel_max_lifetime = *lifetime;
+}
+
+int
+shim_proxy_add_listener(struct shim_proxy *proxy, struct evconnlistener *lev)
+{
+	struct listener *l;
+
+	l = mem_calloc(1, sizeof(*l));
+	l->lev = lev;
+	evconnlistener_set_cb(lev, client_accept, proxy);
+	TAILQ_INSERT_TAIL(&proxy->listeners, l, next);
+
+	return 0;
+}
+
+int
+shim_proxy_listen(struct shim_proxy *proxy, const struct sockaddr *listen_here,
+		  int socklen)
+{
+	struct evconnlistener *lcs = NULL;
+
+	lcs = evconnlistener_new_bind(proxy->base, client_accept, proxy,
 				      LEV_OPT_CLOSE_ON_FREE |
 				      LEV_OPT_REUSEABLE,
 				      -1, listen_here, socklen);
@@ -723,17 +2038,98 @@ proxy_init(struct event_base *base, struct evdns_base *dns,
 	}
 
 	log_notice("proxy: listening on %s", format_addr(listen_here));
-	
-	listener = lcs;
-	proxy_event_base = base;
-	proxy_evdns_base = dns;	
+
+	return shim_proxy_add_listener(proxy, lcs);
+}
+
+int
+shim_proxy_add_client(struct shim_proxy *proxy, evutil_socket_t sock)
+{
+	if (evutil_make_socket_nonblocking(sock) < 0)
+		return -1;
+	client_new(proxy, sock, NULL);
 
 	return 0;
+}
 
+void
+shim_proxy_get_stats(struct shim_proxy *proxy, struct shim_stats *stats)
+{
+	struct server *server;
+	struct tunnel_pool_stats spares;
+	struct onion_cache_stats onions;
+	struct compressor_stats compressed;
+	struct work_pool_stats work;
+	struct relay_pool_stats relays;
+	struct breaker_stats breaker;
+	struct alloc_stats allocs;
+
+	*stats = proxy->stats;
+	stats->nhost_atoms = host_atom_count();
+	alloc_get_stats(&allocs);
+	stats->nevent_allocs = allocs.nallocs;
+	stats->nevent_allocs_cached = allocs.ncached;
+	stats->nevent_cached_bytes = allocs.ncached_bytes;
+	stats->nidle_servers = 0;
+	TAILQ_FOREACH(server, &proxy->idle_servers, next)
+		stats->nidle_servers++;
+
+	tunnel_pool_get_stats(proxy->spares, &spares);
+	stats->nspare_tunnels = spares.nspares;
+	stats->nspares_opened = spares.nopened;
+	stats->nspares_used = spares.nused;
+	stats->nspares_wasted = spares.nwasted;
+	stats->nspares_failed = spares.nfailed;
+
+	if (proxy->onions) {
+		onion_cache_get_stats(proxy->onions, &onions);
+		stats->nonion_mappings = onions.nmappings;
+		stats->nonion_connects = onions.nconnects;
+		stats->nonion_failures = onions.nfailures;
+		stats->nonion_dropped = onions.ndropped;
+	}
+
+	if (proxy->compressor) {
+		compressor_get_stats(proxy->compressor, &compressed);
+		stats->ncompressed = compressed.nresponses;
+		stats->ncompress_bytes_in = compressed.nbytes_in;
+		stats->ncompress_bytes_out = compressed.nbytes_out;
+		stats->ncompress_usec = compressed.nusec;
+		stats->compress_level = compressed.level;
+	}
+
+	if (proxy->workers) {
+		work_pool_get_stats(proxy->workers, &work);
+		stats->nworker_jobs = work.njobs;
+		stats->nworker_backlog = work.nbacklog;
+	}
+
+	if (proxy->relays) {
+		relay_pool_get_stats(proxy->relays, &relays);
+		stats->nrelayed_tunnels = relays.nrelays;
+	}
+
+	if (proxy->breaker) {
+		breaker_get_stats(proxy->breaker, &breaker);
+		stats->nfailing_hosts = breaker.nopen;
+		stats->nfast_failures = breaker.nrefused;
+	}
+}
+
+int
+shim_use_event_allocator(size_t cache_size)
+{
+	return alloc_install(cache_size);
+}
+
+void
+shim_set_log_file(FILE *fp)
+{
+	log_set_file(fp);
 }
 
 void
-proxy_cleanup(void)
+shim_set_log_level(int level)
 {
-	// TODO
+	log_set_min_level(level);
 }
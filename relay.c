@@ -0,0 +1,1130 @@
+#include "netheaders.h"
+
+#include <sys/queue.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+#include "config.h"
+#include "relay.h"
+#include "util.h"
+#include "log.h"
+
+#ifdef HAVE_WORKER_THREADS
+#include <pthread.h>
+#include <errno.h>
+
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+
+#define RELAY_CLIENT 0
+#define RELAY_SERVER 1
+
+/* the same as for tunnels on the main loop */
+static size_t max_relay_backlog = 256 * 1024;
+static size_t relay_io_size = 64 * 1024;
+static struct timeval relay_flush_timeout = {30, 0};
+
+enum relay_dir {
+	RELAY_DIR_OPEN,
+	RELAY_DIR_DRAINING,		/* peer hung up, still writing */
+	RELAY_DIR_SHUT
+};
+
+#ifdef HAVE_IO_URING
+/* what one pass queues; a fuller queue is submitted early */
+#define URING_ENTRIES 1024
+/* a ring's tunnels have two ops out each, and the wake and tick one,
+   which the completion queue must hold all of. past that, tunnels stay
+   on the main loop. */
+#define URING_TUNNELS 8191
+#define URING_INFLIGHT (2 * URING_TUNNELS + 2)
+/* completions that aren't a tunnel's */
+#define URING_WAKE 1
+#define URING_TICK 2
+
+/* how often tunnels on io_uring have their time limits looked at */
+static struct timeval uring_tick = {1, 0};
+
+/* one way through a tunnel on io_uring: read from fd[from] into buf,
+   write all of it to the other side, and again. only one op is in
+   flight each way. */
+struct relay_way {
+	struct relay *r;
+	int from;
+	char *buf;
+	size_t len;			/* in buf; 0 while reading */
+	size_t off;			/* ... of which written */
+	int busy;			/* an op is in flight */
+	struct timeval since;		/* when the write last moved */
+};
+#endif
+
+struct relay {
+	struct relay_thread *t;
+	TAILQ_ENTRY(relay) inbox;	/* waiting for the thread */
+	TAILQ_ENTRY(relay) next;	/* open on the thread, then done */
+	evutil_socket_t fd[2];
+	struct evbuffer *pending[2];	/* for fd[i] until it starts */
+	struct timeval idle;
+	struct timeval lifetime;
+	relay_done_fn done;
+	void *arg;			/* loop side */
+	/* under the thread's lock */
+	int queued;
+	int cancelled;
+	int finished;
+	/* thread side */
+	int started;
+	int flushing;
+	struct bufferevent *bev[2];
+	struct event *expire_ev;
+	enum relay_dir into[2];		/* the way that writes to bev[i] */
+	int paused[2];			/* not reading from bev[i] */
+	struct timeval active;
+	ev_uint64_t nread[2];
+	enum relay_end end;
+#ifdef HAVE_IO_URING
+	struct relay_way way[2];
+	struct timeval begun;
+	int closing;			/* waiting for the ops in flight */
+#endif
+};
+TAILQ_HEAD(relay_list, relay);
+
+struct relay_thread {
+	struct relay_pool *pool;
+	pthread_t thread;
+	struct event_base *base;
+	/* the loop pokes the thread through this */
+	evutil_socket_t wake[2];
+	struct event *wake_ev;
+	struct relay_list open;		/* thread side */
+	pthread_mutex_t lock;
+	struct relay_list inbox;
+	int poked;
+	int stop;
+	size_t nrelays;			/* loop side */
+#ifdef HAVE_IO_URING
+	struct uring *ring;		/* instead of base */
+	char wake_buf[64];
+	struct __kernel_timespec tick;
+	int stopping;			/* thread side */
+#endif
+};
+
+struct relay_pool {
+	struct event_base *base;
+	struct relay_thread *threads;
+	int nthreads;
+	/* threads poke the loop through this when tunnels close */
+	evutil_socket_t notify[2];
+	struct event *notify_ev;
+	pthread_mutex_t lock;
+	struct relay_list done;
+	int notified;
+	int uring;
+	struct relay_pool_stats stats;
+};
+
+static void
+poke(evutil_socket_t fd)
+{
+	send(fd, "", 1, 0);
+}
+
+static void
+drain(evutil_socket_t fd)
+{
+	char buf[64];
+
+	while (recv(fd, buf, sizeof(buf), 0) > 0)
+		;
+}
+
+static int
+socket_pair(evutil_socket_t pair[2])
+{
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+		log_error("relay: can't make a socket pair: %s",
+			  evutil_socket_error_to_string(
+				  EVUTIL_SOCKET_ERROR()));
+		pair[0] = pair[1] = -1;
+		return -1;
+	}
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+
+	return 0;
+}
+
+static void
+socket_pair_close(evutil_socket_t pair[2])
+{
+	if (pair[0] >= 0) {
+		evutil_closesocket(pair[0]);
+		evutil_closesocket(pair[1]);
+	}
+}
+
+/* call with the thread's lock held */
+static void
+thread_queue(struct relay_thread *t, struct relay *r)
+{
+	if (!r->queued) {
+		TAILQ_INSERT_TAIL(&t->inbox, r, inbox);
+		r->queued = 1;
+	}
+	if (!t->poked) {
+		t->poked = 1;
+		poke(t->wake[1]);
+	}
+}
+
+/* runs on the thread: close both sockets and tell the loop */
+static void
+relay_finish(struct relay *r, enum relay_end end)
+{
+	struct relay_thread *t = r->t;
+	struct relay_pool *pool = t->pool;
+	int i;
+
+	for (i = 0; i < 2; ++i) {
+		if (r->bev[i])
+			bufferevent_free(r->bev[i]);
+		else
+			evutil_closesocket(r->fd[i]);
+	}
+	if (r->expire_ev)
+		event_free(r->expire_ev);
+#ifdef HAVE_IO_URING
+	mem_free(r->way[0].buf);
+	mem_free(r->way[1].buf);
+#endif
+	if (r->started)
+		TAILQ_REMOVE(&t->open, r, next);
+	r->end = end;
+
+	pthread_mutex_lock(&t->lock);
+	r->finished = 1;
+	if (r->queued) {
+		TAILQ_REMOVE(&t->inbox, r, inbox);
+		r->queued = 0;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	pthread_mutex_lock(&pool->lock);
+	TAILQ_INSERT_TAIL(&pool->done, r, next);
+	if (!pool->notified) {
+		pool->notified = 1;
+		poke(pool->notify[1]);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static int
+relay_side(struct relay *r, struct bufferevent *bev)
+{
+	return bev == r->bev[RELAY_CLIENT] ? RELAY_CLIENT : RELAY_SERVER;
+}
+
+static const struct timeval *
+relay_timeout(struct relay *r, const struct timeval *tv)
+{
+	const struct timeval *common;
+
+	common = event_base_init_common_timeout(r->t->base, tv);
+
+	return common ? common : tv;
+}
+
+/* stop reading from while what it sent piles up on the other side */
+static void
+relay_throttle(struct relay *r, int from)
+{
+	struct bufferevent *to = r->bev[!from];
+
+	if (evbuffer_get_length(bufferevent_get_output(to)) >
+	    max_relay_backlog) {
+		bufferevent_setwatermark(to, EV_WRITE,
+					 max_relay_backlog / 2, 0);
+		bufferevent_disable(r->bev[from], EV_READ);
+		r->paused[from] = 1;
+	}
+}
+
+static void
+relay_transfer(struct relay *r, int from)
+{
+	struct evbuffer *in = bufferevent_get_input(r->bev[from]);
+	size_t len = evbuffer_get_length(in);
+
+	if (len == 0)
+		return;
+
+	r->nread[from] += len;
+	event_base_gettimeofday_cached(r->t->base, &r->active);
+	evbuffer_add_buffer(bufferevent_get_output(r->bev[!from]), in);
+	relay_throttle(r, from);
+}
+
+static void
+relay_set_flush_deadline(struct relay *r, int i)
+{
+	const struct timeval *idle = NULL;
+
+	if (evutil_timerisset(&r->idle))
+		idle = relay_timeout(r, &r->idle);
+	bufferevent_set_timeouts(r->bev[i], idle,
+				 relay_timeout(r, &relay_flush_timeout));
+}
+
+/* bev[i]'s output is empty; pass its peer's hang up on */
+static void
+relay_shutdown(struct relay *r, int i)
+{
+	r->into[i] = RELAY_DIR_SHUT;
+	shutdown(r->fd[i], SHUT_WR);
+
+	if (r->into[RELAY_CLIENT] == RELAY_DIR_SHUT &&
+	    r->into[RELAY_SERVER] == RELAY_DIR_SHUT)
+		relay_finish(r, RELAY_CLOSED);
+}
+
+/* from won't send any more. the other way stays open. */
+static void
+relay_eof(struct relay *r, int from)
+{
+	int to = !from;
+
+	if (r->into[to] != RELAY_DIR_OPEN)
+		return;
+
+	r->into[to] = RELAY_DIR_DRAINING;
+	bufferevent_disable(r->bev[from], EV_READ);
+	relay_transfer(r, from);
+	r->paused[from] = 0;
+	bufferevent_setwatermark(r->bev[to], EV_WRITE, 0, 0);
+
+	if (evbuffer_get_length(bufferevent_get_output(r->bev[to])) == 0)
+		relay_shutdown(r, to);
+	else
+		relay_set_flush_deadline(r, to);
+}
+
+static void
+relay_readcb(struct bufferevent *bev, void *arg)
+{
+	struct relay *r = arg;
+
+	relay_transfer(r, relay_side(r, bev));
+}
+
+static void
+relay_writecb(struct bufferevent *bev, void *arg)
+{
+	struct relay *r = arg;
+	int i = relay_side(r, bev);
+
+	if (r->flushing) {
+		relay_finish(r, RELAY_CLOSED);
+		return;
+	}
+
+	if (r->paused[!i]) {
+		r->paused[!i] = 0;
+		bufferevent_enable(r->bev[!i], EV_READ);
+		bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+	}
+	if (r->into[i] == RELAY_DIR_DRAINING &&
+	    !evbuffer_get_length(bufferevent_get_output(bev)))
+		relay_shutdown(r, i);
+}
+
+/* a tunnel is only idle when neither side has sent anything; see
+   tunnel_timedout() in httpconn.c */
+static void
+relay_timedout(struct relay *r, struct bufferevent *bev, short what)
+{
+	struct timeval now, idle;
+
+	if (!r->flushing && (what & BEV_EVENT_READING)) {
+		event_base_gettimeofday_cached(r->t->base, &now);
+		evutil_timersub(&now, &r->active, &idle);
+		if (evutil_timercmp(&idle, &r->idle, <)) {
+			bufferevent_enable(bev, EV_READ);
+			return;
+		}
+	}
+
+	if (what & BEV_EVENT_WRITING)
+		log_info("relay: closing a tunnel, couldn't write");
+	else
+		log_info("relay: closing a tunnel, idle for %ld seconds",
+			 (long)r->idle.tv_sec);
+	relay_finish(r, RELAY_TIMEDOUT);
+}
+
+static void
+relay_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct relay *r = arg;
+	int i = relay_side(r, bev);
+	struct bufferevent *other = r->bev[!i];
+
+	if (what & BEV_EVENT_TIMEOUT) {
+		relay_timedout(r, bev, what);
+		return;
+	}
+	if (r->flushing) {
+		relay_finish(r, RELAY_CLOSED);
+		return;
+	}
+	if (what == (BEV_EVENT_EOF | BEV_EVENT_READING)) {
+		relay_eof(r, i);
+		return;
+	}
+
+	/* this side is gone; see what it sent out and quit */
+	if (evbuffer_get_length(bufferevent_get_output(other)) &&
+	    r->into[!i] != RELAY_DIR_SHUT) {
+		r->flushing = 1;
+		bufferevent_disable(bev, EV_READ | EV_WRITE);
+		bufferevent_disable(other, EV_READ);
+		bufferevent_setwatermark(other, EV_WRITE, 0, 0);
+		relay_set_flush_deadline(r, !i);
+		return;
+	}
+	relay_finish(r, RELAY_CLOSED);
+}
+
+static void
+relay_expirecb(evutil_socket_t fd, short what, void *arg)
+{
+	struct relay *r = arg;
+
+	log_info("relay: closing a tunnel, open for %ld seconds",
+		 (long)r->lifetime.tv_sec);
+	relay_finish(r, RELAY_TIMEDOUT);
+}
+
+static void
+relay_begin(struct relay *r)
+{
+	struct relay_thread *t = r->t;
+	const struct timeval *tv;
+	int i;
+
+	r->started = 1;
+	TAILQ_INSERT_TAIL(&t->open, r, next);
+	for (i = 0; i < 2; ++i) {
+		r->bev[i] = bufferevent_socket_new(t->base, r->fd[i],
+						   BEV_OPT_CLOSE_ON_FREE);
+		if (!r->bev[i]) {
+			log_error("relay: failed to create bufferevent");
+			relay_finish(r, RELAY_CLOSED);
+			return;
+		}
+		bufferevent_setcb(r->bev[i], relay_readcb, relay_writecb,
+				  relay_eventcb, r);
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+		bufferevent_set_max_single_read(r->bev[i], relay_io_size);
+		bufferevent_set_max_single_write(r->bev[i], relay_io_size);
+#endif
+	}
+
+	event_base_gettimeofday_cached(t->base, &r->active);
+	if (evutil_timerisset(&r->idle)) {
+		tv = relay_timeout(r, &r->idle);
+		bufferevent_set_timeouts(r->bev[RELAY_CLIENT], tv, tv);
+		bufferevent_set_timeouts(r->bev[RELAY_SERVER], tv, tv);
+	}
+	if (evutil_timerisset(&r->lifetime)) {
+		r->expire_ev = evtimer_new(t->base, relay_expirecb, r);
+		if (!r->expire_ev)
+			log_fatal("relay: failed to create event");
+		evtimer_add(r->expire_ev, relay_timeout(r, &r->lifetime));
+	}
+
+	/* what the loop hadn't written yet goes first */
+	for (i = 0; i < 2; ++i) {
+		evbuffer_add_buffer(bufferevent_get_output(r->bev[i]),
+				    r->pending[i]);
+		relay_throttle(r, !i);
+	}
+	for (i = 0; i < 2; ++i) {
+		if (!r->paused[i])
+			bufferevent_enable(r->bev[i], EV_READ);
+	}
+}
+
+#ifdef HAVE_IO_URING
+
+static void
+way_read(struct relay_way *w)
+{
+	struct relay *r = w->r;
+	struct io_uring_sqe *sqe = uring_get_sqe(r->t->ring);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = r->fd[w->from];
+	sqe->addr = (unsigned long)w->buf;
+	sqe->len = relay_io_size;
+	sqe->user_data = (unsigned long)w;
+	w->len = 0;
+	w->busy = 1;
+}
+
+static void
+way_write(struct relay_way *w)
+{
+	struct relay *r = w->r;
+	struct io_uring_sqe *sqe = uring_get_sqe(r->t->ring);
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = r->fd[!w->from];
+	sqe->addr = (unsigned long)(w->buf + w->off);
+	sqe->len = w->len - w->off;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long)w;
+	w->busy = 1;
+}
+
+/* what the loop hadn't written yet goes first, then whatever comes */
+static void
+way_next(struct relay_way *w)
+{
+	int n;
+
+	n = evbuffer_remove(w->r->pending[!w->from], w->buf, relay_io_size);
+	if (n <= 0) {
+		way_read(w);
+		return;
+	}
+	w->len = n;
+	w->off = 0;
+	evutil_gettimeofday(&w->since, NULL);
+	way_write(w);
+}
+
+/* stop both ways. what's in flight comes back once the sockets are
+   shut down, and then the tunnel is done. */
+static void
+uring_close(struct relay *r, enum relay_end end)
+{
+	if (r->closing)
+		return;
+
+	r->closing = 1;
+	r->end = end;
+	if (!r->way[0].busy && !r->way[1].busy) {
+		relay_finish(r, end);
+		return;
+	}
+	shutdown(r->fd[RELAY_CLIENT], SHUT_RDWR);
+	shutdown(r->fd[RELAY_SERVER], SHUT_RDWR);
+}
+
+/* from won't send any more; pass that on. the other way stays open. */
+static void
+way_eof(struct relay_way *w)
+{
+	struct relay *r = w->r;
+	int to = !w->from;
+
+	shutdown(r->fd[to], SHUT_WR);
+	r->into[to] = RELAY_DIR_SHUT;
+	if (r->into[w->from] == RELAY_DIR_SHUT)
+		uring_close(r, RELAY_CLOSED);
+}
+
+static void
+way_done(struct relay_way *w, int res)
+{
+	struct relay *r = w->r;
+
+	w->busy = 0;
+	if (r->closing) {
+		if (!r->way[0].busy && !r->way[1].busy)
+			relay_finish(r, r->end);
+		return;
+	}
+	if (res == -EINTR || res == -EAGAIN) {
+		if (w->len)
+			way_write(w);
+		else
+			way_read(w);
+		return;
+	}
+
+	if (!w->len) {
+		if (res > 0) {
+			r->nread[w->from] += res;
+			evutil_gettimeofday(&r->active, NULL);
+			w->since = r->active;
+			w->len = res;
+			w->off = 0;
+			way_write(w);
+		} else if (res == 0)
+			way_eof(w);
+		else
+			uring_close(r, RELAY_CLOSED);
+		return;
+	}
+
+	if (res < 0) {
+		uring_close(r, RELAY_CLOSED);
+		return;
+	}
+	w->off += res;
+	evutil_gettimeofday(&w->since, NULL);
+	if (w->off < w->len)
+		way_write(w);
+	else
+		way_next(w);
+}
+
+static void
+uring_begin(struct relay *r)
+{
+	int i;
+
+	r->started = 1;
+	TAILQ_INSERT_TAIL(&r->t->open, r, next);
+	evutil_gettimeofday(&r->begun, NULL);
+	r->active = r->begun;
+	for (i = 0; i < 2; ++i) {
+		r->way[i].r = r;
+		r->way[i].from = i;
+		r->way[i].buf = mem_malloc(relay_io_size);
+		way_next(&r->way[i]);
+	}
+}
+
+/* the same limits as relay_timedout() and relay_expirecb() keep with
+   bufferevent timeouts */
+static void
+uring_check_times(struct relay_thread *t)
+{
+	struct relay *r, *next;
+	struct relay_way *w;
+	struct timeval now, age;
+	int i, writing;
+
+	evutil_gettimeofday(&now, NULL);
+	for (r = TAILQ_FIRST(&t->open); r; r = next) {
+		next = TAILQ_NEXT(r, next);
+		if (r->closing)
+			continue;
+
+		evutil_timersub(&now, &r->begun, &age);
+		if (evutil_timerisset(&r->lifetime) &&
+		    evutil_timercmp(&age, &r->lifetime, >=)) {
+			log_info("relay: closing a tunnel, open for %ld "
+				 "seconds", (long)r->lifetime.tv_sec);
+			uring_close(r, RELAY_TIMEDOUT);
+			continue;
+		}
+		if (!evutil_timerisset(&r->idle))
+			continue;
+
+		writing = 0;
+		for (i = 0; i < 2; ++i) {
+			w = &r->way[i];
+			if (!w->len)
+				continue;
+			writing = 1;
+			evutil_timersub(&now, &w->since, &age);
+			if (evutil_timercmp(&age, &r->idle, >=))
+				break;
+		}
+		if (i < 2) {
+			log_info("relay: closing a tunnel, couldn't write");
+			uring_close(r, RELAY_TIMEDOUT);
+			continue;
+		}
+		evutil_timersub(&now, &r->active, &age);
+		if (!writing && evutil_timercmp(&age, &r->idle, >=)) {
+			log_info("relay: closing a tunnel, idle for %ld "
+				 "seconds", (long)r->idle.tv_sec);
+			uring_close(r, RELAY_TIMEDOUT);
+		}
+	}
+}
+
+static void
+uring_arm_wake(struct relay_thread *t)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(t->ring);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = t->wake[0];
+	sqe->addr = (unsigned long)t->wake_buf;
+	sqe->len = sizeof(t->wake_buf);
+	sqe->user_data = URING_WAKE;
+}
+
+static void
+uring_arm_tick(struct relay_thread *t)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(t->ring);
+
+	t->tick.tv_sec = uring_tick.tv_sec;
+	t->tick.tv_nsec = uring_tick.tv_usec * 1000;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long)&t->tick;
+	sqe->len = 1;
+	sqe->user_data = URING_TICK;
+}
+
+#endif
+
+/* start, or stop, a tunnel on the thread it was given to */
+static void
+thread_begin(struct relay_thread *t, struct relay *r)
+{
+#ifdef HAVE_IO_URING
+	if (t->ring) {
+		uring_begin(r);
+		return;
+	}
+#endif
+	relay_begin(r);
+}
+
+static void
+thread_close(struct relay_thread *t, struct relay *r)
+{
+#ifdef HAVE_IO_URING
+	if (t->ring) {
+		uring_close(r, RELAY_CLOSED);
+		return;
+	}
+#endif
+	relay_finish(r, RELAY_CLOSED);
+}
+
+/* take on what the loop has queued. 1 once the thread is to stop. */
+static int
+thread_take_inbox(struct relay_thread *t)
+{
+	struct relay *r, *next;
+	int cancelled, stop;
+
+	pthread_mutex_lock(&t->lock);
+	t->poked = 0;
+	pthread_mutex_unlock(&t->lock);
+
+	/* one at a time: the loop may queue one again meanwhile */
+	for (;;) {
+		pthread_mutex_lock(&t->lock);
+		r = TAILQ_FIRST(&t->inbox);
+		if (r) {
+			TAILQ_REMOVE(&t->inbox, r, inbox);
+			r->queued = 0;
+		}
+		cancelled = r ? r->cancelled : 0;
+		stop = t->stop;
+		pthread_mutex_unlock(&t->lock);
+		if (!r)
+			break;
+
+		if (r->finished)
+			continue;
+		if (cancelled || stop)
+			thread_close(t, r);
+		else if (!r->started)
+			thread_begin(t, r);
+	}
+
+	if (stop) {
+		for (r = TAILQ_FIRST(&t->open); r; r = next) {
+			next = TAILQ_NEXT(r, next);
+			thread_close(t, r);
+		}
+	}
+
+	return stop;
+}
+
+static void
+wake_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct relay_thread *t = arg;
+
+	drain(fd);
+	if (thread_take_inbox(t))
+		event_base_loopbreak(t->base);
+}
+
+#ifdef HAVE_IO_URING
+static void *
+uring_thread_main(void *arg)
+{
+	struct relay_thread *t = arg;
+	struct io_uring_cqe *cqe;
+	ev_uint64_t data;
+	int res;
+
+	uring_arm_wake(t);
+	uring_arm_tick(t);
+	/* once stopping, until the last tunnel's ops are back */
+	while (!t->stopping || !TAILQ_EMPTY(&t->open)) {
+		if (uring_wait(t->ring) < 0 && errno != EINTR)
+			log_fatal("relay: io_uring failed: %s",
+				  strerror(errno));
+		while ((cqe = uring_peek(t->ring))) {
+			data = cqe->user_data;
+			res = cqe->res;
+			uring_seen(t->ring);
+			if (data == URING_WAKE) {
+				drain(t->wake[0]);
+				t->stopping = thread_take_inbox(t);
+				if (!t->stopping)
+					uring_arm_wake(t);
+			} else if (data == URING_TICK) {
+				uring_check_times(t);
+				uring_arm_tick(t);
+			} else
+				way_done((void *)(unsigned long)data, res);
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+static void *
+thread_main(void *arg)
+{
+	struct relay_thread *t = arg;
+
+#ifdef HAVE_IO_URING
+	if (t->ring)
+		return uring_thread_main(t);
+#endif
+	event_base_dispatch(t->base);
+
+	return NULL;
+}
+
+/* runs on the loop: pass on the tunnels that have closed */
+static void
+pool_collect(struct relay_pool *pool)
+{
+	struct relay_list done;
+	struct relay *r;
+
+	TAILQ_INIT(&done);
+	pthread_mutex_lock(&pool->lock);
+	pool->notified = 0;
+	while ((r = TAILQ_FIRST(&pool->done))) {
+		TAILQ_REMOVE(&pool->done, r, next);
+		TAILQ_INSERT_TAIL(&done, r, next);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	while ((r = TAILQ_FIRST(&done))) {
+		TAILQ_REMOVE(&done, r, next);
+		r->t->nrelays--;
+		pool->stats.nrelays--;
+		if (r->arg)
+			r->done(r->arg, r->end, r->nread[RELAY_CLIENT],
+				r->nread[RELAY_SERVER]);
+		evbuffer_free(r->pending[RELAY_CLIENT]);
+		evbuffer_free(r->pending[RELAY_SERVER]);
+		mem_free(r);
+	}
+}
+
+static void
+notify_cb(evutil_socket_t fd, short what, void *arg)
+{
+	drain(fd);
+	pool_collect(arg);
+}
+
+/* relay threads use the loop's backend, which may have been chosen */
+static struct event_base *
+thread_base_new(struct event_base *loop)
+{
+	struct event_config *cfg;
+	struct event_base *base;
+	const char **methods;
+	const char *method;
+	int i;
+
+	cfg = event_config_new();
+	if (!cfg)
+		return NULL;
+	method = event_base_get_method(loop);
+	methods = event_get_supported_methods();
+	for (i = 0; methods[i]; ++i) {
+		if (strcmp(methods[i], method))
+			event_config_avoid_method(cfg, methods[i]);
+	}
+	base = event_base_new_with_config(cfg);
+	event_config_free(cfg);
+
+	return base;
+}
+
+static void
+thread_clear(struct relay_thread *t)
+{
+	if (t->wake_ev)
+		event_free(t->wake_ev);
+	if (t->base)
+		event_base_free(t->base);
+#ifdef HAVE_IO_URING
+	uring_free(t->ring);
+#endif
+	socket_pair_close(t->wake);
+	pthread_mutex_destroy(&t->lock);
+}
+
+static int
+thread_start(struct relay_pool *pool, struct relay_thread *t)
+{
+	t->pool = pool;
+	TAILQ_INIT(&t->open);
+	TAILQ_INIT(&t->inbox);
+	pthread_mutex_init(&t->lock, NULL);
+	t->wake[0] = t->wake[1] = -1;
+
+	if (socket_pair(t->wake) < 0)
+		goto fail;
+#ifdef HAVE_IO_URING
+	if (pool->uring) {
+		t->ring = uring_new(URING_ENTRIES, URING_INFLIGHT);
+		if (!t->ring)
+			goto fail;
+	} else
+#endif
+	{
+		t->base = thread_base_new(pool->base);
+		if (!t->base) {
+			log_error("relay: can't make an event base");
+			goto fail;
+		}
+		t->wake_ev = event_new(t->base, t->wake[0],
+				       EV_READ | EV_PERSIST, wake_cb, t);
+		if (!t->wake_ev)
+			log_fatal("relay: failed to create event");
+		event_add(t->wake_ev, NULL);
+	}
+	if (pthread_create(&t->thread, NULL, thread_main, t)) {
+		log_error("relay: can't start a relay thread");
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	thread_clear(t);
+	return -1;
+}
+
+struct relay_pool *
+relay_pool_new(struct event_base *base, int nthreads, int uring)
+{
+	struct relay_pool *pool;
+	int i;
+
+#ifndef HAVE_IO_URING
+	if (uring) {
+		log_error("relay: shim was built without io_uring");
+		return NULL;
+	}
+#endif
+	pool = mem_calloc(1, sizeof(*pool));
+	pool->base = base;
+	pool->uring = uring;
+	pool->threads = mem_calloc(nthreads, sizeof(*pool->threads));
+	TAILQ_INIT(&pool->done);
+	pthread_mutex_init(&pool->lock, NULL);
+
+	if (socket_pair(pool->notify) < 0) {
+		relay_pool_free(pool);
+		return NULL;
+	}
+	pool->notify_ev = event_new(base, pool->notify[0],
+				    EV_READ | EV_PERSIST, notify_cb, pool);
+	if (!pool->notify_ev)
+		log_fatal("relay: failed to create event");
+	event_add(pool->notify_ev, NULL);
+
+	for (i = 0; i < nthreads; ++i) {
+		if (thread_start(pool, &pool->threads[i]) < 0) {
+			relay_pool_free(pool);
+			return NULL;
+		}
+		pool->nthreads++;
+	}
+	pool->stats.nthreads = nthreads;
+
+	return pool;
+}
+
+void
+relay_pool_free(struct relay_pool *pool)
+{
+	struct relay_thread *t;
+	int i;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < pool->nthreads; ++i) {
+		t = &pool->threads[i];
+		pthread_mutex_lock(&t->lock);
+		t->stop = 1;
+		if (!t->poked) {
+			t->poked = 1;
+			poke(t->wake[1]);
+		}
+		pthread_mutex_unlock(&t->lock);
+		pthread_join(t->thread, NULL);
+	}
+
+	/* every tunnel is closed by now */
+	pool_collect(pool);
+	for (i = 0; i < pool->nthreads; ++i)
+		thread_clear(&pool->threads[i]);
+
+	if (pool->notify_ev)
+		event_free(pool->notify_ev);
+	socket_pair_close(pool->notify);
+	pthread_mutex_destroy(&pool->lock);
+	mem_free(pool->threads);
+	mem_free(pool);
+}
+
+int
+relay_pool_full(struct relay_pool *pool)
+{
+#ifdef HAVE_IO_URING
+	int i;
+
+	if (!pool->uring)
+		return 0;
+	for (i = 0; i < pool->nthreads; ++i) {
+		if (pool->threads[i].nrelays < URING_TUNNELS)
+			return 0;
+	}
+
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+struct relay *
+relay_start(struct relay_pool *pool, evutil_socket_t client,
+	    evutil_socket_t server, struct evbuffer *to_server,
+	    struct evbuffer *to_client, const struct timeval *idle,
+	    const struct timeval *lifetime, relay_done_fn done, void *arg)
+{
+	struct relay_thread *t;
+	struct relay *r;
+	int i;
+
+	/* the thread with the fewest tunnels */
+	t = &pool->threads[0];
+	for (i = 1; i < pool->nthreads; ++i) {
+		if (pool->threads[i].nrelays < t->nrelays)
+			t = &pool->threads[i];
+	}
+
+	r = mem_calloc(1, sizeof(*r));
+	r->t = t;
+	r->fd[RELAY_CLIENT] = client;
+	r->fd[RELAY_SERVER] = server;
+	r->pending[RELAY_CLIENT] = evbuffer_new();
+	r->pending[RELAY_SERVER] = evbuffer_new();
+	evbuffer_add_buffer(r->pending[RELAY_CLIENT], to_client);
+	evbuffer_add_buffer(r->pending[RELAY_SERVER], to_server);
+	if (idle)
+		r->idle = *idle;
+	if (lifetime)
+		r->lifetime = *lifetime;
+	r->done = done;
+	r->arg = arg;
+
+	t->nrelays++;
+	pool->stats.nrelays++;
+	pool->stats.nstarted++;
+
+	pthread_mutex_lock(&t->lock);
+	thread_queue(t, r);
+	pthread_mutex_unlock(&t->lock);
+
+	return r;
+}
+
+void
+relay_cancel(struct relay *r)
+{
+	struct relay_thread *t = r->t;
+
+	r->arg = NULL;
+	pthread_mutex_lock(&t->lock);
+	if (!r->finished) {
+		r->cancelled = 1;
+		thread_queue(t, r);
+	}
+	pthread_mutex_unlock(&t->lock);
+}
+
+void
+relay_pool_get_stats(struct relay_pool *pool, struct relay_pool_stats *stats)
+{
+	*stats = pool->stats;
+}
+
+#else
+
+struct relay_pool *
+relay_pool_new(struct event_base *base, int nthreads, int uring)
+{
+	log_error("relay: shim was built without thread support");
+
+	return NULL;
+}
+
+void
+relay_pool_free(struct relay_pool *pool)
+{
+}
+
+int
+relay_pool_full(struct relay_pool *pool)
+{
+	return 0;
+}
+
+struct relay *
+relay_start(struct relay_pool *pool, evutil_socket_t client,
+	    evutil_socket_t server, struct evbuffer *to_server,
+	    struct evbuffer *to_client, const struct timeval *idle,
+	    const struct timeval *lifetime, relay_done_fn done, void *arg)
+{
+	return NULL;
+}
+
+void
+relay_cancel(struct relay *r)
+{
+}
+
+void
+relay_pool_get_stats(struct relay_pool *pool, struct relay_pool_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+#endif
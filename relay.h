@@ -0,0 +1,61 @@
+#ifndef _RELAY_H_
+#define _RELAY_H_
+
+#include <event2/util.h>
+
+/* Threads that carry open tunnels, so bulk CONNECT traffic runs on
+   event loops of its own and doesn't hold up header exchanges on the
+   main one. A tunnel's two sockets are handed over once it's up; the
+   relay thread moves bytes both ways, passes half closes on, and keeps
+   the tunnel's time limits. All that comes back to the main loop is how
+   many bytes went each way and how it ended. On Linux the threads can
+   use io_uring rather than an event loop each, so the reads and writes
+   of all their tunnels go to the kernel in one system call. */
+
+struct evbuffer;
+struct event_base;
+struct relay_pool;
+struct relay;
+
+struct relay_pool_stats {
+	size_t nthreads;
+	size_t nrelays;			/* tunnels on the threads right now */
+	ev_uint64_t nstarted;		/* tunnels handed over */
+};
+
+enum relay_end {
+	RELAY_CLOSED,
+	RELAY_TIMEDOUT
+};
+
+/* runs on the loop once a tunnel is closed. up is what the client
+   sent, down what the server did, counted on the relay thread. */
+typedef void (*relay_done_fn)(void *arg, enum relay_end end,
+			      ev_uint64_t up, ev_uint64_t down);
+
+/* uring: carry the tunnels with io_uring. NULL if threads can't be
+   started, or shim was built without them, or without io_uring. */
+struct relay_pool *relay_pool_new(struct event_base *base, int nthreads,
+				  int uring);
+/* closes every tunnel still open and calls back for it. */
+void relay_pool_free(struct relay_pool *pool);
+/* 1 if another tunnel won't fit, and should stay on the loop */
+int relay_pool_full(struct relay_pool *pool);
+
+/* carry a tunnel between two connected sockets, which the pool takes
+   over and closes. to_server and to_client hold what's still to be
+   written each way; their contents are taken. idle and lifetime are as
+   for http_conn_set_tunnel_timeouts(). */
+struct relay *relay_start(struct relay_pool *pool, evutil_socket_t client,
+			  evutil_socket_t server, struct evbuffer *to_server,
+			  struct evbuffer *to_client,
+			  const struct timeval *idle,
+			  const struct timeval *lifetime,
+			  relay_done_fn done, void *arg);
+/* close a tunnel early; done won't be called for it. */
+void relay_cancel(struct relay *r);
+
+void relay_pool_get_stats(struct relay_pool *pool,
+			  struct relay_pool_stats *stats);
+
+#endif
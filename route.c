@@ -0,0 +1,471 @@
+#include "netheaders.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/util.h>
+
+#include "config.h"
+#include "route.h"
+#include "conn.h"
+#include "util.h"
+#include "log.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/* keys of different kinds are hashed with different leading bytes */
+#define KEY_HOST 'h'
+#define KEY_PORT 'p'
+#define KEY_IPV4 '4'
+#define KEY_IPV6 '6'
+
+struct rule {
+	enum route_action action;
+	struct socks_server *socks;
+};
+
+struct slot {
+	ev_uint64_t key;	/* 0 is empty */
+	int rule;		/* the first rule with this key */
+};
+
+struct route_table {
+	struct rule *rules;
+	int nrules;
+	int any;		/* the first '*' rule, or -1 */
+	struct slot *slots;
+	size_t mask;
+	size_t nkeys;
+	/* prefix lengths that have rules, so a lookup only tries those */
+	unsigned char v4_bits[33];
+	int nv4_bits;
+	unsigned char v6_bits[129];
+	int nv6_bits;
+};
+
+static unsigned char
+lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static ev_uint64_t
+hash_raw(ev_uint64_t h, unsigned char c)
+{
+	return (h ^ c) * FNV_PRIME;
+}
+
+/* host names match whatever their case */
+static ev_uint64_t
+hash_step(ev_uint64_t h, char c)
+{
+	return hash_raw(h, lower(c));
+}
+
+static ev_uint64_t
+hash_bytes(char kind, int bits, const unsigned char *p, size_t n)
+{
+	ev_uint64_t h = FNV_OFFSET;
+
+	h = hash_raw(h, kind);
+	h = hash_raw(h, bits);
+	while (n--)
+		h = hash_raw(h, *p++);
+
+	return h ? h : 1;
+}
+
+static int
+table_find(const struct route_table *routes, ev_uint64_t key)
+{
+	size_t i;
+
+	if (!key)
+		key = 1;
+	for (i = key & routes->mask; routes->slots[i].key;
+	     i = (i + 1) & routes->mask) {
+		if (routes->slots[i].key == key)
+			return routes->slots[i].rule;
+	}
+
+	return routes->nrules;
+}
+
+static void table_add(struct route_table *routes, ev_uint64_t key, int rule);
+
+static void
+table_grow(struct route_table *routes)
+{
+	struct slot *old = routes->slots;
+	size_t i, size = routes->mask + 1;
+
+	routes->slots = mem_calloc(size * 2, sizeof(*routes->slots));
+	routes->mask = size * 2 - 1;
+	routes->nkeys = 0;
+	for (i = 0; i < size; ++i) {
+		if (old[i].key)
+			table_add(routes, old[i].key, old[i].rule);
+	}
+	mem_free(old);
+}
+
+/* earlier rules win, so a key keeps the first rule it was added for */
+static void
+table_add(struct route_table *routes, ev_uint64_t key, int rule)
+{
+	size_t i;
+
+	if (!key)
+		key = 1;
+	if ((routes->nkeys + 1) * 2 > routes->mask + 1)
+		table_grow(routes);
+
+	for (i = key & routes->mask; routes->slots[i].key;
+	     i = (i + 1) & routes->mask) {
+		if (routes->slots[i].key == key)
+			return;
+	}
+	routes->slots[i].key = key;
+	routes->slots[i].rule = rule;
+	routes->nkeys++;
+}
+
+static void
+note_bits(unsigned char *lens, int *nlens, int bits)
+{
+	int i;
+
+	for (i = 0; i < *nlens; ++i) {
+		if (lens[i] == bits)
+			return;
+	}
+	lens[(*nlens)++] = bits;
+}
+
+static void
+mask_addr(unsigned char *addr, size_t len, int bits)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		if (bits >= 8)
+			bits -= 8;
+		else {
+			addr[i] &= (0xff00 >> bits) & 0xff;
+			bits = 0;
+		}
+	}
+}
+
+/* a literal address, with or without brackets. return: its length in
+   bytes, or 0 if str isn't one. */
+static size_t
+parse_addr(const char *str, unsigned char *addr)
+{
+	char buf[64];
+	size_t len = strlen(str);
+
+	if (len >= 2 && str[0] == '[' && str[len - 1] == ']') {
+		str++;
+		len -= 2;
+	}
+	if (len >= sizeof(buf))
+		return 0;
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+
+	if (evutil_inet_pton(AF_INET, buf, addr) == 1)
+		return 4;
+	if (evutil_inet_pton(AF_INET6, buf, addr) == 1)
+		return 16;
+
+	return 0;
+}
+
+static int
+add_pattern(struct route_table *routes, char *pat, int rule)
+{
+	unsigned char addr[16];
+	ev_uint64_t h;
+	char *p, *end;
+	size_t len;
+	long n;
+	int bits;
+
+	if (!strcmp(pat, "*")) {
+		if (routes->any < 0)
+			routes->any = rule;
+		return 0;
+	}
+
+	/* ":port", but not an IPv6 address like "::1" */
+	if (pat[0] == ':' && !strchr(pat + 1, ':')) {
+		n = strtol(pat + 1, &end, 10);
+		if (!pat[1] || *end || n < 1 || n > 65535)
+			return -1;
+		addr[0] = n >> 8;
+		addr[1] = n & 0xff;
+		table_add(routes, hash_bytes(KEY_PORT, 0, addr, 2), rule);
+		return 0;
+	}
+
+	bits = -1;
+	p = strchr(pat, '/');
+	if (p) {
+		*p++ = '\0';
+		n = strtol(p, &end, 10);
+		if (!*p || *end || n < 0 || n > 128)
+			return -1;
+		bits = n;
+	}
+	len = parse_addr(pat, addr);
+	if (len) {
+		if (bits < 0)
+			bits = len * 8;
+		if (bits > (int)len * 8)
+			return -1;
+		mask_addr(addr, len, bits);
+		if (len == 4) {
+			note_bits(routes->v4_bits, &routes->nv4_bits, bits);
+			table_add(routes, hash_bytes(KEY_IPV4, bits, addr, 4),
+				  rule);
+		} else {
+			note_bits(routes->v6_bits, &routes->nv6_bits, bits);
+			table_add(routes, hash_bytes(KEY_IPV6, bits, addr, 16),
+				  rule);
+		}
+		return 0;
+	}
+	if (bits >= 0)
+		return -1;
+
+	/* a host name, matched like the blocklist: itself and below */
+	while (*pat == '*' || *pat == '.')
+		pat++;
+	len = strlen(pat);
+	while (len && pat[len - 1] == '.')
+		len--;
+	if (!len)
+		return -1;
+	for (p = pat; p < pat + len; ++p) {
+		if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+		      (*p >= '0' && *p <= '9') || *p == '-' || *p == '.' ||
+		      *p == '_'))
+			return -1;
+	}
+	h = hash_raw(FNV_OFFSET, KEY_HOST);
+	while (len)
+		h = hash_step(h, pat[--len]);
+	table_add(routes, h, rule);
+
+	return 0;
+}
+
+static int
+parse_action(struct rule *rule, const char *action)
+{
+	if (!evutil_ascii_strcasecmp(action, "reject")) {
+		rule->action = ROUTE_REJECT;
+		return 0;
+	}
+	if (!evutil_ascii_strcasecmp(action, "direct")) {
+#ifdef DISABLE_DIRECT_CONNECTIONS
+		log_error("route: direct connections are disabled");
+		return -1;
+#else
+		rule->action = ROUTE_DIRECT;
+		return 0;
+#endif
+	}
+
+	rule->socks = socks_server_parse(action);
+	if (!rule->socks)
+		return -1;
+#ifdef DISABLE_DIRECT_CONNECTIONS
+	if (socks_server_get_version(rule->socks) != SOCKS_4a) {
+		log_error("route: direct connections are disabled, so only "
+			  "socks4a servers can be used");
+		return -1;
+	}
+#endif
+	rule->action = ROUTE_SOCKS;
+
+	return 0;
+}
+
+struct route_table *
+route_table_load(const char *path)
+{
+	struct route_table *routes;
+	char line[1024], pat[256], action[256], extra[2], *p;
+	int lineno = 0, size = 0, n;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		log_error("route: can't open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	routes = mem_calloc(1, sizeof(*routes));
+	routes->slots = mem_calloc(16, sizeof(*routes->slots));
+	routes->mask = 15;
+	routes->any = -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+		n = sscanf(line, "%255s %255s %1s", pat, action, extra);
+		if (n <= 0)
+			continue;
+		if (n != 2) {
+			log_error("route: %s:%d: expected a pattern and an "
+				  "action", path, lineno);
+			goto fail;
+		}
+
+		if (routes->nrules == size) {
+			struct rule *rules;
+
+			size = size ? size * 2 : 16;
+			rules = mem_calloc(size, sizeof(*rules));
+			if (routes->nrules)
+				memcpy(rules, routes->rules,
+				       routes->nrules * sizeof(*rules));
+			mem_free(routes->rules);
+			routes->rules = rules;
+		}
+		if (parse_action(&routes->rules[routes->nrules], action) < 0) {
+			log_error("route: %s:%d: bad action, %s",
+				  path, lineno, action);
+			socks_server_free(routes->rules[routes->nrules].socks);
+			goto fail;
+		}
+		routes->nrules++;
+		if (add_pattern(routes, pat, routes->nrules - 1) < 0) {
+			log_error("route: %s:%d: bad pattern, %s",
+				  path, lineno, pat);
+			goto fail;
+		}
+	}
+	fclose(fp);
+
+	return routes;
+
+fail:
+	fclose(fp);
+	route_table_free(routes);
+
+	return NULL;
+}
+
+void
+route_table_free(struct route_table *routes)
+{
+	int i;
+
+	if (!routes)
+		return;
+
+	for (i = 0; i < routes->nrules; ++i)
+		socks_server_free(routes->rules[i].socks);
+	mem_free(routes->rules);
+	mem_free(routes->slots);
+	mem_free(routes);
+}
+
+static int
+lookup_addr(const struct route_table *routes, const unsigned char *addr,
+	    size_t len)
+{
+	const unsigned char *lens;
+	unsigned char masked[16];
+	int i, n, rule, best = routes->nrules;
+
+	if (len == 4) {
+		lens = routes->v4_bits;
+		n = routes->nv4_bits;
+	} else {
+		lens = routes->v6_bits;
+		n = routes->nv6_bits;
+	}
+
+	for (i = 0; i < n; ++i) {
+		memcpy(masked, addr, len);
+		mask_addr(masked, len, lens[i]);
+		rule = table_find(routes, hash_bytes(len == 4 ? KEY_IPV4 :
+						     KEY_IPV6, lens[i],
+						     masked, len));
+		if (rule < best)
+			best = rule;
+	}
+
+	return best;
+}
+
+static int
+lookup_host(const struct route_table *routes, const char *host)
+{
+	ev_uint64_t h = hash_raw(FNV_OFFSET, KEY_HOST);
+	const char *p;
+	int rule, best = routes->nrules;
+
+	p = host + strlen(host);
+	if (p > host && p[-1] == '.')
+		p--;
+
+	while (p > host) {
+		h = hash_step(h, *--p);
+		if (p == host || p[-1] == '.') {
+			rule = table_find(routes, h);
+			if (rule < best)
+				best = rule;
+		}
+	}
+
+	return best;
+}
+
+enum route_action
+route_lookup(const struct route_table *routes, const char *host, int port,
+	     const struct socks_server **socks)
+{
+	unsigned char addr[16];
+	const struct rule *rule;
+	size_t len;
+	int best, n;
+
+	best = routes->any >= 0 ? routes->any : routes->nrules;
+	if (port > 0 && port <= 65535) {
+		addr[0] = port >> 8;
+		addr[1] = port & 0xff;
+		n = table_find(routes, hash_bytes(KEY_PORT, 0, addr, 2));
+		if (n < best)
+			best = n;
+	}
+
+	len = parse_addr(host, addr);
+	n = len ? lookup_addr(routes, addr, len) : lookup_host(routes, host);
+	if (n < best)
+		best = n;
+
+	if (best == routes->nrules)
+		return ROUTE_DEFAULT;
+
+	rule = &routes->rules[best];
+	if (rule->action == ROUTE_SOCKS)
+		*socks = rule->socks;
+
+	return rule->action;
+}
+
+size_t
+route_table_size(const struct route_table *routes)
+{
+	return routes->nrules;
+}
@@ -0,0 +1,42 @@
+#ifndef _ROUTE_H_
+#define _ROUTE_H_
+
+/* Rules for where connections go. Each line of a rule file is a pattern
+   and what to do with destinations that match it:
+
+	# pattern		action
+	.onion			socks4a://127.0.0.1:9150
+	localhost		direct
+	10.0.0.0/8		direct
+	:25			reject
+	*			socks4a://127.0.0.1:9050
+
+   A pattern is a host name, which also covers the hosts under it; an
+   address or address/bits, which matches literal addresses only; a
+   :port; or *, which matches everything. An action is direct, reject or
+   a SOCKS server. The first matching line wins. Lookups cost a hash
+   probe per label of the host and one per prefix length in use, however
+   many rules there are. */
+
+enum route_action {
+	ROUTE_DEFAULT,		/* no rule matched */
+	ROUTE_DIRECT,
+	ROUTE_SOCKS,
+	ROUTE_REJECT
+};
+
+struct route_table;
+struct socks_server;
+
+/* NULL if the file can't be read or has a bad line. With
+   --disable-direct-connections, only socks4a servers are allowed. */
+struct route_table *route_table_load(const char *path);
+void route_table_free(struct route_table *routes);
+
+/* socks is set for ROUTE_SOCKS; it lives as long as the table. */
+enum route_action route_lookup(const struct route_table *routes,
+			       const char *host, int port,
+			       const struct socks_server **socks);
+size_t route_table_size(const struct route_table *routes);
+
+#endif
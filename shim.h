@@ -0,0 +1,191 @@
+#ifndef _SHIM_H_
+#define _SHIM_H_
+
+#include <stdio.h>
+#include <event2/util.h>
+
+struct sockaddr;
+struct event_base;
+struct evdns_base;
+struct evconnlistener;
+
+/* A proxy instance. Everything it owns runs on the event base it was
+   created with; use one proxy per base. Proxies on different threads
+   are fine: the little they share, like the table of host names, is
+   locked. */
+struct shim_proxy;
+
+struct shim_stats {
+	size_t nclients;		/* open client connections */
+	size_t nservers;		/* open server connections */
+	size_t nidle_servers;		/* servers waiting to be reused */
+	ev_uint64_t nrequests;		/* requests read from clients */
+	ev_uint64_t ntunnels;		/* CONNECT tunnels attempted */
+	ev_uint64_t nserver_failures;	/* failed server connections */
+	size_t nh2_sessions;		/* open HTTP/2 client connections */
+	ev_uint64_t nh2_streams;	/* HTTP/2 streams opened */
+	ev_uint64_t nupgrades;		/* requests that switched protocols */
+	size_t nspare_tunnels;		/* speculative tunnels open right now */
+	ev_uint64_t nspares_opened;	/* speculative tunnels started */
+	ev_uint64_t nspares_used;	/* ... that a CONNECT went on to use */
+	ev_uint64_t nspares_wasted;	/* ... that expired or were closed */
+	ev_uint64_t nspares_failed;	/* ... that never connected */
+	ev_uint64_t ntunnel_timeouts;	/* tunnels closed for idling or age */
+	ev_uint64_t ntunnel_bytes_up;	/* relayed from clients by tunnels */
+	ev_uint64_t ntunnel_bytes_down;	/* relayed to clients by tunnels */
+	ev_uint64_t nblocked;		/* requests refused by the blocklist */
+	ev_uint64_t nrejected;		/* ... and by a routing rule */
+	size_t nonion_mappings;		/* sites known to have onion services */
+	ev_uint64_t nonion_connects;	/* connections made to those instead */
+	ev_uint64_t nonion_failures;	/* ... that failed and fell back */
+	ev_uint64_t nonion_dropped;	/* mappings dropped as unreliable */
+	ev_uint64_t ncompressed;	/* responses gzipped for clients */
+	ev_uint64_t ncompress_bytes_in;	/* ... their bodies' size before */
+	ev_uint64_t ncompress_bytes_out;/* ... and after */
+	ev_uint64_t ncompress_usec;	/* CPU time spent compressing */
+	int compress_level;		/* level new responses get */
+	ev_uint64_t nworker_jobs;	/* pieces of body run on workers */
+	size_t nworker_backlog;		/* ... waiting or running now */
+	size_t nrelayed_tunnels;	/* tunnels on relay threads now */
+	ev_uint64_t nredirects;		/* redirects followed for clients */
+	size_t nfailing_hosts;		/* hosts whose requests fail fast */
+	ev_uint64_t nfast_failures;	/* ... requests failed that way */
+	ev_uint64_t nshed_requests;	/* answered 503 for waiting too long */
+	size_t nhost_atoms;		/* host names held, each just once */
+	ev_uint64_t nevent_allocs;	/* blocks libevent allocated */
+	ev_uint64_t nevent_allocs_cached;/* ... reused from shim's caches */
+	size_t nevent_cached_bytes;	/* kept in those caches now */
+};
+
+/* Have libevent allocate its buffers and events through shim's size
+   class caches, keeping up to cache_size bytes of freed blocks per
+   thread; 0 caches nothing but still counts. Process wide, and has to
+   be called before anything else uses libevent. -1 if it's been done,
+   or libevent can't take an allocator. */
+int shim_use_event_allocator(size_t cache_size);
+
+/* Set up the event priorities shim uses to put header processing ahead
+   of bulk transfers. Call before adding any events to the base; without
+   it everything runs at the same priority. */
+int shim_event_base_init_priorities(struct event_base *base);
+
+/* dns may be NULL if only a SOCKS 4a server will be used. */
+struct shim_proxy *shim_proxy_new(struct event_base *base,
+				  struct evdns_base *dns);
+/* Closes every listener and connection. Connections are released on the
+   next pass through the event loop, so the caller should run it once
+   more, e.g. event_base_loop(base, EVLOOP_NONBLOCK), before freeing the
+   base. */
+void shim_proxy_free(struct shim_proxy *proxy);
+
+/* socks looks like socks_version://address[:port]; -1 on error. */
+int shim_proxy_set_socks_server(struct shim_proxy *proxy, const char *socks);
+void shim_proxy_set_max_pending_requests(struct shim_proxy *proxy,
+					 size_t nreqs);
+size_t shim_proxy_get_max_pending_requests(struct shim_proxy *proxy);
+/* Responses whose length is only known when the server closes are held
+   until then, up to len bytes, so they can be sent with a Content-Length
+   on a persistent connection. Longer ones are streamed. 0 disables. */
+void shim_proxy_set_max_buffered_body(struct shim_proxy *proxy, size_t len);
+size_t shim_proxy_get_max_buffered_body(struct shim_proxy *proxy);
+/* Answer CONNECT with 200 before the far end is reached, so the client's
+   first bytes (a TLS ClientHello, say) can go out with the SOCKS request.
+   A tunnel that then fails to connect is just closed. Off by default. */
+void shim_proxy_set_optimistic_connect(struct shim_proxy *proxy, int enable);
+/* Learn which CONNECT targets tend to follow which, and keep up to n
+   connections to likely next targets open for a few seconds. 0, the
+   default, turns this off. */
+void shim_proxy_set_max_spare_tunnels(struct shim_proxy *proxy, size_t n);
+/* Close tunnels (CONNECT or upgraded) that have carried nothing for
+   idle, or that have been open for lifetime. NULL or zero means no
+   limit. The default is a 300 second idle limit and no lifetime limit. */
+void shim_proxy_set_tunnel_timeouts(struct shim_proxy *proxy,
+				    const struct timeval *idle,
+				    const struct timeval *lifetime);
+/* Answer requests and CONNECTs for hosts listed in the file at path, or
+   under them, with a 403; see blocklist.h for the format. Call again to
+   reload. A list that can't be read leaves the old one in place and
+   returns -1. NULL drops the list. */
+int shim_proxy_set_blocklist(struct shim_proxy *proxy, const char *path);
+/* Choose per destination whether to connect directly, through a given
+   SOCKS server or not at all; see route.h for the rule file format.
+   Destinations no rule matches use the SOCKS server set above, if any.
+   Rejected requests get a 403. Reloads and errors work as for the
+   blocklist. */
+int shim_proxy_set_routes(struct shim_proxy *proxy, const char *path);
+/* Strip or rewrite request and response headers as the file at path
+   says; see headerpolicy.h for the format. Proxy-Authorization and
+   Proxy-Authenticate are always removed. Reloads and errors work as for
+   the blocklist; NULL goes back to just the built in rules. */
+int shim_proxy_set_header_policy(struct shim_proxy *proxy, const char *path);
+/* Remember Onion-Location headers and connect to the onion service for
+   later plain HTTP requests to the same site; the client still sees the
+   URL it asked for. Needs a SOCKS 4a server (Tor) for .onion hosts. A
+   failed onion connection falls back to the site, and mappings that
+   keep failing or are slow are forgotten. Off by default. */
+void shim_proxy_set_onion_location(struct shim_proxy *proxy, int enable);
+/* gzip text responses the origin didn't compress, for clients that
+   accept it. level (1-9) is the most that's used; it drops while the
+   process is busy. Clients on this machine are never compressed for.
+   0 turns it off, the default. -1 if shim was built without zlib. */
+int shim_proxy_set_compression(struct shim_proxy *proxy, int level);
+/* Run CPU heavy body work, like compression, on n worker threads
+   instead of the event loop. Set it before serving any clients; -1 if
+   it's already set, or threads can't be started. */
+int shim_proxy_set_worker_threads(struct shim_proxy *proxy, int n);
+/* Follow up to max redirects of a GET within shim, and answer with
+   where they led, saving the client a round trip each. Only plain http
+   is followed, only within the same directory, and only to the same
+   host:port unless cross_host is set; redirects that set cookies,
+   loop, or would take credentials to another host are passed on. 0,
+   the default, turns it off. */
+void shim_proxy_set_follow_redirects(struct shim_proxy *proxy, int max,
+				     int cross_host);
+/* Carry open tunnels on n threads of their own, so bulk CONNECT
+   traffic doesn't slow down the event loop's header exchanges. Set it
+   before serving any clients; -1 if it's already set, or threads can't
+   be started. */
+int shim_proxy_set_relay_threads(struct shim_proxy *proxy, int n);
+/* Have the relay threads carry tunnels with io_uring instead of an
+   event loop each. Set it before shim_proxy_set_relay_threads(), which
+   then fails if shim was built without io_uring or the kernel won't
+   let it be used. */
+void shim_proxy_set_relay_io_uring(struct shim_proxy *proxy, int on);
+/* Once connections to a host:port have failed this many times in a
+   row, fail its requests straight away for a while instead of letting
+   each wait out a connect of its own; then try one connection to see if
+   it's back. The wait doubles each time it isn't, up to five minutes.
+   0, the default, turns it off. */
+void shim_proxy_set_circuit_breaker(struct shim_proxy *proxy,
+				    unsigned failures);
+/* Keep pipelined requests from piling up behind slow responses. Once a
+   client's requests have kept waiting longer than target to go out for
+   a whole interval, the oldest are answered with a 503 and Retry-After
+   instead, more often the longer it goes on, and the client may only
+   have one request waiting until they get through in time again.
+   interval may be NULL for 20 times target; a NULL or zero target turns
+   it off, the default. */
+void shim_proxy_set_queue_delay(struct shim_proxy *proxy,
+				const struct timeval *target,
+				const struct timeval *interval);
+
+/* Bind a new listener. */
+int shim_proxy_listen(struct shim_proxy *proxy,
+		      const struct sockaddr *listen_here, int socklen);
+/* Take over an existing listener; the proxy frees it. */
+int shim_proxy_add_listener(struct shim_proxy *proxy,
+			    struct evconnlistener *lev);
+/* Serve a client socket accepted elsewhere; the proxy closes it. */
+int shim_proxy_add_client(struct shim_proxy *proxy, evutil_socket_t sock);
+
+/* The counts are the proxy's own, except nhost_atoms and the
+   nevent_ ones: host names and libevent's allocator are shared by every
+   proxy in the process, like logging below. */
+void shim_proxy_get_stats(struct shim_proxy *proxy, struct shim_stats *stats);
+
+/* Logging is shared by every proxy in the process. Levels run from 0
+   (debug) to 5 (fatal); fp NULL means stderr. */
+void shim_set_log_file(FILE *fp);
+void shim_set_log_level(int level);
+
+#endif
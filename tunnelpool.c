@@ -0,0 +1,435 @@
+#include "netheaders.h"
+
+#include <sys/queue.h>
+#include <assert.h>
+#include <string.h>
+
+#include <event2/util.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "tunnelpool.h"
+#include "conn.h"
+#include "util.h"
+#include "log.h"
+
+/* CONNECTs this close together are taken to belong to the same page */
+static struct timeval follow_window = {3, 0};
+/* how often B has to have followed A before we'll guess it */
+static unsigned min_follow_hits = 2;
+/* spares opened per CONNECT */
+static int max_predictions = 2;
+/* servers drop idle connections; don't hold one long */
+static struct timeval spare_lifetime = {10, 0};
+/* anything a server says before a client claims its tunnel */
+static size_t max_spare_backlog = 16 * 1024;
+
+#define MAX_ORIGINS 256
+#define MAX_FOLLOWERS 8
+#define MAX_HITS 1024
+#define NRECENT 4
+
+struct target {
+	const char *host;		/* an atom */
+	int port;
+};
+
+struct follower {
+	struct target target;
+	unsigned hits;
+};
+
+/* a CONNECT target and what has come after it */
+struct origin {
+	TAILQ_ENTRY(origin) next;
+	struct target target;
+	struct follower followers[MAX_FOLLOWERS];
+	int nfollowers;
+};
+TAILQ_HEAD(origin_list, origin);
+
+struct recent {
+	struct target target;
+	struct timeval when;
+};
+
+struct spare {
+	TAILQ_ENTRY(spare) next;
+	struct tunnel_pool *pool;
+	struct target target;
+	struct bufferevent *bev;
+	struct event *expire_ev;
+	int ready;
+	int expired;
+};
+TAILQ_HEAD(spare_list, spare);
+
+struct tunnel_pool {
+	struct event_base *base;
+	struct origin_list origins;		/* most recently used first */
+	size_t norigins;
+	struct recent recent[NRECENT];
+	int next_recent;
+	struct spare_list spares;
+	size_t max_spares;
+	struct tunnel_pool_stats stats;
+};
+
+static int
+target_matches(const struct target *t, const char *host, int port)
+{
+	return t->host == host && t->port == port;
+}
+
+static void
+target_set(struct target *t, const char *host, int port)
+{
+	host = host_atom_ref(host);
+	host_atom_unref(t->host);
+	t->host = host;
+	t->port = port;
+}
+
+static void
+origin_free(struct origin *origin)
+{
+	int i;
+
+	for (i = 0; i < origin->nfollowers; ++i)
+		host_atom_unref(origin->followers[i].target.host);
+	host_atom_unref(origin->target.host);
+	mem_free(origin);
+}
+
+static struct origin *
+origin_find(struct tunnel_pool *pool, const char *host, int port)
+{
+	struct origin *origin;
+
+	TAILQ_FOREACH(origin, &pool->origins, next) {
+		if (target_matches(&origin->target, host, port)) {
+			TAILQ_REMOVE(&pool->origins, origin, next);
+			TAILQ_INSERT_HEAD(&pool->origins, origin, next);
+			return origin;
+		}
+	}
+
+	return NULL;
+}
+
+static struct origin *
+origin_get(struct tunnel_pool *pool, const char *host, int port)
+{
+	struct origin *origin;
+
+	origin = origin_find(pool, host, port);
+	if (origin)
+		return origin;
+
+	if (pool->norigins == MAX_ORIGINS) {
+		origin = TAILQ_LAST(&pool->origins, origin_list);
+		TAILQ_REMOVE(&pool->origins, origin, next);
+		origin_free(origin);
+		pool->norigins--;
+	}
+
+	origin = mem_calloc(1, sizeof(*origin));
+	target_set(&origin->target, host, port);
+	TAILQ_INSERT_HEAD(&pool->origins, origin, next);
+	pool->norigins++;
+
+	return origin;
+}
+
+static void
+origin_add_follower(struct origin *origin, const char *host, int port)
+{
+	struct follower *f, *least = NULL;
+	int i;
+
+	for (i = 0; i < origin->nfollowers; ++i) {
+		f = &origin->followers[i];
+		if (target_matches(&f->target, host, port)) {
+			if (++f->hits < MAX_HITS)
+				return;
+			/* age everything so old habits can be unlearned */
+			for (i = 0; i < origin->nfollowers; ++i)
+				origin->followers[i].hits /= 2;
+			return;
+		}
+		if (!least || f->hits < least->hits)
+			least = f;
+	}
+
+	if (origin->nfollowers < MAX_FOLLOWERS)
+		f = &origin->followers[origin->nfollowers++];
+	else
+		f = least;
+	target_set(&f->target, host, port);
+	f->hits = 1;
+}
+
+/* remember host:port as following whatever was CONNECTed to just before */
+static void
+learn(struct tunnel_pool *pool, const char *host, int port)
+{
+	struct timeval now, age;
+	struct recent *r;
+	int i;
+
+	event_base_gettimeofday_cached(pool->base, &now);
+
+	for (i = 0; i < NRECENT; ++i) {
+		r = &pool->recent[i];
+		if (!r->target.host || target_matches(&r->target, host, port))
+			continue;
+		evutil_timersub(&now, &r->when, &age);
+		if (evutil_timercmp(&age, &follow_window, >))
+			continue;
+		origin_add_follower(origin_get(pool, r->target.host,
+					       r->target.port), host, port);
+	}
+
+	r = &pool->recent[pool->next_recent];
+	pool->next_recent = (pool->next_recent + 1) % NRECENT;
+	target_set(&r->target, host, port);
+	r->when = now;
+}
+
+static struct spare *
+spare_find(struct tunnel_pool *pool, const char *host, int port)
+{
+	struct spare *spare;
+
+	TAILQ_FOREACH(spare, &pool->spares, next) {
+		if (target_matches(&spare->target, host, port))
+			return spare;
+	}
+
+	return NULL;
+}
+
+static void
+spare_free(struct spare *spare)
+{
+	struct tunnel_pool *pool = spare->pool;
+
+	if (pool) {
+		TAILQ_REMOVE(&pool->spares, spare, next);
+		pool->stats.nspares--;
+	}
+
+	if (spare->expire_ev)
+		event_free(spare->expire_ev);
+	if (spare->bev)
+		bufferevent_free(spare->bev);
+	host_atom_unref(spare->target.host);
+	mem_free(spare);
+}
+
+static void
+spare_wasted(struct spare *spare)
+{
+	log_debug("tunnelpool: spare to %s:%d went unused",
+		  log_scrub(spare->target.host), spare->target.port);
+	spare->pool->stats.nwasted++;
+	spare_free(spare);
+}
+
+static void
+spare_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	/* the server gave up on us */
+	spare_wasted(arg);
+}
+
+static void
+spare_expirecb(evutil_socket_t fd, short what, void *arg)
+{
+	struct spare *spare = arg;
+
+	/* conn.c still has the bev; let it finish */
+	if (!spare->ready)
+		spare->expired = 1;
+	else
+		spare_wasted(spare);
+}
+
+static void
+spare_connectcb(struct bufferevent *bev, int ok, const char *err, void *arg)
+{
+	struct spare *spare = arg;
+
+	/* the pool went while it was connecting */
+	if (!spare->pool) {
+		spare_free(spare);
+		return;
+	}
+	if (!ok) {
+		log_debug("tunnelpool: spare to %s:%d failed: %s",
+			  log_scrub(spare->target.host), spare->target.port,
+			  err);
+		spare->pool->stats.nfailed++;
+		spare_free(spare);
+		return;
+	}
+	if (spare->expired) {
+		spare_wasted(spare);
+		return;
+	}
+
+	spare->ready = 1;
+	bufferevent_setcb(bev, NULL, NULL, spare_eventcb, spare);
+	bufferevent_setwatermark(bev, EV_READ, 0, max_spare_backlog);
+	bufferevent_enable(bev, EV_READ);
+}
+
+static void
+spare_open(struct tunnel_pool *pool, struct evdns_base *dns,
+	   const struct socks_server *socks, const char *host, int port)
+{
+	struct spare *spare;
+
+	log_debug("tunnelpool: opening a spare to %s:%d",
+		  log_scrub(host), port);
+
+	spare = mem_calloc(1, sizeof(*spare));
+	spare->pool = pool;
+	target_set(&spare->target, host, port);
+	spare->bev = bufferevent_socket_new(pool->base, -1,
+					    BEV_OPT_CLOSE_ON_FREE);
+	spare->expire_ev = evtimer_new(pool->base, spare_expirecb, spare);
+	evtimer_add(spare->expire_ev, &spare_lifetime);
+	TAILQ_INSERT_TAIL(&pool->spares, spare, next);
+	pool->stats.nspares++;
+	pool->stats.nopened++;
+
+	conn_connect_bufferevent(spare->bev, dns, socks, AF_INET, host, port,
+				 NULL, spare_connectcb, spare);
+}
+
+struct tunnel_pool *
+tunnel_pool_new(struct event_base *base)
+{
+	struct tunnel_pool *pool;
+
+	pool = mem_calloc(1, sizeof(*pool));
+	pool->base = base;
+	TAILQ_INIT(&pool->origins);
+	TAILQ_INIT(&pool->spares);
+
+	return pool;
+}
+
+void
+tunnel_pool_free(struct tunnel_pool *pool)
+{
+	struct origin *origin;
+	struct spare *spare;
+	int i;
+
+	if (!pool)
+		return;
+
+	while ((spare = TAILQ_FIRST(&pool->spares))) {
+		if (spare->ready) {
+			spare_free(spare);
+			continue;
+		}
+		/* conn.c still has the bev; spare_connectcb frees it */
+		TAILQ_REMOVE(&pool->spares, spare, next);
+		event_free(spare->expire_ev);
+		spare->expire_ev = NULL;
+		spare->expired = 1;
+		spare->pool = NULL;
+	}
+	while ((origin = TAILQ_FIRST(&pool->origins))) {
+		TAILQ_REMOVE(&pool->origins, origin, next);
+		origin_free(origin);
+	}
+	for (i = 0; i < NRECENT; ++i)
+		host_atom_unref(pool->recent[i].target.host);
+	mem_free(pool);
+}
+
+void
+tunnel_pool_set_max_spares(struct tunnel_pool *pool, size_t n)
+{
+	pool->max_spares = n;
+}
+
+void
+tunnel_pool_note_connect(struct tunnel_pool *pool, struct evdns_base *dns,
+			 tunnel_pool_routecb route, void *arg,
+			 const char *host, int port)
+{
+	const struct socks_server *socks;
+	struct origin *origin;
+	struct follower *f, *best;
+	unsigned chosen = 0;
+	int i, n;
+
+	if (!pool->max_spares)
+		return;
+
+	learn(pool, host, port);
+
+	origin = origin_find(pool, host, port);
+	if (!origin)
+		return;
+
+	/* the most frequent followers we don't already have spares for */
+	for (n = 0; n < max_predictions; ++n) {
+		best = NULL;
+		for (i = 0; i < origin->nfollowers; ++i) {
+			f = &origin->followers[i];
+			if ((chosen & (1u << i)) || f->hits < min_follow_hits)
+				continue;
+			if (!best || f->hits > best->hits)
+				best = f;
+		}
+		if (!best || pool->stats.nspares >= pool->max_spares)
+			break;
+		chosen |= 1u << (best - origin->followers);
+		if (spare_find(pool, best->target.host, best->target.port) ||
+		    route(best->target.host, best->target.port, &socks,
+			  arg) < 0)
+			continue;
+		spare_open(pool, dns, socks, best->target.host,
+			   best->target.port);
+	}
+}
+
+struct bufferevent *
+tunnel_pool_take(struct tunnel_pool *pool, const char *host, int port)
+{
+	struct spare *spare;
+	struct bufferevent *bev;
+
+	TAILQ_FOREACH(spare, &pool->spares, next) {
+		if (spare->ready && target_matches(&spare->target, host, port))
+			break;
+	}
+	if (!spare)
+		return NULL;
+
+	log_debug("tunnelpool: using spare to %s:%d", log_scrub(host), port);
+	pool->stats.nused++;
+
+	bev = spare->bev;
+	spare->bev = NULL;
+	bufferevent_disable(bev, EV_READ);
+	bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+	bufferevent_setwatermark(bev, EV_READ, 0, 0);
+	spare_free(spare);
+
+	return bev;
+}
+
+void
+tunnel_pool_get_stats(struct tunnel_pool *pool,
+		      struct tunnel_pool_stats *stats)
+{
+	*stats = pool->stats;
+}
@@ -0,0 +1,51 @@
+#ifndef _TUNNELPOOL_H_
+#define _TUNNELPOOL_H_
+
+#include <event2/util.h>
+
+/* Spare CONNECT tunnels. The pool learns which targets tend to be
+   CONNECTed to shortly after which, and when a CONNECT comes in opens
+   connections to its likely followers ahead of time. A tunnel is single
+   use, so a spare that isn't claimed soon is thrown away. */
+
+struct bufferevent;
+struct event_base;
+struct evdns_base;
+struct socks_server;
+struct tunnel_pool;
+
+struct tunnel_pool_stats {
+	size_t nspares;			/* open or opening right now */
+	ev_uint64_t nopened;		/* speculative connections started */
+	ev_uint64_t nused;		/* spares handed to a CONNECT */
+	ev_uint64_t nwasted;		/* expired or closed unclaimed */
+	ev_uint64_t nfailed;		/* never got connected */
+};
+
+struct tunnel_pool *tunnel_pool_new(struct event_base *base);
+void tunnel_pool_free(struct tunnel_pool *pool);
+
+/* the most spares to keep at once; 0, the default, turns the pool off. */
+void tunnel_pool_set_max_spares(struct tunnel_pool *pool, size_t n);
+
+/* how to reach host:port: sets socks, NULL to connect directly, or
+   returns -1 if no spare should be opened there. */
+typedef int (*tunnel_pool_routecb)(const char *host, int port,
+				   const struct socks_server **socks,
+				   void *arg);
+
+/* learn from a CONNECT to host:port and open spares to whatever usually
+   follows it, each routed through route. */
+void tunnel_pool_note_connect(struct tunnel_pool *pool,
+			      struct evdns_base *dns,
+			      tunnel_pool_routecb route, void *arg,
+			      const char *host, int port);
+
+/* a connected spare to host:port, now the caller's, or NULL. */
+struct bufferevent *tunnel_pool_take(struct tunnel_pool *pool,
+				     const char *host, int port);
+
+void tunnel_pool_get_stats(struct tunnel_pool *pool,
+			   struct tunnel_pool_stats *stats);
+
+#endif
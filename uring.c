@@ -0,0 +1,195 @@
+#include "config.h"
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+#include "util.h"
+#include "log.h"
+
+#define load_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned nqueued;		/* not submitted yet */
+	void *sq_ring;
+	size_t sq_size;
+	void *cq_ring;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	/* in the rings the kernel shares with us */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static void *
+ring_map(int fd, size_t size, off_t what)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, fd, what);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+struct uring *
+uring_new(unsigned entries, unsigned inflight)
+{
+	struct io_uring_params p;
+	struct uring *u;
+	char *sq, *cq;
+
+	u = mem_calloc(1, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	if (inflight > entries) {
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = inflight;
+	}
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0) {
+		log_error("uring: can't set up io_uring: %s",
+			  strerror(errno));
+		mem_free(u);
+		return NULL;
+	}
+	/* older kernels throw completions away when the queue is full */
+	if (!(p.features & IORING_FEAT_NODROP)) {
+		log_error("uring: kernel may drop completions");
+		close(u->fd);
+		mem_free(u);
+		return NULL;
+	}
+	u->entries = p.sq_entries;
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_size = p.cq_off.cqes +
+		     p.cq_entries * sizeof(struct io_uring_cqe);
+	/* older kernels map the two rings separately */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_size > u->sq_size)
+			u->sq_size = u->cq_size;
+		u->sq_ring = ring_map(u->fd, u->sq_size, IORING_OFF_SQ_RING);
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->sq_ring = ring_map(u->fd, u->sq_size, IORING_OFF_SQ_RING);
+		u->cq_ring = ring_map(u->fd, u->cq_size, IORING_OFF_CQ_RING);
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = ring_map(u->fd, u->sqes_size, IORING_OFF_SQES);
+	if (!u->sq_ring || !u->cq_ring || !u->sqes) {
+		log_error("uring: can't map the rings: %s", strerror(errno));
+		uring_free(u);
+		return NULL;
+	}
+
+	sq = u->sq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq = u->cq_ring;
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return u;
+}
+
+void
+uring_free(struct uring *u)
+{
+	if (!u)
+		return;
+
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_size);
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_size);
+	close(u->fd);
+	mem_free(u);
+}
+
+static int
+uring_enter(struct uring *u, unsigned wait)
+{
+	int rv;
+
+	rv = syscall(__NR_io_uring_enter, u->fd, u->nqueued, wait,
+		     wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	/* completions it couldn't fit are waiting on us to reap some */
+	if (rv < 0 && errno == EBUSY)
+		return 0;
+	if (rv < 0)
+		return -1;
+	u->nqueued -= rv;
+
+	return 0;
+}
+
+struct io_uring_sqe *
+uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *u->sq_tail, i;
+
+	if (tail - load_acquire(u->sq_head) == u->entries &&
+	    (uring_enter(u, 0) < 0 ||
+	     tail - load_acquire(u->sq_head) == u->entries))
+		log_fatal("uring: submission queue is stuck");
+
+	/* the kernel only looks at the queue when it's submitted */
+	i = tail & *u->sq_mask;
+	sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[i] = i;
+	store_release(u->sq_tail, tail + 1);
+	u->nqueued++;
+
+	return sqe;
+}
+
+int
+uring_wait(struct uring *u)
+{
+	/* no need to sleep with completions still to look at */
+	if (*u->cq_head != load_acquire(u->cq_tail))
+		return uring_enter(u, 0);
+
+	return uring_enter(u, 1);
+}
+
+struct io_uring_cqe *
+uring_peek(struct uring *u)
+{
+	unsigned head = *u->cq_head;
+
+	if (head == load_acquire(u->cq_tail))
+		return NULL;
+
+	return &u->cqes[head & *u->cq_mask];
+}
+
+void
+uring_seen(struct uring *u)
+{
+	store_release(u->cq_head, *u->cq_head + 1);
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+/* Just enough io_uring for the relay threads, over the raw system
+   calls: a submission queue and a completion queue, both filled and
+   drained by one thread. Nothing is submitted until uring_wait(), so
+   everything a pass over the completions asked for goes to the kernel
+   in one call. */
+
+#include <linux/io_uring.h>
+
+struct uring;
+
+/* entries is the submission queue; the completion queue has room for
+   inflight, the most ops ever out at once, so none overflow. NULL if
+   the kernel won't set one up, or might drop completions. */
+struct uring *uring_new(unsigned entries, unsigned inflight);
+void uring_free(struct uring *u);
+
+/* a cleared entry to fill in, submitted with the next uring_wait() */
+struct io_uring_sqe *uring_get_sqe(struct uring *u);
+/* submit what's queued and wait until something has completed. -1
+   with errno set on error. 0 without submitting if the kernel is
+   holding completions back: look at those and call again. */
+int uring_wait(struct uring *u);
+/* the next completion, or NULL. uring_seen() lets go of it. */
+struct io_uring_cqe *uring_peek(struct uring *u);
+void uring_seen(struct uring *u);
+
+#endif
@@ -1,12 +1,20 @@
 #include "netheaders.h"
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <event2/buffer.h>
+
+#include "config.h"
 #include "util.h"
 #include "log.h"
 
+#ifdef HAVE_WORKER_THREADS
+#include <pthread.h>
+#endif
+
 void *
 mem_calloc(size_t nmemb, size_t size)
 {
@@ -141,6 +149,186 @@ get_port(const char *str)
 	return port;
 }
 
+struct host_atom {
+	struct host_atom *next;		/* in its bucket */
+	unsigned hash;
+	unsigned refcnt;
+	char name[0];
+};
+
+#define ATOM(str) \
+	((struct host_atom *)((char *)(str) - offsetof(struct host_atom, name)))
+
+static struct host_atom **atom_table;
+static size_t atom_table_size;
+static size_t natoms;
+
+/* proxies on other threads share the table. a count only reaches 0
+   with the lock held, so a lookup can't revive an atom being freed. */
+#ifdef HAVE_WORKER_THREADS
+static pthread_mutex_t atom_lock = PTHREAD_MUTEX_INITIALIZER;
+#define atom_lock()		pthread_mutex_lock(&atom_lock)
+#define atom_unlock()		pthread_mutex_unlock(&atom_lock)
+#define ref_add(p)		__atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#define ref_sub(p)		__atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define count_get(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#else
+#define atom_lock()
+#define atom_unlock()
+#define ref_add(p)		(++*(p))
+#define ref_sub(p)		(--*(p))
+#define count_get(p)		(*(p))
+#endif
+
+static inline char
+lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/* FNV-1a, of the name lowercased */
+static unsigned
+atom_hash(const char *name, size_t n)
+{
+	unsigned hash = 2166136261U;
+
+	while (n--) {
+		hash ^= (unsigned char)lower(*name++);
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static void
+atom_table_grow(void)
+{
+	struct host_atom **table, *a, *next;
+	size_t size, i;
+
+	size = atom_table_size ? atom_table_size * 2 : 64;
+	table = mem_calloc(size, sizeof(*table));
+	for (i = 0; i < atom_table_size; i++) {
+		for (a = atom_table[i]; a; a = next) {
+			next = a->next;
+			a->next = table[a->hash & (size - 1)];
+			table[a->hash & (size - 1)] = a;
+		}
+	}
+	mem_free(atom_table);
+	atom_table = table;
+	atom_table_size = size;
+}
+
+const char *
+host_atom_n(const char *name, size_t n)
+{
+	struct host_atom *a, **bucket;
+	unsigned hash;
+	size_t i;
+
+	hash = atom_hash(name, n);
+	atom_lock();
+	if (natoms >= atom_table_size)
+		atom_table_grow();
+	bucket = &atom_table[hash & (atom_table_size - 1)];
+	for (a = *bucket; a; a = a->next) {
+		if (a->hash == hash &&
+		    !evutil_ascii_strncasecmp(a->name, name, n) &&
+		    a->name[n] == '\0') {
+			ref_add(&a->refcnt);
+			atom_unlock();
+			return a->name;
+		}
+	}
+
+	a = mem_malloc(sizeof(*a) + n + 1);
+	a->hash = hash;
+	a->refcnt = 1;
+	for (i = 0; i < n; i++)
+		a->name[i] = lower(name[i]);
+	a->name[n] = '\0';
+	a->next = *bucket;
+	*bucket = a;
+	natoms++;
+	atom_unlock();
+
+	return a->name;
+}
+
+const char *
+host_atom(const char *name)
+{
+	return host_atom_n(name, strlen(name));
+}
+
+const char *
+host_atom_ref(const char *atom)
+{
+	/* the caller's own reference keeps it from going away */
+	if (atom)
+		ref_add(&ATOM(atom)->refcnt);
+
+	return atom;
+}
+
+void
+host_atom_unref(const char *atom)
+{
+	struct host_atom *a, **p;
+
+	if (!atom)
+		return;
+
+	a = ATOM(atom);
+	atom_lock();
+	assert(count_get(&a->refcnt) > 0);
+	if (ref_sub(&a->refcnt)) {
+		atom_unlock();
+		return;
+	}
+
+	p = &atom_table[a->hash & (atom_table_size - 1)];
+	while (*p != a)
+		p = &(*p)->next;
+	*p = a->next;
+	natoms--;
+	atom_unlock();
+	mem_free(a);
+}
+
+size_t
+host_atom_count(void)
+{
+	size_t n;
+
+	atom_lock();
+	n = natoms;
+	atom_unlock();
+
+	return n;
+}
+
+/* libevent's own lines come from its allocator, which needn't be ours */
+char *
+mem_readln(struct evbuffer *buf)
+{
+	struct evbuffer_ptr eol;
+	size_t eol_len;
+	char *line;
+
+	eol = evbuffer_search_eol(buf, NULL, &eol_len, EVBUFFER_EOL_CRLF);
+	if (eol.pos < 0)
+		return NULL;
+
+	line = mem_malloc(eol.pos + 1);
+	evbuffer_remove(buf, line, eol.pos);
+	line[eol.pos] = '\0';
+	evbuffer_drain(buf, eol_len);
+
+	return line;
+}
+
 // tokenize a CONNECT host:port request
 struct url *
 url_connect_tokenize(const char *str)
@@ -158,7 +346,7 @@ url_connect_tokenize(const char *str)
 	if (port < 0)
 		goto fail;	
 
-	url->host = mem_strdup_n(str, p - str);
+	url->host = host_atom_n(str, p - str);
 	url->port = port;
 
 	return url;	
@@ -235,12 +423,11 @@ url_tokenize(const char *str)
 
 	url = mem_calloc(1, sizeof(*url));
 	url->scheme = scheme->token;
-	url->host = hostport->token;
+	url->host = host_atom(hostport->token);
 	url->port = port;
 	url->path = pathstr;
 
 	scheme->token = NULL;
-	hostport->token = NULL;
 
 out:
 	token_list_clear(&tokens);
@@ -255,7 +442,7 @@ url_free(struct url *url)
 		return;
 
 	mem_free(url->scheme);
-	mem_free(url->host);
+	host_atom_unref(url->host);
 	mem_free(url->path);
 	mem_free(url);
 }
@@ -303,6 +490,38 @@ socket_error_string(evutil_socket_t s)
 	return evutil_socket_error_to_string(evutil_socket_geterror(s));
 }
 
+/* is the other end of s on this machine? */
+int
+socket_peer_is_local(evutil_socket_t s)
+{
+	struct sockaddr_storage ss;
+	ev_socklen_t len = sizeof(ss);
+	const unsigned char *a;
+
+	if (getpeername(s, (struct sockaddr *)&ss, &len) < 0)
+		return 0;
+
+	switch (ss.ss_family) {
+	case AF_INET:
+		a = (const unsigned char *)
+		    &((struct sockaddr_in *)&ss)->sin_addr;
+		return a[0] == 127;
+	case AF_INET6:
+		a = ((struct sockaddr_in6 *)&ss)->sin6_addr.s6_addr;
+		/* ::1, or 127.x.x.x mapped as ::ffff:127.x.x.x */
+		if (!memcmp(a, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\1", 16))
+			return 1;
+		return !memcmp(a, "\0\0\0\0\0\0\0\0\0\0\xff\xff", 12) &&
+		       a[12] == 127;
+#ifndef WIN32
+	case AF_UNIX:
+		return 1;
+#endif
+	}
+
+	return 0;
+}
+
 #ifdef TEST_UTIL
 #include <stdio.h>
 #include <stdlib.h>
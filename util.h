@@ -10,6 +10,10 @@ char *mem_strdup(const char *str);
 char *mem_strdup_n(const char *str, size_t n);
 void mem_free(void *buf);
 
+struct evbuffer;
+/* evbuffer_readln() of a CRLF or LF line, into memory mem_free() takes */
+char *mem_readln(struct evbuffer *buf);
+
 struct token {
 	TAILQ_ENTRY(token) next;
 	char *token;
@@ -22,9 +26,19 @@ void token_list_clear(struct token_list *tokens);
 
 ev_int64_t get_int(const char *buf, int base);
 
+/* Host names are interned: each is kept once, lowercased, so two hosts
+   are the same if their pointers are. An atom reads as a plain string.
+   Atoms are counted; the table is shared by the whole process, and
+   safe to use from any thread. */
+const char *host_atom(const char *name);
+const char *host_atom_n(const char *name, size_t n);
+const char *host_atom_ref(const char *atom);
+void host_atom_unref(const char *atom);
+size_t host_atom_count(void);
+
 struct url {
 	char *scheme;
-	char *host;
+	const char *host;		/* an atom */
 	int port;
 	char *path;
 };
@@ -36,5 +50,6 @@ struct sockaddr;
 
 const char *format_addr(const struct sockaddr *addr);
 const char *socket_error_string(evutil_socket_t s);
+int socket_peer_is_local(evutil_socket_t s);
 
 #endif
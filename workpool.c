@@ -0,0 +1,485 @@
+#include "netheaders.h"
+
+#include <sys/queue.h>
+#include <assert.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+#include "config.h"
+#include "workpool.h"
+#include "util.h"
+#include "log.h"
+
+#ifdef HAVE_WORKER_THREADS
+#include <pthread.h>
+
+/* jobs a worker can have at once; the rest wait on the loop */
+#define RING_SIZE 64
+
+#define load_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define load_sc(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define store_sc(p, v)		__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define exchange_sc(p, v)	__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+/* orders a store before a later load of something else: the release
+   and acquire above don't, and a sleeper would miss its wakeup */
+#define full_fence()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+struct work_job {
+	TAILQ_ENTRY(work_job) next;	/* in its queue */
+	TAILQ_ENTRY(work_job) waiting;	/* for room in a worker's ring */
+	struct work_queue *q;
+	work_fn fn;
+	void *state;
+	int tag;
+	int result;
+	int done;
+	struct evbuffer *in;
+	struct evbuffer *out;
+};
+TAILQ_HEAD(work_job_list, work_job);
+
+/* one producer, one consumer. each index is only written by one side,
+   and kept on its own cache line. */
+struct ring {
+	struct work_job *slots[RING_SIZE];
+	unsigned head __attribute__((aligned(64)));
+	unsigned tail __attribute__((aligned(64)));
+};
+
+struct worker {
+	struct work_pool *pool;
+	pthread_t thread;
+	struct ring jobs;		/* loop to worker */
+	struct ring results;		/* worker to loop */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int sleeping;
+	/* loop side */
+	unsigned outstanding;		/* jobs in the rings or running */
+	struct work_job_list backlog;	/* jobs that didn't fit */
+	size_t nqueues;
+};
+
+struct work_queue {
+	struct work_pool *pool;
+	struct worker *worker;
+	struct work_job_list jobs;	/* in order */
+	size_t njobs;
+	work_done_fn done;
+	void *arg;
+	int dead;
+	int busy;			/* being delivered */
+};
+
+struct work_pool {
+	struct event_base *base;
+	struct worker *workers;
+	int nworkers;
+	int stop;
+	/* workers poke the loop through this when results are ready */
+	evutil_socket_t notify[2];
+	struct event *notify_ev;
+	int notified;
+	struct work_pool_stats stats;
+};
+
+static int
+ring_push(struct ring *r, struct work_job *job)
+{
+	unsigned tail = r->tail;
+
+	if (tail - load_acquire(&r->head) == RING_SIZE)
+		return -1;
+	r->slots[tail % RING_SIZE] = job;
+	store_release(&r->tail, tail + 1);
+
+	return 0;
+}
+
+static struct work_job *
+ring_pop(struct ring *r)
+{
+	unsigned head = r->head;
+	struct work_job *job;
+
+	if (head == load_acquire(&r->tail))
+		return NULL;
+	job = r->slots[head % RING_SIZE];
+	store_release(&r->head, head + 1);
+
+	return job;
+}
+
+static int
+ring_empty(struct ring *r)
+{
+	return load_sc(&r->head) == load_sc(&r->tail);
+}
+
+static void
+pool_notify(struct work_pool *pool)
+{
+	full_fence();
+	if (!exchange_sc(&pool->notified, 1))
+		send(pool->notify[1], "", 1, 0);
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct work_job *job;
+
+	while (!load_sc(&w->pool->stop)) {
+		job = ring_pop(&w->jobs);
+		if (!job) {
+			pthread_mutex_lock(&w->lock);
+			store_sc(&w->sleeping, 1);
+			full_fence();
+			while (ring_empty(&w->jobs) &&
+			       !load_sc(&w->pool->stop))
+				pthread_cond_wait(&w->wake, &w->lock);
+			store_sc(&w->sleeping, 0);
+			pthread_mutex_unlock(&w->lock);
+			continue;
+		}
+
+		job->result = job->fn(job->state, job->in, job->out);
+		/* can't be full: the loop keeps outstanding jobs to
+		   RING_SIZE */
+		ring_push(&w->results, job);
+		pool_notify(w->pool);
+	}
+
+	return NULL;
+}
+
+static void
+worker_wake(struct worker *w)
+{
+	full_fence();
+	if (load_sc(&w->sleeping)) {
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->wake);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+/* hand a worker as much of its backlog as fits */
+static void
+worker_feed(struct worker *w)
+{
+	struct work_job *job;
+	int fed = 0;
+
+	while ((job = TAILQ_FIRST(&w->backlog)) &&
+	       w->outstanding < RING_SIZE) {
+		TAILQ_REMOVE(&w->backlog, job, waiting);
+		ring_push(&w->jobs, job);
+		w->outstanding++;
+		fed = 1;
+	}
+	if (fed)
+		worker_wake(w);
+}
+
+static void
+queue_release(struct work_queue *q)
+{
+	q->worker->nqueues--;
+	q->pool->stats.nqueues--;
+	mem_free(q);
+}
+
+static void
+job_free(struct work_job *job)
+{
+	evbuffer_free(job->in);
+	evbuffer_free(job->out);
+	mem_free(job);
+}
+
+/* pass on whatever has come back at the front of the queue */
+static void
+queue_deliver(struct work_queue *q)
+{
+	struct work_job *job;
+
+	q->busy++;
+	while ((job = TAILQ_FIRST(&q->jobs)) && job->done) {
+		TAILQ_REMOVE(&q->jobs, job, next);
+		q->njobs--;
+		q->pool->stats.nbacklog--;
+		q->done(q->dead ? NULL : q->arg, job->state, job->tag,
+			job->out, job->result);
+		job_free(job);
+	}
+	q->busy--;
+
+	if (q->dead && !q->busy && TAILQ_EMPTY(&q->jobs))
+		queue_release(q);
+}
+
+static void
+pool_collect(struct work_pool *pool)
+{
+	struct work_job *job;
+	struct worker *w;
+	int i;
+
+	for (i = 0; i < pool->nworkers; ++i) {
+		w = &pool->workers[i];
+		while ((job = ring_pop(&w->results))) {
+			w->outstanding--;
+			job->done = 1;
+			pool->stats.njobs++;
+			pool->stats.nbytes_out +=
+				evbuffer_get_length(job->out);
+			queue_deliver(job->q);
+		}
+		worker_feed(w);
+	}
+}
+
+static void
+notify_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct work_pool *pool = arg;
+	char buf[64];
+
+	while (recv(fd, buf, sizeof(buf), 0) > 0)
+		;
+	/* before looking, so a result that comes in after still pokes */
+	store_sc(&pool->notified, 0);
+	full_fence();
+	pool_collect(pool);
+}
+
+struct work_pool *
+work_pool_new(struct event_base *base, int nthreads)
+{
+	struct work_pool *pool;
+	struct worker *w;
+	int i;
+
+	pool = mem_calloc(1, sizeof(*pool));
+	pool->base = base;
+	pool->workers = mem_calloc(nthreads, sizeof(*pool->workers));
+	pool->notify[0] = pool->notify[1] = -1;
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pool->notify) < 0) {
+		log_error("workpool: can't make a socket pair: %s",
+			  evutil_socket_error_to_string(
+				  EVUTIL_SOCKET_ERROR()));
+		work_pool_free(pool);
+		return NULL;
+	}
+	evutil_make_socket_nonblocking(pool->notify[0]);
+	evutil_make_socket_nonblocking(pool->notify[1]);
+	pool->notify_ev = event_new(base, pool->notify[0],
+				    EV_READ | EV_PERSIST, notify_cb, pool);
+	if (!pool->notify_ev)
+		log_fatal("workpool: failed to create event");
+	event_add(pool->notify_ev, NULL);
+
+	for (i = 0; i < nthreads; ++i) {
+		w = &pool->workers[i];
+		w->pool = pool;
+		TAILQ_INIT(&w->backlog);
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->wake, NULL);
+		if (pthread_create(&w->thread, NULL, worker_main, w)) {
+			log_error("workpool: can't start a worker thread");
+			pthread_mutex_destroy(&w->lock);
+			pthread_cond_destroy(&w->wake);
+			work_pool_free(pool);
+			return NULL;
+		}
+		pool->nworkers++;
+	}
+	pool->stats.nthreads = nthreads;
+
+	return pool;
+}
+
+void
+work_pool_free(struct work_pool *pool)
+{
+	struct work_job *job;
+	struct worker *w;
+	int i;
+
+	if (!pool)
+		return;
+
+	store_sc(&pool->stop, 1);
+	for (i = 0; i < pool->nworkers; ++i) {
+		w = &pool->workers[i];
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->wake);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+	}
+
+	/* what ran comes back as usual; the rest fails */
+	pool_collect(pool);
+	for (i = 0; i < pool->nworkers; ++i) {
+		w = &pool->workers[i];
+		while ((job = ring_pop(&w->jobs))) {
+			job->done = 1;
+			job->result = -1;
+			queue_deliver(job->q);
+		}
+		while ((job = TAILQ_FIRST(&w->backlog))) {
+			TAILQ_REMOVE(&w->backlog, job, waiting);
+			job->done = 1;
+			job->result = -1;
+			queue_deliver(job->q);
+		}
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->wake);
+	}
+
+	if (pool->notify_ev)
+		event_free(pool->notify_ev);
+	if (pool->notify[0] >= 0) {
+		evutil_closesocket(pool->notify[0]);
+		evutil_closesocket(pool->notify[1]);
+	}
+	mem_free(pool->workers);
+	mem_free(pool);
+}
+
+struct work_queue *
+work_queue_new(struct work_pool *pool, work_done_fn done, void *arg)
+{
+	struct work_queue *q;
+	struct worker *w;
+	int i;
+
+	/* the worker with the fewest queues */
+	w = &pool->workers[0];
+	for (i = 1; i < pool->nworkers; ++i) {
+		if (pool->workers[i].nqueues < w->nqueues)
+			w = &pool->workers[i];
+	}
+
+	q = mem_calloc(1, sizeof(*q));
+	q->pool = pool;
+	q->worker = w;
+	TAILQ_INIT(&q->jobs);
+	q->done = done;
+	q->arg = arg;
+	w->nqueues++;
+	pool->stats.nqueues++;
+
+	return q;
+}
+
+void
+work_queue_free(struct work_queue *q)
+{
+	if (!q)
+		return;
+
+	q->dead = 1;
+	if (!q->busy && TAILQ_EMPTY(&q->jobs))
+		queue_release(q);
+}
+
+void
+work_queue_add(struct work_queue *q, work_fn fn, void *state,
+	       struct evbuffer *in, int tag)
+{
+	struct work_job *job;
+	struct worker *w = q->worker;
+
+	assert(!q->dead);
+
+	job = mem_calloc(1, sizeof(*job));
+	job->q = q;
+	job->fn = fn;
+	job->state = state;
+	job->tag = tag;
+	job->in = evbuffer_new();
+	job->out = evbuffer_new();
+	if (in)
+		evbuffer_add_buffer(job->in, in);
+	TAILQ_INSERT_TAIL(&q->jobs, job, next);
+	q->njobs++;
+	q->pool->stats.nbacklog++;
+	q->pool->stats.nbytes_in += evbuffer_get_length(job->in);
+
+	if (!fn) {
+		evbuffer_add_buffer(job->out, job->in);
+		job->done = 1;
+		if (job == TAILQ_FIRST(&q->jobs))
+			queue_deliver(q);
+		return;
+	}
+
+	TAILQ_INSERT_TAIL(&w->backlog, job, waiting);
+	worker_feed(w);
+}
+
+size_t
+work_queue_length(struct work_queue *q)
+{
+	return q->njobs;
+}
+
+void
+work_pool_get_stats(struct work_pool *pool, struct work_pool_stats *stats)
+{
+	*stats = pool->stats;
+}
+
+#else
+
+struct work_pool *
+work_pool_new(struct event_base *base, int nthreads)
+{
+	log_error("workpool: shim was built without thread support");
+
+	return NULL;
+}
+
+void
+work_pool_free(struct work_pool *pool)
+{
+}
+
+struct work_queue *
+work_queue_new(struct work_pool *pool, work_done_fn done, void *arg)
+{
+	return NULL;
+}
+
+void
+work_queue_free(struct work_queue *q)
+{
+}
+
+void
+work_queue_add(struct work_queue *q, work_fn fn, void *state,
+	       struct evbuffer *in, int tag)
+{
+}
+
+size_t
+work_queue_length(struct work_queue *q)
+{
+	return 0;
+}
+
+void
+work_pool_get_stats(struct work_pool *pool, struct work_pool_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+#endif
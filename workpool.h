@@ -0,0 +1,58 @@
+#ifndef _WORKPOOL_H_
+#define _WORKPOOL_H_
+
+#include <event2/util.h>
+
+/* A fixed set of worker threads for CPU heavy work on bodies, so it
+   doesn't hold up the event loop and every other connection with it.
+   Work goes through a work queue. A queue sticks to one worker, which
+   runs its jobs one at a time in the order they were added, so a job
+   may use state the queue's earlier jobs left behind without locking.
+   Results come back to the loop, in the same order, through a done
+   callback. Jobs are handed to a worker and back through single
+   producer, single consumer rings; a lock is only taken to wake a
+   worker that ran out of work. */
+
+struct evbuffer;
+struct event_base;
+struct work_pool;
+struct work_queue;
+
+struct work_pool_stats {
+	size_t nthreads;
+	size_t nqueues;			/* open right now */
+	size_t nbacklog;		/* jobs waiting or running */
+	ev_uint64_t njobs;		/* jobs run */
+	ev_uint64_t nbytes_in;		/* ... the input they were given */
+	ev_uint64_t nbytes_out;		/* ... and what they made of it */
+};
+
+/* runs on a worker: transform in into out. -1 on error. */
+typedef int (*work_fn)(void *state, struct evbuffer *in,
+		       struct evbuffer *out);
+/* runs on the loop with a job's result. arg is NULL if the queue has
+   been freed since; only state and tag are still good then. */
+typedef void (*work_done_fn)(void *arg, void *state, int tag,
+			     struct evbuffer *out, int result);
+
+/* NULL if threads can't be started, or shim was built without them. */
+struct work_pool *work_pool_new(struct event_base *base, int nthreads);
+/* stops the workers. jobs still queued are done with result -1. */
+void work_pool_free(struct work_pool *pool);
+
+struct work_queue *work_queue_new(struct work_pool *pool, work_done_fn done,
+				  void *arg);
+/* jobs already added still run and come back, with arg NULL. */
+void work_queue_free(struct work_queue *q);
+
+/* run fn(state, in, out) after the queue's other jobs; what's in in is
+   taken. fn NULL passes in through as it is. tag is for the caller. */
+void work_queue_add(struct work_queue *q, work_fn fn, void *state,
+		    struct evbuffer *in, int tag);
+/* jobs added that haven't come back */
+size_t work_queue_length(struct work_queue *q);
+
+void work_pool_get_stats(struct work_pool *pool,
+			 struct work_pool_stats *stats);
+
+#endif